@@ -0,0 +1,458 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <sstream>
+
+#include "XrdMockBackend.h"
+
+using namespace XrdAdaptor::Mock;
+
+typedef Backend::Clock Clock;
+
+namespace {
+
+  Clock::duration
+  milliseconds(double ms)
+  {
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(ms));
+  }
+
+  XrdCl::XRootDStatus
+  errorStatus(uint16_t code, uint32_t errNo, const std::string &message)
+  {
+    return XrdCl::XRootDStatus(XrdCl::stError, code, errNo, message);
+  }
+
+  // Closes the descriptor once no handle or pending response uses it.
+  class LocalFile : boost::noncopyable {
+  public:
+    explicit LocalFile(int fd) : m_fd(fd) {}
+    ~LocalFile() {close(m_fd);}
+    int fd() const {return m_fd;}
+  private:
+    int m_fd;
+  };
+
+  /**
+   * A file opened at a simulated server.
+   */
+  class MockFile final : public XrdAdaptor::FileHandle {
+  public:
+    explicit MockFile(Backend &backend) : m_backend(backend), m_server(nullptr) {}
+
+    virtual XrdCl::XRootDStatus Open(const std::string &url, XrdCl::OpenFlags::Flags flags, XrdCl::Access::Mode) override
+    {
+      Clock::time_point when;
+      XrdCl::XRootDStatus status = open(url, flags, when);
+      std::this_thread::sleep_until(when);
+      return status;
+    }
+
+    virtual XrdCl::XRootDStatus Open(const std::string &url, XrdCl::OpenFlags::Flags flags, XrdCl::Access::Mode, XrdCl::ResponseHandler *handler) override
+    {
+      Clock::time_point when;
+      XrdCl::XRootDStatus status = open(url, flags, when);
+      // A server which is down refuses the connection before any request is sent.
+      if (!status.IsOK() && (status.errNo == ECONNREFUSED)) return status;
+      m_backend.schedule(when, [handler, status]() {
+        handler->HandleResponseWithHosts(new XrdCl::XRootDStatus(status), nullptr, new XrdCl::HostList());
+      });
+      return XrdCl::XRootDStatus();
+    }
+
+    virtual XrdCl::XRootDStatus Close() override
+    {
+      m_file.reset();
+      return XrdCl::XRootDStatus();
+    }
+
+    virtual XrdCl::XRootDStatus Stat(bool, XrdCl::StatInfo *&response) override
+    {
+      struct stat buf;
+      if (!m_file) return errorStatus(XrdCl::errInvalidArgs, EBADF, "file is not open");
+      if (fstat(m_file->fd(), &buf) == -1) return errorStatus(XrdCl::errOSError, errno, strerror(errno));
+      std::stringstream ss;
+      ss << "0 " << buf.st_size << " 0 " << buf.st_mtime;
+      response = new XrdCl::StatInfo(ss.str().c_str());
+      return XrdCl::XRootDStatus();
+    }
+
+    virtual XrdCl::XRootDStatus Read(uint64_t offset, uint32_t size, void *buffer, XrdCl::ResponseHandler *handler) override
+    {
+      XrdCl::ChunkList chunks;
+      chunks.emplace_back(XrdCl::ChunkInfo(offset, size, buffer));
+      return submit(chunks, handler, false);
+    }
+
+    virtual XrdCl::XRootDStatus VectorRead(const XrdCl::ChunkList &chunks, void *buffer, XrdCl::ResponseHandler *handler) override
+    {
+      XrdCl::ChunkList copy(chunks);
+      // As with XrdCl, chunks without a buffer are read consecutively into buffer.
+      char *next = static_cast<char*>(buffer);
+      for (auto & chunk : copy)
+      {
+        if (chunk.buffer) continue;
+        if (!next) return errorStatus(XrdCl::errInvalidArgs, EINVAL, "no buffer for chunk");
+        chunk.buffer = next;
+        next += chunk.length;
+      }
+      return submit(copy, handler, true);
+    }
+
+    virtual XrdCl::XRootDStatus Write(uint64_t offset, uint32_t size, const void *buffer) override
+    {
+      if (!m_file) return errorStatus(XrdCl::errInvalidArgs, EBADF, "file is not open");
+      bool failed;
+      std::this_thread::sleep_until(m_server->transfer(size, failed));
+      return write(*m_file, offset, size, buffer, failed, m_server->config().m_name);
+    }
+
+    virtual XrdCl::XRootDStatus Write(uint64_t offset, uint32_t size, const void *buffer, XrdCl::ResponseHandler *handler) override
+    {
+      if (!m_file) return errorStatus(XrdCl::errInvalidArgs, EBADF, "file is not open");
+      bool failed;
+      Clock::time_point when = m_server->transfer(size, failed);
+      std::shared_ptr<LocalFile> file = m_file;
+      std::string name = m_server->config().m_name;
+      m_backend.schedule(when, [file, offset, size, buffer, handler, failed, name]() {
+        handler->HandleResponse(new XrdCl::XRootDStatus(write(*file, offset, size, buffer, failed, name)), nullptr);
+      });
+      return XrdCl::XRootDStatus();
+    }
+
+    virtual XrdCl::XRootDStatus Locate(const std::string &, std::vector<std::string> &servers) override
+    {
+      std::this_thread::sleep_until(m_backend.locate(servers));
+      return XrdCl::XRootDStatus();
+    }
+
+    virtual std::string GetDataServer() override
+    {
+      return m_server ? m_server->config().m_name + ":1094" : "";
+    }
+
+  private:
+    static XrdCl::XRootDStatus write(const LocalFile &file, uint64_t offset, uint32_t size, const void *buffer, bool failed, const std::string &name)
+    {
+      if (failed) return errorStatus(XrdCl::errErrorResponse, EIO, "simulated write failure at " + name);
+      ssize_t result = pwrite(file.fd(), buffer, size, offset);
+      if (result < 0) return errorStatus(XrdCl::errOSError, errno, strerror(errno));
+      if (result != static_cast<ssize_t>(size)) return errorStatus(XrdCl::errOSError, EIO, "short write");
+      return XrdCl::XRootDStatus();
+    }
+
+    XrdCl::XRootDStatus open(const std::string &url, XrdCl::OpenFlags::Flags flags, Clock::time_point &when)
+    {
+      when = Clock::now();
+      m_server = m_backend.pickServer(url);
+      if (!m_server) return errorStatus(XrdCl::errErrorResponse, ENOENT, "no more servers hold " + url);
+      if (m_server->down()) return errorStatus(XrdCl::errErrorResponse, ECONNREFUSED, "simulated server " + m_server->config().m_name + " is down");
+      bool failed;
+      when = m_server->transfer(0, failed);
+      if (failed) return errorStatus(XrdCl::errErrorResponse, EIO, "simulated open failure at " + m_server->config().m_name);
+
+      // root://host//path?opaque - the path starts after the host.
+      std::string path = url;
+      size_t pos = path.find("://");
+      if (pos != std::string::npos)
+      {
+        pos = path.find('/', pos + 3);
+        path = (pos == std::string::npos) ? "" : path.substr(pos);
+      }
+      path = path.substr(0, path.find('?'));
+      while ((path.size() > 1) && (path[1] == '/')) path.erase(0, 1);
+
+      int mode = (flags & (XrdCl::OpenFlags::Update | XrdCl::OpenFlags::New)) ? O_RDWR : O_RDONLY;
+      if (flags & XrdCl::OpenFlags::New) mode |= O_CREAT;
+      if (flags & XrdCl::OpenFlags::Delete) mode |= O_TRUNC;
+      int fd = ::open(path.c_str(), mode, 0644);
+      if (fd == -1) return errorStatus(XrdCl::errErrorResponse, errno, "unable to open " + path + ": " + strerror(errno));
+      m_file.reset(new LocalFile(fd));
+      return XrdCl::XRootDStatus();
+    }
+
+    XrdCl::XRootDStatus submit(const XrdCl::ChunkList &chunks, XrdCl::ResponseHandler *handler, bool vector)
+    {
+      if (!m_file) return errorStatus(XrdCl::errInvalidArgs, EBADF, "file is not open");
+      size_t bytes = 0;
+      for (const auto & chunk : chunks) bytes += chunk.length;
+      bool failed;
+      Clock::time_point when = m_server->transfer(bytes, failed);
+      std::shared_ptr<LocalFile> file = m_file;
+      std::string name = m_server->config().m_name;
+      m_backend.schedule(when, [file, chunks, handler, vector, failed, name]() {
+        if (failed)
+        {
+          handler->HandleResponse(new XrdCl::XRootDStatus(errorStatus(XrdCl::errErrorResponse, EIO, "simulated read failure at " + name)), nullptr);
+          return;
+        }
+        uint32_t total = 0;
+        for (const auto & chunk : chunks)
+        {
+          ssize_t result = pread(file->fd(), chunk.buffer, chunk.length, chunk.offset);
+          if (result < 0)
+          {
+            handler->HandleResponse(new XrdCl::XRootDStatus(errorStatus(XrdCl::errOSError, errno, strerror(errno))), nullptr);
+            return;
+          }
+          total += result;
+        }
+        XrdCl::AnyObject *response = new XrdCl::AnyObject();
+        if (vector)
+        {
+          XrdCl::VectorReadInfo *info = new XrdCl::VectorReadInfo();
+          info->SetSize(total);
+          info->GetChunks() = chunks;
+          response->Set(info);
+        }
+        else
+        {
+          response->Set(new XrdCl::ChunkInfo(chunks[0].offset, total, chunks[0].buffer));
+        }
+        handler->HandleResponse(new XrdCl::XRootDStatus(), response);
+      });
+      return XrdCl::XRootDStatus();
+    }
+
+    Backend &m_backend;
+    Backend::Server *m_server;
+    std::shared_ptr<LocalFile> m_file;
+  };
+
+  bool
+  parseDouble(const std::string &value, double &result)
+  {
+    char *end;
+    result = strtod(value.c_str(), &end);
+    return !value.empty() && (*end == '\0');
+  }
+}
+
+bool
+XrdAdaptor::Mock::parseServers(const std::string &spec, std::vector<ServerConfig> &servers, std::string &error)
+{
+    std::stringstream specs(spec);
+    std::string entry;
+    while (std::getline(specs, entry, ';'))
+    {
+        if (entry.empty()) continue;
+        ServerConfig config;
+        size_t colon = entry.find(':');
+        config.m_name = entry.substr(0, colon);
+        if (config.m_name.empty())
+        {
+            error = "server with no name in '" + entry + "'";
+            return false;
+        }
+        std::stringstream settings(colon == std::string::npos ? "" : entry.substr(colon + 1));
+        std::string setting;
+        while (std::getline(settings, setting, ','))
+        {
+            size_t equals = setting.find('=');
+            std::string key = setting.substr(0, equals);
+            double value;
+            if ((equals == std::string::npos) || !parseDouble(setting.substr(equals + 1), value))
+            {
+                error = "invalid setting '" + setting + "' for server " + config.m_name;
+                return false;
+            }
+            if (key == "latency") config.m_latency_ms = value;
+            else if (key == "jitter") config.m_jitter_ms = value;
+            else if (key == "bandwidth") config.m_bandwidth_mbs = value;
+            else if (key == "errors") config.m_error_rate = value;
+            else if (key == "degrade_after") config.m_degrade_after_s = value;
+            else if (key == "degrade_factor") config.m_degrade_factor = value;
+            else if (key == "down_after") config.m_down_after_s = value;
+            else
+            {
+                error = "unknown setting '" + key + "' for server " + config.m_name;
+                return false;
+            }
+        }
+        if (config.m_bandwidth_mbs <= 0 || config.m_degrade_factor <= 0)
+        {
+            error = "bandwidth and degrade_factor must be positive for server " + config.m_name;
+            return false;
+        }
+        servers.push_back(config);
+    }
+    if (servers.empty())
+    {
+        error = "no servers given";
+        return false;
+    }
+    return true;
+}
+
+Backend::Server::Server(const ServerConfig &config, Clock::time_point start, unsigned long long seed)
+    : m_config(config),
+      m_start(start),
+      m_busy_until(start),
+      m_generator(seed),
+      m_uniform(0, 1)
+{
+}
+
+Clock::time_point
+Backend::Server::transfer(size_t bytes, bool &failed)
+{
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    Clock::time_point now = Clock::now();
+    double latency = m_config.m_latency_ms;
+    double bandwidth = m_config.m_bandwidth_mbs;
+    if ((m_config.m_degrade_after_s >= 0) && (now - m_start >= milliseconds(1000*m_config.m_degrade_after_s)))
+    {
+        latency *= m_config.m_degrade_factor;
+        bandwidth /= m_config.m_degrade_factor;
+    }
+    double jitter = m_config.m_jitter_ms * m_uniform(m_generator);
+    failed = (m_uniform(m_generator) < m_config.m_error_rate) || down();
+
+    // The request reaches the server after half the round trip and then
+    // waits for the link; the response takes the other half to return.
+    Clock::time_point begin = std::max(now + milliseconds(latency/2), m_busy_until);
+    m_busy_until = begin + milliseconds(1000*static_cast<double>(bytes)/(bandwidth*1024*1024));
+    return m_busy_until + milliseconds(latency/2 + jitter);
+}
+
+bool
+Backend::Server::down() const
+{
+    return (m_config.m_down_after_s >= 0) && (Clock::now() - m_start >= milliseconds(1000*m_config.m_down_after_s));
+}
+
+Backend::Backend(const std::vector<ServerConfig> &servers, unsigned long long seed, unsigned threads)
+    : m_start(Clock::now()),
+      m_sequence(0),
+      m_running(0),
+      m_stop(false)
+{
+    for (const auto & config : servers)
+    {
+        m_servers.emplace_back(new Server(config, m_start, seed++));
+    }
+    for (unsigned idx = 0; idx < threads; idx++)
+    {
+        m_threads.emplace_back(&Backend::run, this);
+    }
+}
+
+Backend::~Backend()
+{
+    {
+        std::lock_guard<std::mutex> sentry(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    for (auto & thread : m_threads) thread.join();
+    FileHandle::setFactory(FileHandle::Factory());
+}
+
+void
+Backend::install()
+{
+    FileHandle::setFactory([this]() {return createFile();});
+}
+
+std::unique_ptr<XrdAdaptor::FileHandle>
+Backend::createFile()
+{
+    return std::unique_ptr<FileHandle>(new MockFile(*this));
+}
+
+Clock::time_point
+Backend::locate(std::vector<std::string> &servers)
+{
+    for (const auto & server : m_servers)
+    {
+        servers.push_back(server->config().m_name + ":1094");
+    }
+    // The redirector answers after one round trip to the first server.
+    return Clock::now() + milliseconds(m_servers.front()->config().m_latency_ms);
+}
+
+Backend::Server *
+Backend::pickServer(const std::string &url)
+{
+    // A URL naming one of the servers directly is opened there.
+    size_t host = url.find("://");
+    if (host != std::string::npos)
+    {
+        host += 3;
+        std::string name = url.substr(host, url.find('/', host) - host);
+        name = name.substr(0, name.find(':'));
+        for (const auto & server : m_servers)
+        {
+            if (server->config().m_name == name) return server.get();
+        }
+    }
+    std::string tried;
+    size_t pos = url.find("tried=");
+    if (pos != std::string::npos)
+    {
+        tried = url.substr(pos + 6);
+        tried = "," + tried.substr(0, tried.find('&')) + ",";
+    }
+    for (const auto & server : m_servers)
+    {
+        if (tried.find("," + server->config().m_name + ",") == std::string::npos)
+        {
+            return server.get();
+        }
+    }
+    return nullptr;
+}
+
+void
+Backend::schedule(Clock::time_point when, std::function<void()> callback)
+{
+    {
+        std::lock_guard<std::mutex> sentry(m_mutex);
+        m_events.push(Event{when, m_sequence++, callback});
+    }
+    m_cv.notify_one();
+}
+
+void
+Backend::drain()
+{
+    std::unique_lock<std::mutex> sentry(m_mutex);
+    m_idle.wait(sentry, [this]() {return m_events.empty() && !m_running;});
+}
+
+void
+Backend::run()
+{
+    std::unique_lock<std::mutex> sentry(m_mutex);
+    while (!m_stop)
+    {
+        if (m_events.empty())
+        {
+            m_cv.wait(sentry);
+            continue;
+        }
+        Clock::time_point when = m_events.top().m_when;
+        if (Clock::now() < when)
+        {
+            m_cv.wait_until(sentry, when);
+            continue;
+        }
+        std::function<void()> callback = m_events.top().m_callback;
+        m_events.pop();
+        // Another event may now be due for a different thread.
+        m_cv.notify_one();
+        m_running++;
+        sentry.unlock();
+        callback();
+        // Release whatever the callback captured before counting it done.
+        callback = nullptr;
+        sentry.lock();
+        if (!--m_running && m_events.empty()) m_idle.notify_all();
+    }
+}
@@ -0,0 +1,174 @@
+#ifndef Utilities_XrdAdaptor_XrdMockBackend_h
+#define Utilities_XrdAdaptor_XrdMockBackend_h
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/utility.hpp>
+
+#include "Utilities/XrdAdaptor/src/XrdFileHandle.h"
+
+namespace XrdAdaptor {
+namespace Mock {
+
+/**
+ * The behavior of one simulated data server.
+ */
+struct ServerConfig {
+    // Reported as the data server, so must be unique.
+    std::string m_name;
+    // Round-trip time of every request.
+    double m_latency_ms = 20;
+    // Each response is delayed by an extra uniform [0, jitter) ms.
+    double m_jitter_ms = 0;
+    // Transfers from the server are serialized at this rate.
+    double m_bandwidth_mbs = 100;
+    // Probability that any single request fails.
+    double m_error_rate = 0;
+    // Seconds after the backend starts at which the server degrades (never,
+    // if negative); it then has factor times the latency and 1/factor the
+    // bandwidth.
+    double m_degrade_after_s = -1;
+    double m_degrade_factor = 1;
+    // Seconds after the backend starts at which the server goes down (never,
+    // if negative); every request then fails, and opens are refused at once.
+    double m_down_after_s = -1;
+};
+
+/**
+ * Parse a list of servers of the form
+ *   name[:key=value[,key=value...]][;name...]
+ * where the keys are latency, jitter, bandwidth, errors, degrade_after,
+ * degrade_factor and down_after (see ServerConfig).  Returns false, setting error, if the
+ * specification is invalid.
+ */
+bool parseServers(const std::string &spec, std::vector<ServerConfig> &servers, std::string &error);
+
+/**
+ * An in-process stand-in for a redirector and its data servers.
+ *
+ * Once installed, every file the adaptor opens is served from local disk:
+ * the path of the URL is opened locally (for writing too, if so requested),
+ * at the server named by the URL's host or else at the first configured
+ * server not excluded by the URL's tried= list.  Every server is reported
+ * as holding a replica of every file.  Responses are delivered from a pool of
+ * callback threads, like those of XrdCl, after the delay the server's
+ * configuration implies.  The random draws for jitter and errors are seeded,
+ * so a run is repeatable up to thread scheduling.
+ */
+class Backend : boost::noncopyable {
+
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    class Server;
+
+    Backend(const std::vector<ServerConfig> &servers, unsigned long long seed, unsigned threads = 4);
+
+    /**
+     * Stops the callback threads; all files must have been closed.
+     */
+    ~Backend();
+
+    /**
+     * Make FileHandle::create return files served by this backend.
+     */
+    void install();
+
+    /**
+     * A new, unopened file served by this backend.
+     */
+    std::unique_ptr<FileHandle> createFile();
+
+    /**
+     * List every server as a replica; returns when the answer arrives.
+     */
+    Clock::time_point locate(std::vector<std::string> &servers);
+
+    /**
+     * Find the server to open url at: the one named as the URL's host, if
+     * any, or else the first not excluded by tried=.  Returns nullptr if
+     * all are excluded.
+     */
+    Server *pickServer(const std::string &url);
+
+    /**
+     * Run callback on a callback thread at the given time.
+     */
+    void schedule(Clock::time_point when, std::function<void()> callback);
+
+    /**
+     * Wait until every scheduled callback has run, including responses
+     * which arrive after their file was closed.
+     */
+    void drain();
+
+    Clock::time_point start() const {return m_start;}
+
+private:
+    struct Event {
+        Clock::time_point m_when;
+        unsigned long long m_sequence;
+        std::function<void()> m_callback;
+
+        // Earliest first; ties in order of scheduling.
+        bool operator<(const Event &other) const
+        {
+            return (m_when != other.m_when) ? (m_when > other.m_when) : (m_sequence > other.m_sequence);
+        }
+    };
+
+    void run();
+
+    const Clock::time_point m_start;
+    std::vector<std::unique_ptr<Server> > m_servers;
+
+    std::priority_queue<Event> m_events;
+    unsigned long long m_sequence;
+    // Callbacks currently running.
+    unsigned m_running;
+    bool m_stop;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::condition_variable m_idle;
+    std::vector<std::thread> m_threads;
+};
+
+class Backend::Server : boost::noncopyable {
+
+public:
+    Server(const ServerConfig &config, Clock::time_point start, unsigned long long seed);
+
+    /**
+     * Account for a request transferring the given number of bytes.
+     * Returns when the response arrives at the client, and sets failed if
+     * the request is to fail.
+     */
+    Clock::time_point transfer(size_t bytes, bool &failed);
+
+    bool down() const;
+
+    const ServerConfig &config() const {return m_config;}
+
+private:
+    const ServerConfig m_config;
+    const Clock::time_point m_start;
+    // When the server's link is next free.
+    Clock::time_point m_busy_until;
+    std::mt19937_64 m_generator;
+    std::uniform_real_distribution<double> m_uniform;
+    std::mutex m_mutex;
+};
+
+}
+}
+
+#endif
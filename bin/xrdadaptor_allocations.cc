@@ -0,0 +1,309 @@
+/*
+ * Counts the heap allocations the adaptor makes per read, once its pools
+ * have warmed up, against a simulated server (see XrdMockBackend.h).
+ *
+ * Only the adaptor's own allocations are counted: those made while issuing
+ * a read and while handling its response.  What the simulated server
+ * allocates stands for XrdCl's own work, which is outside our control, and
+ * is excluded by wrapping each file handle and response handler.
+ *
+ * Example:
+ *   xrdadaptor_allocations --file /tmp/data.root --pattern readv --chunks 64
+ *
+ * With several servers, and XRD_ADAPTOR_LOCATE_SOURCES set so that they
+ * are all opened, reads are split and hedged between them:
+ *   XRD_ADAPTOR_LOCATE_SOURCES=2 xrdadaptor_allocations --file /tmp/data.root \
+ *     --servers "a:latency=0,bandwidth=100000;b:latency=0,bandwidth=100000"
+ */
+
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Utilities/XrdAdaptor/src/XrdFile.h"
+#include "XrdMockBackend.h"
+
+using namespace XrdAdaptor;
+
+namespace {
+
+  std::atomic<unsigned long long> g_allocations(0);
+  // Whether this thread is running adaptor code on behalf of a read.
+  thread_local bool t_counting = false;
+
+  // Sets whether allocations are counted until the end of the scope.
+  class Counting {
+  public:
+    explicit Counting(bool counting) : m_previous(t_counting) {t_counting = counting;}
+    ~Counting() {t_counting = m_previous;}
+  private:
+    bool m_previous;
+  };
+
+  /**
+   * Counts the allocations of the adaptor's response handling.
+   */
+  class CountedHandler final : public XrdCl::ResponseHandler {
+  public:
+    explicit CountedHandler(XrdCl::ResponseHandler *handler) : m_handler(handler) {}
+
+    virtual void HandleResponseWithHosts(XrdCl::XRootDStatus *status, XrdCl::AnyObject *response, XrdCl::HostList *hosts) override
+    {
+      XrdCl::ResponseHandler *handler = m_handler;
+      {
+        Counting counting(false);
+        delete this;
+      }
+      Counting counting(true);
+      handler->HandleResponseWithHosts(status, response, hosts);
+    }
+
+    virtual void HandleResponse(XrdCl::XRootDStatus *status, XrdCl::AnyObject *response) override
+    {
+      XrdCl::ResponseHandler *handler = m_handler;
+      {
+        Counting counting(false);
+        delete this;
+      }
+      Counting counting(true);
+      handler->HandleResponse(status, response);
+    }
+
+  private:
+    XrdCl::ResponseHandler *m_handler;
+  };
+
+  /**
+   * Excludes the simulated server's allocations, and counts those of the
+   * responses it delivers.
+   */
+  class CountedFile final : public FileHandle {
+  public:
+    explicit CountedFile(std::unique_ptr<FileHandle> file) : m_file(std::move(file)) {}
+
+    virtual XrdCl::XRootDStatus Open(const std::string &url, XrdCl::OpenFlags::Flags flags, XrdCl::Access::Mode mode) override
+    {
+      Counting counting(false);
+      return m_file->Open(url, flags, mode);
+    }
+    virtual XrdCl::XRootDStatus Open(const std::string &url, XrdCl::OpenFlags::Flags flags, XrdCl::Access::Mode mode, XrdCl::ResponseHandler *handler) override
+    {
+      Counting counting(false);
+      return m_file->Open(url, flags, mode, new CountedHandler(handler));
+    }
+    virtual XrdCl::XRootDStatus Close() override
+    {
+      Counting counting(false);
+      return m_file->Close();
+    }
+    virtual XrdCl::XRootDStatus Stat(bool force, XrdCl::StatInfo *&response) override
+    {
+      Counting counting(false);
+      return m_file->Stat(force, response);
+    }
+    virtual XrdCl::XRootDStatus Read(uint64_t offset, uint32_t size, void *buffer, XrdCl::ResponseHandler *handler) override
+    {
+      Counting counting(false);
+      return m_file->Read(offset, size, buffer, new CountedHandler(handler));
+    }
+    virtual XrdCl::XRootDStatus VectorRead(const XrdCl::ChunkList &chunks, void *buffer, XrdCl::ResponseHandler *handler) override
+    {
+      Counting counting(false);
+      return m_file->VectorRead(chunks, buffer, new CountedHandler(handler));
+    }
+    virtual XrdCl::XRootDStatus Write(uint64_t offset, uint32_t size, const void *buffer) override
+    {
+      Counting counting(false);
+      return m_file->Write(offset, size, buffer);
+    }
+    virtual XrdCl::XRootDStatus Write(uint64_t offset, uint32_t size, const void *buffer, XrdCl::ResponseHandler *handler) override
+    {
+      Counting counting(false);
+      return m_file->Write(offset, size, buffer, new CountedHandler(handler));
+    }
+    virtual XrdCl::XRootDStatus Locate(const std::string &url, std::vector<std::string> &servers) override
+    {
+      Counting counting(false);
+      return m_file->Locate(url, servers);
+    }
+    virtual std::string GetDataServer() override
+    {
+      Counting counting(false);
+      return m_file->GetDataServer();
+    }
+
+  private:
+    std::unique_ptr<FileHandle> m_file;
+  };
+
+  struct Options {
+    std::string m_file;
+    // A single fast server: the interest is in the client's overhead.
+    std::string m_servers = "server:latency=0,bandwidth=100000";
+    std::string m_pattern = "readv";
+    unsigned m_reads = 1000;
+    unsigned m_warmup = 100;
+    IOSize m_size = 16*1024;
+    unsigned m_chunks = 32;
+    unsigned long long m_seed = 1;
+  };
+
+  void
+  usage(const char *argv0)
+  {
+    std::cerr << "Usage: " << argv0 << " --file PATH [options]\n"
+      << "  --servers SPEC   simulated servers, as for xrdadaptor_benchmark\n"
+      << "  --pattern P      read (single ranges), readv (chunks far apart) or\n"
+      << "                   coalesced (chunks close enough to be merged)\n"
+      << "  --reads N        number of reads to count\n"
+      << "  --warmup N       reads to issue before counting\n"
+      << "  --size BYTES     bytes per range\n"
+      << "  --chunks K       ranges per vector read\n"
+      << "  --seed S         seed for the offsets\n";
+  }
+
+  /**
+   * Fill chunks with the next read of the pattern, pointing into buffer.
+   */
+  void
+  nextRead(const Options &options, IOOffset file_size, std::mt19937_64 &generator, char *buffer, std::vector<IOPosBuffer> &chunks)
+  {
+    chunks.clear();
+    unsigned count = (options.m_pattern == "read") ? 1 : options.m_chunks;
+    // Coalesced chunks are 1KB apart, well within the default gap; the
+    // others are 64KB apart, so are sent as they are.
+    IOOffset stride = options.m_size + ((options.m_pattern == "coalesced") ? 1024 : 64*1024);
+    IOOffset extent = stride * count;
+    std::uniform_int_distribution<IOOffset> offset(0, std::max<IOOffset>(file_size - extent, 0));
+    IOOffset start = offset(generator);
+    for (unsigned idx = 0; idx < count; idx++)
+    {
+      chunks.push_back(IOPosBuffer(start + idx*stride, buffer + idx*options.m_size, options.m_size));
+    }
+  }
+}
+
+// Out of line, so the compiler does not pair the malloc and free below
+// with new and delete expressions at their call sites.
+__attribute__((noinline)) void *
+operator new(size_t size)
+{
+  if (t_counting) g_allocations.fetch_add(1, std::memory_order_relaxed);
+  void *ptr = malloc(size ? size : 1);
+  if (!ptr) throw std::bad_alloc();
+  return ptr;
+}
+
+__attribute__((noinline)) void
+operator delete(void *ptr) noexcept
+{
+  free(ptr);
+}
+
+__attribute__((noinline)) void
+operator delete(void *ptr, size_t) noexcept
+{
+  free(ptr);
+}
+
+int
+main(int argc, char *argv[])
+{
+    Options options;
+    static struct option long_options[] = {
+        {"file", required_argument, nullptr, 'f'},
+        {"servers", required_argument, nullptr, 's'},
+        {"pattern", required_argument, nullptr, 'p'},
+        {"reads", required_argument, nullptr, 'n'},
+        {"warmup", required_argument, nullptr, 'w'},
+        {"size", required_argument, nullptr, 'b'},
+        {"chunks", required_argument, nullptr, 'k'},
+        {"seed", required_argument, nullptr, 'r'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'f': options.m_file = optarg; break;
+        case 's': options.m_servers = optarg; break;
+        case 'p': options.m_pattern = optarg; break;
+        case 'n': options.m_reads = std::max(1ul, strtoul(optarg, nullptr, 10)); break;
+        case 'w': options.m_warmup = strtoul(optarg, nullptr, 10); break;
+        case 'b': options.m_size = std::max(1ul, strtoul(optarg, nullptr, 10)); break;
+        case 'k': options.m_chunks = std::max(1ul, strtoul(optarg, nullptr, 10)); break;
+        case 'r': options.m_seed = strtoull(optarg, nullptr, 10); break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (options.m_file.empty() || (options.m_pattern != "read" && options.m_pattern != "readv" && options.m_pattern != "coalesced"))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    std::vector<Mock::ServerConfig> servers;
+    std::string error;
+    if (!Mock::parseServers(options.m_servers, servers, error))
+    {
+        std::cerr << "Invalid --servers: " << error << std::endl;
+        return 1;
+    }
+    struct stat buf;
+    if ((stat(options.m_file.c_str(), &buf) == -1) || (buf.st_size == 0))
+    {
+        std::cerr << "Cannot use " << options.m_file << " as input: it must exist and be non-empty." << std::endl;
+        return 1;
+    }
+
+    Mock::Backend backend(servers, options.m_seed);
+    FileHandle::setFactory([&backend]() -> std::unique_ptr<FileHandle> {
+        return std::unique_ptr<FileHandle>(new CountedFile(backend.createFile()));
+    });
+
+    unsigned long long count = 0;
+    try
+    {
+        XrdFile file("root://mock/" + options.m_file);
+        std::mt19937_64 generator(options.m_seed);
+        std::vector<char> buffer(static_cast<size_t>(options.m_size) * options.m_chunks);
+        std::vector<IOPosBuffer> chunks;
+        chunks.reserve(options.m_chunks);
+        for (unsigned idx = 0; idx < options.m_warmup + options.m_reads; idx++)
+        {
+            nextRead(options, buf.st_size, generator, &buffer[0], chunks);
+            unsigned long long start = g_allocations.load();
+            {
+                Counting counting(true);
+                std::future<IOSize> future = (chunks.size() == 1)
+                    ? file.readAsync(chunks[0].data(), chunks[0].size(), chunks[0].offset())
+                    : file.readvAsync(&chunks[0], chunks.size());
+                future.get();
+            }
+            // The callback thread may still be finishing with the response.
+            backend.drain();
+            if (idx >= options.m_warmup) count += g_allocations.load() - start;
+        }
+        file.close();
+    }
+    catch (cms::Exception &ex)
+    {
+        std::cerr << "Benchmark aborted: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    std::cout << std::fixed << std::setprecision(2)
+      << "pattern " << options.m_pattern << ", " << options.m_reads << " reads after " << options.m_warmup << " to warm up\n"
+      << "allocations per read  " << static_cast<double>(count) / options.m_reads << std::endl;
+    return 0;
+}
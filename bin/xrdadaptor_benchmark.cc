@@ -0,0 +1,358 @@
+/*
+ * Runs standard access patterns through XrdFile against simulated servers
+ * (see XrdMockBackend.h), and reports the throughput and latency.
+ *
+ * Example:
+ *   xrdadaptor_benchmark --file /tmp/data.root \
+ *     --servers "fast:latency=10,bandwidth=100;slow:latency=80,bandwidth=10,degrade_after=5,degrade_factor=4" \
+ *     --pattern readv --reads 2000
+ *
+ * With --threads, several readers share the file, which stresses the
+ * lock-free read path that picks and submits to the sources:
+ *   xrdadaptor_benchmark --file /tmp/data.root --servers "a:latency=0;b:latency=0" \
+ *     --pattern random --size 4096 --reads 20000 --depth 8 --threads 16
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Utilities/XrdAdaptor/src/XrdFile.h"
+#include "XrdMockBackend.h"
+
+using namespace XrdAdaptor;
+
+namespace {
+
+  typedef std::chrono::steady_clock Clock;
+
+  struct Options {
+    std::string m_file;
+    std::string m_servers = "server1:latency=20,bandwidth=50;server2:latency=40,bandwidth=25";
+    std::string m_pattern = "readv";
+    unsigned m_reads = 1000;
+    IOSize m_size = 256*1024;
+    unsigned m_chunks = 64;
+    unsigned m_depth = 1;
+    unsigned m_threads = 1;
+    unsigned long long m_seed = 1;
+    bool m_verify = false;
+  };
+
+  // One read of the pattern: a single range, or several for a vector read.
+  struct Operation {
+    std::vector<IOPosBuffer> m_chunks;
+    IOSize m_bytes;
+  };
+
+  // Compare the data read against the local file.
+  bool
+  verify(int fd, const std::vector<IOPosBuffer> &chunks)
+  {
+    std::vector<char> expected;
+    for (const auto & chunk : chunks)
+    {
+      expected.resize(chunk.size());
+      if ((pread(fd, &expected[0], chunk.size(), chunk.offset()) != static_cast<ssize_t>(chunk.size()))
+          || memcmp(&expected[0], chunk.data(), chunk.size()))
+      {
+        std::cerr << "Data mismatch for " << chunk.size() << " bytes at offset " << chunk.offset() << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void
+  usage(const char *argv0)
+  {
+    std::cerr << "Usage: " << argv0 << " --file PATH [options]\n"
+      << "  --servers SPEC   simulated servers, name[:key=value,...][;...]; keys are\n"
+      << "                   latency, jitter (ms), bandwidth (MB/s), errors (probability),\n"
+      << "                   degrade_after (s), degrade_factor and down_after (s)\n"
+      << "  --pattern P      sequential, readv (TTreeCache-style) or random\n"
+      << "  --reads N        number of reads to issue\n"
+      << "  --size BYTES     bytes per read\n"
+      << "  --chunks K       chunks per vector read\n"
+      << "  --depth D        reads outstanding at once, per thread\n"
+      << "  --threads T      threads reading the file concurrently, each issuing\n"
+      << "                   --reads reads with its own seed\n"
+      << "  --seed S         seed for the access pattern and the servers\n"
+      << "  --verify         check the data read against the local file\n";
+  }
+
+  /**
+   * Generates the reads for a pattern.  Buffers point into a single arena,
+   * with one slot per outstanding read.
+   */
+  class Pattern {
+  public:
+    Pattern(const Options &options, IOOffset file_size)
+      : m_options(options),
+        m_file_size(file_size),
+        m_offset(0),
+        m_generator(options.m_seed)
+    {}
+
+    void next(char *buffer, Operation &op)
+    {
+      IOSize size = std::min<IOOffset>(m_options.m_size, m_file_size);
+      op.m_chunks.clear();
+      op.m_bytes = 0;
+      if (m_options.m_pattern == "sequential")
+      {
+        if (m_offset + static_cast<IOOffset>(size) > m_file_size) m_offset = 0;
+        op.m_chunks.push_back(IOPosBuffer(m_offset, buffer, size));
+        m_offset += size;
+      }
+      else if (m_options.m_pattern == "random")
+      {
+        std::uniform_int_distribution<IOOffset> offset(0, m_file_size - size);
+        op.m_chunks.push_back(IOPosBuffer(offset(m_generator), buffer, size));
+      }
+      else
+      {
+        // Baskets of a cluster: chunks moving forward through the file,
+        // separated by the baskets of branches which were not requested.
+        IOSize chunk = std::max<IOSize>(size / m_options.m_chunks, 1);
+        std::uniform_int_distribution<IOSize> gap(0, 2*chunk);
+        for (unsigned idx = 0; (idx < m_options.m_chunks) && (op.m_bytes + chunk <= size); idx++)
+        {
+          IOOffset skip = gap(m_generator);
+          if (m_offset + skip + static_cast<IOOffset>(chunk) > m_file_size) m_offset = skip = 0;
+          m_offset += skip;
+          op.m_chunks.push_back(IOPosBuffer(m_offset, buffer + op.m_bytes, chunk));
+          m_offset += chunk;
+          op.m_bytes += chunk;
+        }
+        return;
+      }
+      op.m_bytes = size;
+    }
+
+  private:
+    const Options &m_options;
+    const IOOffset m_file_size;
+    IOOffset m_offset;
+    std::mt19937_64 m_generator;
+  };
+
+  // What one reader thread saw.
+  struct Result {
+    std::vector<double> m_latencies;
+    IOOffset m_bytes = 0;
+    unsigned m_failures = 0;
+    unsigned m_mismatches = 0;
+    std::string m_error;
+  };
+
+  /**
+   * Issue the pattern's reads against the shared file, keeping up to
+   * --depth outstanding.
+   */
+  void
+  runReader(XrdFile &file, const Options &options, IOOffset file_size, int verify_fd, unsigned idx, Result &result)
+  {
+    Options reader_options(options);
+    reader_options.m_seed = options.m_seed + idx;
+    try
+    {
+      Pattern pattern(reader_options, file_size);
+      std::vector<char> arena(static_cast<size_t>(options.m_depth) * options.m_size);
+      result.m_latencies.reserve(options.m_reads);
+
+      struct Outstanding {
+        std::future<IOSize> m_future;
+        Clock::time_point m_start;
+        std::vector<IOPosBuffer> m_chunks;
+      };
+      std::deque<Outstanding> outstanding;
+      Operation op;
+      unsigned issued = 0;
+      while ((issued < options.m_reads) || !outstanding.empty())
+      {
+        if ((issued < options.m_reads) && (outstanding.size() < options.m_depth))
+        {
+          char *slot = &arena[(issued % options.m_depth) * options.m_size];
+          pattern.next(slot, op);
+          Outstanding read;
+          read.m_start = Clock::now();
+          read.m_future = (op.m_chunks.size() == 1)
+              ? file.readAsync(op.m_chunks[0].data(), op.m_chunks[0].size(), op.m_chunks[0].offset())
+              : file.readvAsync(&op.m_chunks[0], op.m_chunks.size());
+          if (options.m_verify) read.m_chunks = op.m_chunks;
+          outstanding.push_back(std::move(read));
+          issued++;
+          continue;
+        }
+        Outstanding &read = outstanding.front();
+        try
+        {
+          result.m_bytes += read.m_future.get();
+          result.m_latencies.push_back(std::chrono::duration<double, std::milli>(Clock::now() - read.m_start).count());
+          if (options.m_verify && !verify(verify_fd, read.m_chunks)) result.m_mismatches++;
+        }
+        catch (cms::Exception &)
+        {
+          result.m_failures++;
+        }
+        outstanding.pop_front();
+      }
+    }
+    catch (cms::Exception &ex)
+    {
+      result.m_error = ex.what();
+    }
+  }
+
+  double
+  percentile(const std::vector<double> &sorted, double fraction)
+  {
+    if (sorted.empty()) return 0;
+    size_t idx = std::min(sorted.size()-1, static_cast<size_t>(fraction*sorted.size()));
+    return sorted[idx];
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+    Options options;
+    static struct option long_options[] = {
+        {"file", required_argument, nullptr, 'f'},
+        {"servers", required_argument, nullptr, 's'},
+        {"pattern", required_argument, nullptr, 'p'},
+        {"reads", required_argument, nullptr, 'n'},
+        {"size", required_argument, nullptr, 'b'},
+        {"chunks", required_argument, nullptr, 'k'},
+        {"depth", required_argument, nullptr, 'd'},
+        {"threads", required_argument, nullptr, 't'},
+        {"seed", required_argument, nullptr, 'r'},
+        {"verify", no_argument, nullptr, 'v'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'f': options.m_file = optarg; break;
+        case 's': options.m_servers = optarg; break;
+        case 'p': options.m_pattern = optarg; break;
+        case 'n': options.m_reads = strtoul(optarg, nullptr, 10); break;
+        case 'b': options.m_size = strtoul(optarg, nullptr, 10); break;
+        case 'k': options.m_chunks = std::max(1ul, strtoul(optarg, nullptr, 10)); break;
+        case 'd': options.m_depth = std::max(1ul, strtoul(optarg, nullptr, 10)); break;
+        case 't': options.m_threads = std::max(1ul, strtoul(optarg, nullptr, 10)); break;
+        case 'r': options.m_seed = strtoull(optarg, nullptr, 10); break;
+        case 'v': options.m_verify = true; break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (options.m_file.empty() || (options.m_pattern != "sequential" && options.m_pattern != "readv" && options.m_pattern != "random"))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<Mock::ServerConfig> servers;
+    std::string error;
+    if (!Mock::parseServers(options.m_servers, servers, error))
+    {
+        std::cerr << "Invalid --servers: " << error << std::endl;
+        return 1;
+    }
+    struct stat buf;
+    if ((stat(options.m_file.c_str(), &buf) == -1) || (buf.st_size == 0))
+    {
+        std::cerr << "Cannot use " << options.m_file << " as input: it must exist and be non-empty." << std::endl;
+        return 1;
+    }
+
+    Mock::Backend backend(servers, options.m_seed);
+    backend.install();
+
+    std::vector<Result> results(options.m_threads);
+    int verify_fd = options.m_verify ? open(options.m_file.c_str(), O_RDONLY) : -1;
+    Clock::time_point start = Clock::now();
+    try
+    {
+        XrdFile file("root://mock/" + options.m_file);
+        // Every reader shares the file, as the framework's threads do.
+        std::vector<std::thread> readers;
+        for (unsigned idx = 1; idx < options.m_threads; idx++)
+        {
+            readers.emplace_back(runReader, std::ref(file), std::cref(options), buf.st_size, verify_fd, idx, std::ref(results[idx]));
+        }
+        runReader(file, options, buf.st_size, verify_fd, 0, results[0]);
+        for (auto & reader : readers) reader.join();
+        for (const auto & result : results)
+        {
+            if (!result.m_error.empty())
+            {
+                std::cerr << "Benchmark aborted: " << result.m_error << std::endl;
+                return 1;
+            }
+        }
+        Statistics::Snapshot total;
+        std::vector<std::pair<std::string, Statistics::Snapshot> > sources;
+        file.getStatistics(total, sources);
+        std::cout << "file: " << total << "\n";
+        for (const auto & source : sources)
+        {
+            std::cout << "source " << source.first << ": " << source.second << "\n";
+        }
+        file.close();
+    }
+    catch (cms::Exception &ex)
+    {
+        std::cerr << "Benchmark aborted: " << ex.what() << std::endl;
+        return 1;
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<double> latencies;
+    IOOffset bytes = 0;
+    unsigned failures = 0;
+    unsigned mismatches = 0;
+    for (const auto & result : results)
+    {
+        latencies.insert(latencies.end(), result.m_latencies.begin(), result.m_latencies.end());
+        bytes += result.m_bytes;
+        failures += result.m_failures;
+        mismatches += result.m_mismatches;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << std::fixed << std::setprecision(2)
+      << "pattern " << options.m_pattern << ", " << latencies.size() << " reads (" << failures << " failed), depth " << options.m_depth
+      << ", " << options.m_threads << " threads\n"
+      << "bytes read      " << bytes << "\n"
+      << "elapsed         " << elapsed << " s\n"
+      << "throughput      " << (elapsed > 0 ? bytes / elapsed / (1024*1024) : 0) << " MB/s\n"
+      << "latency p50     " << percentile(latencies, 0.50) << " ms\n"
+      << "latency p90     " << percentile(latencies, 0.90) << " ms\n"
+      << "latency p99     " << percentile(latencies, 0.99) << " ms\n"
+      << "latency max     " << (latencies.empty() ? 0 : latencies.back()) << " ms\n"
+      << "reads/s         " << (elapsed > 0 ? latencies.size() / elapsed : 0) << std::endl;
+    if (options.m_verify)
+    {
+        std::cout << "mismatches      " << mismatches << std::endl;
+        close(verify_fd);
+    }
+    return mismatches ? 2 : 0;
+}
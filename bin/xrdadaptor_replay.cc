@@ -0,0 +1,411 @@
+/*
+ * Replays an IO recording (see XrdRecorder.h) through XrdFile, against
+ * simulated servers serving local copies of the files (see XrdMockBackend.h)
+ * or, with --real, against the recorded URLs.  Reports the replayed latency
+ * of each kind of operation beside the recorded one.
+ *
+ * Example:
+ *   XRD_ADAPTOR_RECORD=/tmp/io.rec cmsRun job.py
+ *   xrdadaptor_replay --recording /tmp/io.rec --local-dir /data/copies \
+ *     --servers "fast:latency=10,bandwidth=100;slow:latency=80,bandwidth=10" --speed 2
+ *
+ * The operations of each recorded thread are replayed in order by a thread of
+ * their own, each no earlier than its recorded start time (scaled by
+ * --speed); blocking operations wait for their result before the next is
+ * issued, as in the job.  Every file is opened before the replay starts and
+ * closed once it ends, so open times are not part of the replay.  Writes are
+ * skipped unless --writes is given, as they modify the files.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Utilities/XrdAdaptor/src/XrdFile.h"
+#include "Utilities/XrdAdaptor/src/XrdRecorder.h"
+#include "XrdMockBackend.h"
+
+using namespace XrdAdaptor;
+
+namespace {
+
+  typedef std::chrono::steady_clock Clock;
+
+  struct Options {
+    std::string m_recording;
+    std::string m_local_dir;
+    std::string m_servers = "local:latency=0,bandwidth=10000";
+    double m_speed = 1;
+    unsigned long long m_seed = 1;
+    bool m_real = false;
+    bool m_writes = false;
+  };
+
+  struct Operation {
+    Recorder::Record m_record;
+    std::vector<Recorder::Chunk> m_chunks;
+  };
+
+  struct OpenFile {
+    std::string m_name;
+    int m_flags;
+    std::unique_ptr<XrdFile> m_file;
+  };
+
+  // Latencies, in ms, of one kind of operation.
+  struct Latencies {
+    std::vector<double> m_recorded;
+    std::vector<double> m_replayed;
+    unsigned m_failures = 0;
+  };
+
+  bool
+  readRecording(FILE *fp, std::map<uint16_t, OpenFile> &files, std::map<uint16_t, std::vector<Operation> > &threads)
+  {
+    char magic[sizeof(Recorder::file_magic)];
+    if ((fread(magic, sizeof(magic), 1, fp) != 1) || memcmp(magic, Recorder::file_magic, sizeof(magic))) return false;
+    Operation op;
+    while (fread(&op.m_record, sizeof(op.m_record), 1, fp) == 1)
+    {
+      const Recorder::Record &record = op.m_record;
+      std::string name;
+      op.m_chunks.clear();
+      if ((record.m_type == Recorder::Open) || (record.m_type == Recorder::SourceName))
+      {
+        name.resize(record.m_count);
+        if (record.m_count && (fread(&name[0], 1, record.m_count, fp) != record.m_count)) return false;
+      }
+      else if (record.m_count)
+      {
+        op.m_chunks.resize(record.m_count);
+        if (fread(&op.m_chunks[0], sizeof(Recorder::Chunk), record.m_count, fp) != record.m_count) return false;
+      }
+      std::vector<uint16_t> sources(record.m_sources);
+      if (record.m_sources && (fread(&sources[0], sizeof(uint16_t), record.m_sources, fp) != record.m_sources)) return false;
+
+      if (record.m_type == Recorder::Open)
+      {
+        OpenFile &file = files[record.m_file];
+        file.m_name = name;
+        file.m_flags = record.m_offset;
+      }
+      else if ((record.m_type != Recorder::SourceName) && (record.m_type != Recorder::Close))
+      {
+        threads[record.m_thread].push_back(op);
+      }
+    }
+    // Asynchronous reads are recorded as they complete; replay them in the
+    // order they were issued.
+    for (auto & thread : threads)
+    {
+      std::stable_sort(thread.second.begin(), thread.second.end(), [](const Operation &op1, const Operation &op2) {
+          return op1.m_record.m_time_ns < op2.m_record.m_time_ns;
+      });
+    }
+    return feof(fp);
+  }
+
+  /**
+   * The URL to replay a recorded file name at: its path below the local
+   * directory, served by the mock backend, or the name itself.
+   */
+  std::string
+  replayURL(const Options &options, const std::string &name)
+  {
+    if (options.m_real) return name;
+    std::string path = name;
+    size_t host = name.find("://");
+    if (host != std::string::npos)
+    {
+      size_t slash = name.find('/', host + 3);
+      path = (slash == std::string::npos) ? "/" : name.substr(slash);
+      // Strip the extra slash of root://host//path.
+      if ((path.size() > 1) && (path[1] == '/')) path = path.substr(1);
+    }
+    return "root://mock/" + options.m_local_dir + path;
+  }
+
+  /**
+   * Replay the operations of one recorded thread.  Buffers of asynchronous
+   * operations are kept until the end, when their futures are waited for.
+   */
+  void
+  replayThread(const Options &options, const std::vector<Operation> &ops, std::map<uint16_t, OpenFile> &files,
+               uint64_t first_ns, Clock::time_point start, std::map<unsigned, Latencies> &latencies)
+  {
+    struct Pending {
+      std::future<IOSize> m_future;
+      std::vector<char> m_buffer;
+      std::vector<IOPosBuffer> m_chunks;
+      Clock::time_point m_start;
+      unsigned m_type;
+    };
+    std::vector<std::unique_ptr<Pending> > pending;
+    std::vector<char> buffer;
+    std::vector<IOPosBuffer> chunks;
+
+    for (const auto & op : ops)
+    {
+      const Recorder::Record &record = op.m_record;
+      auto file_it = files.find(record.m_file);
+      if ((file_it == files.end()) || !file_it->second.m_file) continue;
+      if ((record.m_type == Recorder::Write) && !options.m_writes) continue;
+      if (op.m_chunks.empty() && ((record.m_type == Recorder::VectorRead) || (record.m_type == Recorder::Prefetch))) continue;
+      XrdFile &file = *file_it->second.m_file;
+
+      if (options.m_speed > 0)
+      {
+        std::this_thread::sleep_until(start + std::chrono::nanoseconds(static_cast<long long>((record.m_time_ns - first_ns)/options.m_speed)));
+      }
+      bool async = record.m_flags & Recorder::Async;
+      std::unique_ptr<Pending> op_pending;
+      if (async)
+      {
+        op_pending.reset(new Pending());
+        op_pending->m_type = record.m_type;
+      }
+      std::vector<char> &op_buffer = async ? op_pending->m_buffer : buffer;
+      std::vector<IOPosBuffer> &op_chunks = async ? op_pending->m_chunks : chunks;
+      op_buffer.resize(std::max<uint64_t>(record.m_size, 1));
+      op_chunks.clear();
+      char *data = &op_buffer[0];
+      for (const auto & chunk : op.m_chunks)
+      {
+        op_chunks.push_back(IOPosBuffer(chunk.m_offset, data, chunk.m_size));
+        data += chunk.m_size;
+      }
+
+      Clock::time_point op_start = Clock::now();
+      Latencies &stats = latencies[record.m_type];
+      try
+      {
+        switch (record.m_type)
+        {
+        case Recorder::Read:
+          if (async) op_pending->m_future = file.readAsync(data, record.m_size, record.m_offset);
+          else file.read(data, record.m_size, record.m_offset);
+          break;
+        case Recorder::VectorRead:
+          if (async) op_pending->m_future = file.readvAsync(&op_chunks[0], op_chunks.size());
+          else file.readv(&op_chunks[0], op_chunks.size());
+          break;
+        case Recorder::Prefetch:
+          file.prefetch(&op_chunks[0], op_chunks.size());
+          break;
+        case Recorder::Write:
+          file.write(data, record.m_size, record.m_offset);
+          break;
+        }
+      }
+      catch (cms::Exception &)
+      {
+        stats.m_failures++;
+        continue;
+      }
+      stats.m_recorded.push_back(record.m_latency_us/1000.0);
+      if (async)
+      {
+        op_pending->m_start = op_start;
+        pending.push_back(std::move(op_pending));
+        continue;
+      }
+      stats.m_replayed.push_back(std::chrono::duration<double, std::milli>(Clock::now() - op_start).count());
+    }
+
+    // These are waited for in the order they were issued, so their replayed
+    // latency includes the time until we got round to them.
+    for (auto & op : pending)
+    {
+      Latencies &stats = latencies[op->m_type];
+      try
+      {
+        op->m_future.get();
+        stats.m_replayed.push_back(std::chrono::duration<double, std::milli>(Clock::now() - op->m_start).count());
+      }
+      catch (cms::Exception &)
+      {
+        stats.m_failures++;
+      }
+    }
+  }
+
+  double
+  percentile(std::vector<double> &values, double fraction)
+  {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    size_t idx = std::min(values.size()-1, static_cast<size_t>(fraction*values.size()));
+    return values[idx];
+  }
+
+  void
+  usage(const char *argv0)
+  {
+    std::cerr << "Usage: " << argv0 << " --recording PATH [options]\n"
+      << "  --local-dir DIR  serve the path of each recorded URL from below DIR\n"
+      << "  --servers SPEC   simulated servers, as for xrdadaptor_benchmark\n"
+      << "  --real           replay against the recorded URLs rather than simulated servers\n"
+      << "  --speed X        replay X times faster than recorded; 0 for as fast as possible\n"
+      << "  --writes         replay writes too (they modify the files)\n"
+      << "  --seed S         seed for the simulated servers\n";
+  }
+
+}
+
+int
+main(int argc, char *argv[])
+{
+    Options options;
+    static struct option long_options[] = {
+        {"recording", required_argument, nullptr, 'r'},
+        {"local-dir", required_argument, nullptr, 'l'},
+        {"servers", required_argument, nullptr, 's'},
+        {"real", no_argument, nullptr, 'x'},
+        {"speed", required_argument, nullptr, 'p'},
+        {"writes", no_argument, nullptr, 'w'},
+        {"seed", required_argument, nullptr, 'e'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'r': options.m_recording = optarg; break;
+        case 'l': options.m_local_dir = optarg; break;
+        case 's': options.m_servers = optarg; break;
+        case 'x': options.m_real = true; break;
+        case 'p': options.m_speed = std::max(0.0, strtod(optarg, nullptr)); break;
+        case 'w': options.m_writes = true; break;
+        case 'e': options.m_seed = strtoull(optarg, nullptr, 10); break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (options.m_recording.empty())
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *fp = fopen(options.m_recording.c_str(), "r");
+    if (!fp)
+    {
+        std::cerr << "Unable to open " << options.m_recording << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    std::map<uint16_t, OpenFile> files;
+    std::map<uint16_t, std::vector<Operation> > threads;
+    bool ok = readRecording(fp, files, threads);
+    fclose(fp);
+    if (!ok)
+    {
+        std::cerr << options.m_recording << " is not a valid XrdAdaptor recording." << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<Mock::Backend> backend;
+    if (!options.m_real)
+    {
+        std::vector<Mock::ServerConfig> servers;
+        std::string error;
+        if (!Mock::parseServers(options.m_servers, servers, error))
+        {
+            std::cerr << "Invalid --servers: " << error << std::endl;
+            return 1;
+        }
+        backend.reset(new Mock::Backend(servers, options.m_seed));
+        backend->install();
+    }
+
+    for (auto & it : files)
+    {
+        OpenFile &file = it.second;
+        int flags = options.m_writes ? file.m_flags : IOFlags::OpenRead;
+        try
+        {
+            file.m_file.reset(new XrdFile(replayURL(options, file.m_name), flags));
+        }
+        catch (cms::Exception &ex)
+        {
+            std::cerr << "Skipping the operations on " << file.m_name << ": " << ex.what() << std::endl;
+        }
+    }
+
+    uint64_t first_ns = ~0ull, last_ns = 0;
+    for (const auto & thread : threads)
+    {
+        if (thread.second.empty()) continue;
+        first_ns = std::min<uint64_t>(first_ns, thread.second.front().m_record.m_time_ns);
+        const Recorder::Record &last = thread.second.back().m_record;
+        last_ns = std::max<uint64_t>(last_ns, last.m_time_ns + 1000ull*last.m_latency_us);
+    }
+
+    // One set of latencies per thread, merged at the end.
+    std::vector<std::map<unsigned, Latencies> > latencies(threads.size());
+    std::vector<std::thread> replayers;
+    Clock::time_point start = Clock::now();
+    size_t idx = 0;
+    for (const auto & thread : threads)
+    {
+        replayers.emplace_back(replayThread, std::cref(options), std::cref(thread.second), std::ref(files),
+                               first_ns, start, std::ref(latencies[idx++]));
+    }
+    for (auto & replayer : replayers) replayer.join();
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    for (auto & it : files)
+    {
+        if (!it.second.m_file) continue;
+        try
+        {
+            it.second.m_file->close();
+        }
+        catch (cms::Exception &ex)
+        {
+            std::cerr << "Closing " << it.second.m_name << ": " << ex.what() << std::endl;
+        }
+    }
+
+    std::map<unsigned, Latencies> total;
+    for (auto & thread : latencies)
+    {
+        for (auto & it : thread)
+        {
+            Latencies &merged = total[it.first];
+            merged.m_recorded.insert(merged.m_recorded.end(), it.second.m_recorded.begin(), it.second.m_recorded.end());
+            merged.m_replayed.insert(merged.m_replayed.end(), it.second.m_replayed.begin(), it.second.m_replayed.end());
+            merged.m_failures += it.second.m_failures;
+        }
+    }
+    std::cout << std::fixed << std::setprecision(2)
+      << files.size() << " files, " << threads.size() << " threads\n"
+      << "recorded elapsed " << ((first_ns < last_ns) ? (last_ns - first_ns)/1e9 : 0) << " s\n"
+      << "replayed elapsed " << elapsed << " s at speed " << options.m_speed << "\n"
+      << std::setw(12) << std::left << "operation" << std::right
+      << std::setw(8) << "count" << std::setw(8) << "failed"
+      << std::setw(14) << "recorded p50" << std::setw(14) << "replayed p50"
+      << std::setw(14) << "recorded p99" << std::setw(14) << "replayed p99" << "\n";
+    for (auto & it : total)
+    {
+      Latencies &stats = it.second;
+      std::cout << std::setw(12) << std::left << Recorder::typeName(it.first) << std::right
+        << std::setw(8) << stats.m_replayed.size() << std::setw(8) << stats.m_failures
+        << std::setw(14) << percentile(stats.m_recorded, 0.50) << std::setw(14) << percentile(stats.m_replayed, 0.50)
+        << std::setw(14) << percentile(stats.m_recorded, 0.99) << std::setw(14) << percentile(stats.m_replayed, 0.99) << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,696 @@
+/*
+ * A discrete-event simulation of the adaptor's source selection: the real
+ * XrdFile / RequestManager / Source logic runs against simulated servers,
+ * with the adaptor's clock (see XrdClock.h) and ticker driven in simulated
+ * time, so a job of hours runs in seconds.  Reports the throughput, the
+ * latency, the over-read (bytes fetched from servers beyond those the job
+ * asked for) and, for each server, when it was demoted.
+ *
+ * Example: a two-hour job where one server degrades after ten minutes and
+ * another becomes fast after an hour.
+ *   xrdadaptor_simulate --duration 7200 \
+ *     --servers "a:latency=20,bandwidth=50;b:latency=40,bandwidth=25,degrade_after=600,degrade_factor=10;c:latency=30,bandwidth=5" \
+ *     --script "3600:c:latency=10,bandwidth=100"
+ *
+ * Everything runs on one thread, in the order of simulated time: a response
+ * is delivered as an event at the time the server's model says it arrives,
+ * and the job issues its next read once the previous one has completed and
+ * its think time has passed.  No data is read; the simulated file only has a
+ * size.  Every server holds a replica.  Opens take simulated time too: where
+ * the adaptor would block waiting for them, it runs the events instead (see
+ * FileHandle::setWaitFunction).  As in production, the file is opened
+ * through the redirector unless XRD_ADAPTOR_LOCATE_SOURCES is set, in which
+ * case that many replicas are located and opened in parallel.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Utilities/XrdAdaptor/src/XrdClock.h"
+#include "Utilities/XrdAdaptor/src/XrdFile.h"
+#include "Utilities/XrdAdaptor/src/XrdFileHandle.h"
+#include "Utilities/XrdAdaptor/src/XrdTicker.h"
+#include "XrdMockBackend.h"
+
+using namespace XrdAdaptor;
+
+namespace {
+
+  // Simulated time starts well away from zero, which the adaptor takes to
+  // mean "never".
+  const uint64_t g_start_ns = 1000ull*1000000000ull;
+  uint64_t g_now_ns = g_start_ns;
+
+  void
+  simulatedNow(timespec &now)
+  {
+    now.tv_sec = g_now_ns / 1000000000ull;
+    now.tv_nsec = g_now_ns % 1000000000ull;
+  }
+
+  uint64_t
+  nanoseconds(double ms)
+  {
+    return static_cast<uint64_t>(ms*1000000);
+  }
+
+  double
+  seconds(uint64_t ns)
+  {
+    return static_cast<double>(ns - g_start_ns)/1e9;
+  }
+
+  struct Options {
+    std::string m_servers = "server1:latency=20,bandwidth=50;server2:latency=40,bandwidth=25";
+    std::string m_script;
+    std::string m_pattern = "readv";
+    double m_duration_s = 3600;
+    double m_think_ms = 10;
+    IOOffset m_file_size = 2ll*1024*1024*1024;
+    IOSize m_size = 256*1024;
+    unsigned m_chunks = 64;
+    unsigned m_depth = 1;
+    unsigned long long m_seed = 1;
+  };
+
+  XrdCl::XRootDStatus
+  errorStatus(uint16_t code, uint32_t errNo, const std::string &message)
+  {
+    return XrdCl::XRootDStatus(XrdCl::stError, code, errNo, message);
+  }
+
+  /**
+   * The pending events, in order of simulated time.
+   */
+  class EventQueue {
+  public:
+    EventQueue() : m_sequence(0), m_pending(0) {}
+
+    /**
+     * Run callback at the given time.  Only background events (such as
+     * ticks) may be left when the simulation ends.
+     */
+    void schedule(uint64_t when, std::function<void()> callback, bool background = false)
+    {
+      m_events.push(Event{std::max(when, g_now_ns), m_sequence++, background, callback});
+      if (!background) m_pending++;
+    }
+
+    /**
+     * Run every event due by the given time, then advance the clock to it.
+     */
+    void runUntil(uint64_t when)
+    {
+      while (!m_events.empty() && (m_events.top().m_when <= when)) runNext();
+      g_now_ns = std::max(g_now_ns, when);
+    }
+
+    /**
+     * Advance the clock to the next event and run it; false if there is none.
+     */
+    bool runNext()
+    {
+      if (m_events.empty()) return false;
+      Event event = m_events.top();
+      m_events.pop();
+      if (!event.m_background) m_pending--;
+      g_now_ns = event.m_when;
+      event.m_callback();
+      return true;
+    }
+
+    unsigned pending() const {return m_pending;}
+
+  private:
+    struct Event {
+      uint64_t m_when;
+      unsigned long long m_sequence;
+      bool m_background;
+      std::function<void()> m_callback;
+
+      bool operator<(const Event &other) const
+      {
+        return (m_when != other.m_when) ? (m_when > other.m_when) : (m_sequence > other.m_sequence);
+      }
+    };
+
+    std::priority_queue<Event> m_events;
+    unsigned long long m_sequence;
+    unsigned m_pending;
+  };
+
+  /**
+   * A server with the same model as Mock::Backend::Server, in simulated
+   * time; its configuration may be changed by the script.
+   */
+  class Server {
+  public:
+    Server(const Mock::ServerConfig &config, unsigned long long seed)
+      : m_config(config), m_busy_until(0), m_generator(seed), m_uniform(0, 1),
+        m_requests(0), m_bytes(0)
+    {}
+
+    uint64_t transfer(size_t bytes, bool &failed)
+    {
+      double latency = m_config.m_latency_ms;
+      double bandwidth = m_config.m_bandwidth_mbs;
+      if ((m_config.m_degrade_after_s >= 0) && (seconds(g_now_ns) >= m_config.m_degrade_after_s))
+      {
+        latency *= m_config.m_degrade_factor;
+        bandwidth /= m_config.m_degrade_factor;
+      }
+      double jitter = m_config.m_jitter_ms * m_uniform(m_generator);
+      failed = m_uniform(m_generator) < m_config.m_error_rate;
+      m_requests++;
+      m_bytes += bytes;
+
+      uint64_t begin = std::max(g_now_ns + nanoseconds(latency/2), m_busy_until);
+      m_busy_until = begin + static_cast<uint64_t>(1e9*static_cast<double>(bytes)/(bandwidth*1024*1024));
+      return m_busy_until + nanoseconds(latency/2 + jitter);
+    }
+
+    void reconfigure(const Mock::ServerConfig &config) {m_config = config;}
+
+    const Mock::ServerConfig &config() const {return m_config;}
+    unsigned long long requests() const {return m_requests;}
+    unsigned long long bytes() const {return m_bytes;}
+
+  private:
+    Mock::ServerConfig m_config;
+    uint64_t m_busy_until;
+    std::mt19937_64 m_generator;
+    std::uniform_real_distribution<double> m_uniform;
+    unsigned long long m_requests;
+    unsigned long long m_bytes;
+  };
+
+  class Simulation;
+
+  /**
+   * A file at a simulated server; reads complete as events, without data.
+   */
+  class SimFile final : public FileHandle {
+  public:
+    explicit SimFile(Simulation &sim) : m_sim(sim), m_server(nullptr) {}
+
+    virtual XrdCl::XRootDStatus Open(const std::string &url, XrdCl::OpenFlags::Flags, XrdCl::Access::Mode) override;
+    virtual XrdCl::XRootDStatus Open(const std::string &url, XrdCl::OpenFlags::Flags, XrdCl::Access::Mode, XrdCl::ResponseHandler *handler) override;
+
+    virtual XrdCl::XRootDStatus Close() override
+    {
+      m_server = nullptr;
+      return XrdCl::XRootDStatus();
+    }
+
+    virtual XrdCl::XRootDStatus Stat(bool, XrdCl::StatInfo *&response) override;
+
+    virtual XrdCl::XRootDStatus Read(uint64_t offset, uint32_t size, void *buffer, XrdCl::ResponseHandler *handler) override
+    {
+      XrdCl::ChunkList chunks;
+      chunks.emplace_back(XrdCl::ChunkInfo(offset, size, buffer));
+      return submit(chunks, handler, false);
+    }
+
+    virtual XrdCl::XRootDStatus VectorRead(const XrdCl::ChunkList &chunks, void *, XrdCl::ResponseHandler *handler) override
+    {
+      return submit(chunks, handler, true);
+    }
+
+    virtual XrdCl::XRootDStatus Write(uint64_t, uint32_t, const void *) override
+    {
+      return errorStatus(XrdCl::errNotSupported, ENOTSUP, "the simulation does not support writes");
+    }
+
+    virtual XrdCl::XRootDStatus Write(uint64_t, uint32_t, const void *, XrdCl::ResponseHandler *) override
+    {
+      return errorStatus(XrdCl::errNotSupported, ENOTSUP, "the simulation does not support writes");
+    }
+
+    virtual XrdCl::XRootDStatus Locate(const std::string &, std::vector<std::string> &servers) override;
+
+    virtual std::string GetDataServer() override
+    {
+      return m_server ? m_server->config().m_name + ":1094" : "";
+    }
+
+  private:
+    XrdCl::XRootDStatus open(const std::string &url, uint64_t &when);
+    XrdCl::XRootDStatus submit(const XrdCl::ChunkList &chunks, XrdCl::ResponseHandler *handler, bool vector);
+
+    Simulation &m_sim;
+    Server *m_server;
+  };
+
+  class Simulation {
+  public:
+    Simulation(const Options &options, const std::vector<Mock::ServerConfig> &servers)
+      : m_options(options)
+    {
+      unsigned long long seed = options.m_seed;
+      for (const auto & config : servers) m_servers.emplace_back(new Server(config, seed++));
+    }
+
+    EventQueue &events() {return m_events;}
+    const Options &options() const {return m_options;}
+    const std::vector<std::unique_ptr<Server> > &servers() const {return m_servers;}
+
+    Server *findServer(const std::string &name)
+    {
+      for (const auto & server : m_servers) if (server->config().m_name == name) return server.get();
+      return nullptr;
+    }
+
+    /**
+     * As Mock::Backend::pickServer: the server named as the URL's host, or
+     * else the first not excluded by tried=.
+     */
+    Server *pickServer(const std::string &url)
+    {
+      size_t host = url.find("://");
+      if (host != std::string::npos)
+      {
+        host += 3;
+        std::string name = url.substr(host, url.find('/', host) - host);
+        Server *server = findServer(name.substr(0, name.find(':')));
+        if (server) return server;
+      }
+      std::string tried;
+      size_t pos = url.find("tried=");
+      if (pos != std::string::npos)
+      {
+        tried = url.substr(pos + 6);
+        tried = "," + tried.substr(0, tried.find('&')) + ",";
+      }
+      for (const auto & server : m_servers)
+      {
+        if (tried.find("," + server->config().m_name + ",") == std::string::npos) return server.get();
+      }
+      return nullptr;
+    }
+
+  private:
+    const Options &m_options;
+    EventQueue m_events;
+    std::vector<std::unique_ptr<Server> > m_servers;
+  };
+
+  XrdCl::XRootDStatus
+  SimFile::open(const std::string &url, uint64_t &when)
+  {
+    when = g_now_ns;
+    m_server = m_sim.pickServer(url);
+    if (!m_server) return errorStatus(XrdCl::errErrorResponse, ENOENT, "no more servers hold " + url);
+    bool failed;
+    when = m_server->transfer(0, failed);
+    if (failed) return errorStatus(XrdCl::errErrorResponse, EIO, "simulated open failure at " + m_server->config().m_name);
+    return XrdCl::XRootDStatus();
+  }
+
+  XrdCl::XRootDStatus
+  SimFile::Open(const std::string &url, XrdCl::OpenFlags::Flags, XrdCl::Access::Mode)
+  {
+    uint64_t when;
+    XrdCl::XRootDStatus status = open(url, when);
+    m_sim.events().runUntil(when);
+    return status;
+  }
+
+  XrdCl::XRootDStatus
+  SimFile::Open(const std::string &url, XrdCl::OpenFlags::Flags, XrdCl::Access::Mode, XrdCl::ResponseHandler *handler)
+  {
+    uint64_t when;
+    XrdCl::XRootDStatus status = open(url, when);
+    m_sim.events().schedule(when, [handler, status]() {
+      handler->HandleResponseWithHosts(new XrdCl::XRootDStatus(status), nullptr, new XrdCl::HostList());
+    });
+    return XrdCl::XRootDStatus();
+  }
+
+  XrdCl::XRootDStatus
+  SimFile::Locate(const std::string &, std::vector<std::string> &servers)
+  {
+    for (const auto & server : m_sim.servers()) servers.push_back(server->config().m_name + ":1094");
+    return XrdCl::XRootDStatus();
+  }
+
+  XrdCl::XRootDStatus
+  SimFile::Stat(bool, XrdCl::StatInfo *&response)
+  {
+    if (!m_server) return errorStatus(XrdCl::errInvalidArgs, EBADF, "file is not open");
+    std::stringstream ss;
+    ss << "0 " << m_sim.options().m_file_size << " 0 0";
+    response = new XrdCl::StatInfo(ss.str().c_str());
+    return XrdCl::XRootDStatus();
+  }
+
+  XrdCl::XRootDStatus
+  SimFile::submit(const XrdCl::ChunkList &chunks, XrdCl::ResponseHandler *handler, bool vector)
+  {
+    if (!m_server) return errorStatus(XrdCl::errInvalidArgs, EBADF, "file is not open");
+    size_t bytes = 0;
+    for (const auto & chunk : chunks) bytes += chunk.length;
+    bool failed;
+    uint64_t when = m_server->transfer(bytes, failed);
+    std::string name = m_server->config().m_name;
+    m_sim.events().schedule(when, [chunks, bytes, handler, vector, failed, name]() {
+      if (failed)
+      {
+        handler->HandleResponse(new XrdCl::XRootDStatus(errorStatus(XrdCl::errErrorResponse, EIO, "simulated read failure at " + name)), nullptr);
+        return;
+      }
+      XrdCl::AnyObject *response = new XrdCl::AnyObject();
+      if (vector)
+      {
+        XrdCl::VectorReadInfo *info = new XrdCl::VectorReadInfo();
+        info->SetSize(bytes);
+        info->GetChunks() = chunks;
+        response->Set(info);
+      }
+      else
+      {
+        response->Set(new XrdCl::ChunkInfo(chunks[0].offset, bytes, chunks[0].buffer));
+      }
+      handler->HandleResponse(new XrdCl::XRootDStatus(), response);
+    });
+    return XrdCl::XRootDStatus();
+  }
+
+  /**
+   * Parse changes to the servers of the form
+   *   time:name:key=value[,key=value...][;...]
+   * where at time seconds into the job, the server takes the configuration
+   * given (unspecified settings take their defaults).
+   */
+  bool
+  parseScript(const std::string &spec, std::vector<std::pair<double, Mock::ServerConfig> > &changes, std::string &error)
+  {
+    std::stringstream specs(spec);
+    std::string entry;
+    while (std::getline(specs, entry, ';'))
+    {
+      if (entry.empty()) continue;
+      size_t colon = entry.find(':');
+      char *end;
+      double when = strtod(entry.substr(0, colon).c_str(), &end);
+      std::vector<Mock::ServerConfig> configs;
+      if ((colon == std::string::npos) || *end || !Mock::parseServers(entry.substr(colon + 1), configs, error))
+      {
+        if (error.empty()) error = "invalid change '" + entry + "'";
+        return false;
+      }
+      changes.emplace_back(when, configs.front());
+    }
+    return true;
+  }
+
+  /**
+   * Generates the reads of the job, as in xrdadaptor_benchmark.
+   */
+  class Pattern {
+  public:
+    Pattern(const Options &options)
+      : m_options(options), m_offset(0), m_generator(options.m_seed)
+    {}
+
+    void next(char *buffer, std::vector<IOPosBuffer> &chunks, IOSize &bytes)
+    {
+      IOSize size = std::min<IOOffset>(m_options.m_size, m_options.m_file_size);
+      chunks.clear();
+      bytes = 0;
+      if (m_options.m_pattern == "sequential")
+      {
+        if (m_offset + static_cast<IOOffset>(size) > m_options.m_file_size) m_offset = 0;
+        chunks.push_back(IOPosBuffer(m_offset, buffer, size));
+        m_offset += size;
+        bytes = size;
+      }
+      else if (m_options.m_pattern == "random")
+      {
+        std::uniform_int_distribution<IOOffset> offset(0, m_options.m_file_size - size);
+        chunks.push_back(IOPosBuffer(offset(m_generator), buffer, size));
+        bytes = size;
+      }
+      else
+      {
+        IOSize chunk = std::max<IOSize>(size / m_options.m_chunks, 1);
+        std::uniform_int_distribution<IOSize> gap(0, 2*chunk);
+        for (unsigned idx = 0; (idx < m_options.m_chunks) && (bytes + chunk <= size); idx++)
+        {
+          IOOffset skip = gap(m_generator);
+          if (m_offset + skip + static_cast<IOOffset>(chunk) > m_options.m_file_size) m_offset = skip = 0;
+          m_offset += skip;
+          chunks.push_back(IOPosBuffer(m_offset, buffer + bytes, chunk));
+          m_offset += chunk;
+          bytes += chunk;
+        }
+      }
+    }
+
+  private:
+    const Options &m_options;
+    IOOffset m_offset;
+    std::mt19937_64 m_generator;
+  };
+
+  double
+  percentile(std::vector<double> &values, double fraction)
+  {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    size_t idx = std::min(values.size()-1, static_cast<size_t>(fraction*values.size()));
+    return values[idx];
+  }
+
+  void
+  usage(const char *argv0)
+  {
+    std::cerr << "Usage: " << argv0 << " [options]\n"
+      << "  --servers SPEC   simulated servers, as for xrdadaptor_benchmark\n"
+      << "  --script SPEC    changes to the servers, time:name:key=value,...[;...]\n"
+      << "  --duration S     simulated seconds of the job\n"
+      << "  --think MS       simulated time between the end of one read and the next\n"
+      << "  --pattern P      sequential, readv (TTreeCache-style) or random\n"
+      << "  --file-size B    size of the simulated file\n"
+      << "  --size BYTES     bytes per read\n"
+      << "  --chunks K       chunks per vector read\n"
+      << "  --depth D        reads outstanding at once\n"
+      << "  --seed S         seed for the access pattern and the servers\n";
+  }
+
+}
+
+int
+main(int argc, char *argv[])
+{
+    Options options;
+    static struct option long_options[] = {
+        {"servers", required_argument, nullptr, 's'},
+        {"script", required_argument, nullptr, 'c'},
+        {"duration", required_argument, nullptr, 't'},
+        {"think", required_argument, nullptr, 'w'},
+        {"pattern", required_argument, nullptr, 'p'},
+        {"file-size", required_argument, nullptr, 'f'},
+        {"size", required_argument, nullptr, 'b'},
+        {"chunks", required_argument, nullptr, 'k'},
+        {"depth", required_argument, nullptr, 'd'},
+        {"seed", required_argument, nullptr, 'r'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 's': options.m_servers = optarg; break;
+        case 'c': options.m_script = optarg; break;
+        case 't': options.m_duration_s = strtod(optarg, nullptr); break;
+        case 'w': options.m_think_ms = std::max(0.0, strtod(optarg, nullptr)); break;
+        case 'p': options.m_pattern = optarg; break;
+        case 'f': options.m_file_size = strtoll(optarg, nullptr, 10); break;
+        case 'b': options.m_size = strtoul(optarg, nullptr, 10); break;
+        case 'k': options.m_chunks = std::max(1ul, strtoul(optarg, nullptr, 10)); break;
+        case 'd': options.m_depth = std::max(1ul, strtoul(optarg, nullptr, 10)); break;
+        case 'r': options.m_seed = strtoull(optarg, nullptr, 10); break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if ((options.m_file_size <= 0) || (options.m_pattern != "sequential" && options.m_pattern != "readv" && options.m_pattern != "random"))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<Mock::ServerConfig> configs;
+    std::vector<std::pair<double, Mock::ServerConfig> > changes;
+    std::string error;
+    if (!Mock::parseServers(options.m_servers, configs, error))
+    {
+        std::cerr << "Invalid --servers: " << error << std::endl;
+        return 1;
+    }
+    if (!parseScript(options.m_script, changes, error))
+    {
+        std::cerr << "Invalid --script: " << error << std::endl;
+        return 1;
+    }
+
+    // The adaptor runs entirely in simulated time, on this thread.
+    MonotonicClock::setNowFunction(&simulatedNow);
+    Ticker::instance().setManual();
+    Simulation sim(options, configs);
+    FileHandle::setFactory([&sim]() {return std::unique_ptr<FileHandle>(new SimFile(sim));});
+    FileHandle::setWaitFunction([&sim]() {return sim.events().runNext();});
+
+    for (const auto & change : changes)
+    {
+        Server *server = sim.findServer(change.second.m_name);
+        if (!server)
+        {
+            std::cerr << "Invalid --script: no server " << change.second.m_name << std::endl;
+            return 1;
+        }
+        Mock::ServerConfig config = change.second;
+        sim.events().schedule(g_start_ns + static_cast<uint64_t>(1e9*change.first), [server, config]() {server->reconfigure(config);}, true);
+    }
+    std::function<void()> tick = [&sim, &tick]() {
+        Ticker::instance().tick();
+        sim.events().schedule(g_now_ns + nanoseconds(Ticker::interval_ms), tick, true);
+    };
+    sim.events().schedule(g_now_ns + nanoseconds(Ticker::interval_ms), tick, true);
+
+    struct Outstanding {
+        std::future<IOSize> m_future;
+        uint64_t m_start;
+        IOSize m_bytes;
+    };
+    std::vector<double> latencies;
+    unsigned long long requested = 0, bytes = 0;
+    unsigned failures = 0;
+    // Sim time of each demotion, per source.
+    std::map<std::string, std::vector<double> > demotions;
+    std::map<std::string, unsigned long long> demotion_counts;
+    uint64_t end_ns = g_start_ns + static_cast<uint64_t>(1e9*options.m_duration_s);
+    std::chrono::steady_clock::time_point real_start = std::chrono::steady_clock::now();
+    try
+    {
+        XrdFile file("root://redirector//store/simulated.root");
+        Pattern pattern(options);
+        std::vector<char> arena(static_cast<size_t>(options.m_depth) * options.m_size);
+        std::vector<IOPosBuffer> chunks;
+        std::deque<Outstanding> outstanding;
+        unsigned slot = 0;
+        // Reads due to be issued, once their think time has passed.
+        unsigned due = options.m_depth;
+
+        while (true)
+        {
+            while (due && (g_now_ns < end_ns))
+            {
+                due--;
+                char *buffer = &arena[(slot++ % options.m_depth) * options.m_size];
+                Outstanding read;
+                pattern.next(buffer, chunks, read.m_bytes);
+                read.m_start = g_now_ns;
+                try
+                {
+                    read.m_future = (chunks.size() == 1)
+                        ? file.readAsync(chunks[0].data(), chunks[0].size(), chunks[0].offset())
+                        : file.readvAsync(&chunks[0], chunks.size());
+                    requested += read.m_bytes;
+                    outstanding.push_back(std::move(read));
+                }
+                catch (cms::Exception &)
+                {
+                    failures++;
+                    sim.events().schedule(g_now_ns + nanoseconds(options.m_think_ms), [&due]() {due++;});
+                }
+            }
+            if (outstanding.empty() && !sim.events().pending()) break;
+            if (!sim.events().runNext()) break;
+
+            for (auto it = outstanding.begin(); it != outstanding.end(); )
+            {
+                if (it->m_future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {++it; continue;}
+                try
+                {
+                    bytes += it->m_future.get();
+                    latencies.push_back((g_now_ns - it->m_start)/1e6);
+                }
+                catch (cms::Exception &)
+                {
+                    failures++;
+                }
+                it = outstanding.erase(it);
+                sim.events().schedule(g_now_ns + nanoseconds(options.m_think_ms), [&due]() {due++;});
+
+                Statistics::Snapshot total;
+                std::vector<std::pair<std::string, Statistics::Snapshot> > sources;
+                file.getStatistics(total, sources);
+                for (const auto & source : sources)
+                {
+                    unsigned long long &count = demotion_counts[source.first];
+                    for (; count < source.second.m_demotions; count++) demotions[source.first].push_back(seconds(g_now_ns));
+                }
+            }
+        }
+        file.close();
+    }
+    catch (cms::Exception &ex)
+    {
+        std::cerr << "Simulation aborted: " << ex.what() << std::endl;
+        return 1;
+    }
+    double real_elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - real_start).count();
+    double elapsed = seconds(g_now_ns);
+
+    unsigned long long served = 0;
+    for (const auto & server : sim.servers()) served += server->bytes();
+    std::cout << std::fixed << std::setprecision(2)
+      << "simulated " << elapsed << " s in " << real_elapsed << " s\n"
+      << "pattern " << options.m_pattern << ", " << latencies.size() << " reads (" << failures << " failed), depth " << options.m_depth << "\n"
+      << "bytes read      " << bytes << "\n"
+      << "over-read       " << (requested ? 100.0*(static_cast<double>(served) - requested)/requested : 0) << " %\n"
+      << "throughput      " << (elapsed > 0 ? bytes / elapsed / (1024*1024) : 0) << " MB/s\n"
+      << "latency p50     " << percentile(latencies, 0.50) << " ms\n"
+      << "latency p90     " << percentile(latencies, 0.90) << " ms\n"
+      << "latency p99     " << percentile(latencies, 0.99) << " ms\n";
+    for (const auto & server : sim.servers())
+    {
+        const std::string name = server->config().m_name;
+        std::cout << "server " << name << ": " << server->requests() << " requests, " << server->bytes() << " bytes";
+        const std::vector<double> &times = demotions[name + ":1094"];
+        if (!times.empty())
+        {
+            std::cout << ", demoted at";
+            for (double time : times) std::cout << " " << time << "s";
+            double degraded = server->config().m_degrade_after_s;
+            for (double time : times)
+            {
+                if ((degraded >= 0) && (time >= degraded))
+                {
+                    std::cout << " (" << time - degraded << " s after degrading)";
+                    break;
+                }
+            }
+        }
+        std::cout << "\n";
+    }
+    return 0;
+}
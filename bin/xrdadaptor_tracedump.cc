@@ -0,0 +1,120 @@
+/*
+ * Decodes the binary IO trace written when XRD_ADAPTOR_TRACE is set (see
+ * XrdTrace.h) and prints one line per event, in time order.
+ *
+ * Example:
+ *   XRD_ADAPTOR_TRACE=/tmp/io.trace cmsRun job.py
+ *   xrdadaptor_tracedump /tmp/io.trace
+ *
+ * Times are in ms relative to the first event.  Objects which were given a
+ * name (files and sources) are printed by name, others as addresses.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Utilities/XrdAdaptor/src/XrdTrace.h"
+
+using namespace XrdAdaptor;
+
+namespace {
+
+  typedef std::map<uint64_t, std::string> NameMap;
+
+  std::string
+  objectName(const NameMap &names, uint64_t object)
+  {
+    auto it = names.find(object);
+    if (it != names.end()) return it->second;
+    std::ostringstream os;
+    os << "0x" << std::hex << object;
+    return os.str();
+  }
+
+  bool
+  isObject(const char *arg)
+  {
+    return !strcmp(arg, "source") || !strcmp(arg, "thief") || !strcmp(arg, "fast");
+  }
+
+  bool
+  readTrace(FILE *fp, NameMap &names, std::vector<Trace::Event> &events)
+  {
+    char magic[sizeof(Trace::file_magic)];
+    uint32_t record_size, name_count;
+    if ((fread(magic, sizeof(magic), 1, fp) != 1) || memcmp(magic, Trace::file_magic, sizeof(magic))) return false;
+    if ((fread(&record_size, sizeof(record_size), 1, fp) != 1) || (record_size != sizeof(Trace::Event))) return false;
+    if (fread(&name_count, sizeof(name_count), 1, fp) != 1) return false;
+    for (uint32_t idx = 0; idx < name_count; idx++)
+    {
+      uint64_t object;
+      uint32_t length;
+      if ((fread(&object, sizeof(object), 1, fp) != 1) || (fread(&length, sizeof(length), 1, fp) != 1)) return false;
+      std::string name(length, '\0');
+      if (length && (fread(&name[0], 1, length, fp) != length)) return false;
+      names[object] = name;
+    }
+    uint64_t event_count;
+    if (fread(&event_count, sizeof(event_count), 1, fp) != 1) return false;
+    events.resize(event_count);
+    return !event_count || (fread(&events[0], sizeof(Trace::Event), event_count, fp) == event_count);
+  }
+
+}
+
+int
+main(int argc, char *argv[])
+{
+  if (argc != 2)
+  {
+    std::cerr << "Usage: " << argv[0] << " TRACE_FILE" << std::endl;
+    return 1;
+  }
+  FILE *fp = fopen(argv[1], "r");
+  if (!fp)
+  {
+    std::cerr << "Unable to open " << argv[1] << ": " << strerror(errno) << std::endl;
+    return 1;
+  }
+  NameMap names;
+  std::vector<Trace::Event> events;
+  bool ok = readTrace(fp, names, events);
+  fclose(fp);
+  if (!ok)
+  {
+    std::cerr << argv[1] << " is not a valid XrdAdaptor trace." << std::endl;
+    return 1;
+  }
+
+  // Each thread's ring is in order; merge them.
+  std::stable_sort(events.begin(), events.end(),
+      [](const Trace::Event &e1, const Trace::Event &e2) {return e1.m_time_ns < e2.m_time_ns;});
+  uint64_t start = events.empty() ? 0 : events.front().m_time_ns;
+  for (const auto & event : events)
+  {
+    std::cout << std::fixed << std::setprecision(3) << std::setw(12) << (event.m_time_ns - start)/1e6
+      << " t" << std::setw(3) << std::left << event.m_thread << std::right
+      << " " << std::setw(16) << std::left << Trace::eventName(event.m_type) << std::right
+      << " " << objectName(names, event.m_object);
+    const uint64_t args[2] = {event.m_arg1, event.m_arg2};
+    for (unsigned arg = 0; arg < 2; arg++)
+    {
+      const char *name = Trace::argName(event.m_type, arg);
+      if (!*name) continue;
+      std::cout << " " << name << "=";
+      if (isObject(name)) std::cout << objectName(names, args[arg]);
+      else std::cout << args[arg];
+    }
+    std::cout << "\n";
+  }
+  return 0;
+}
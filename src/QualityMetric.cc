@@ -1,9 +1,15 @@
 
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
 #include <iostream>
 
 #include "FWCore/MessageLogger/interface/MessageLogger.h"
 
 #include "QualityMetric.h"
+#include "QualityMetricStore.h"
+#include "XrdClock.h"
+#include "XrdTrace.h"
 
 using namespace XrdAdaptor;
 
@@ -11,7 +17,7 @@ QualityMetricWatch::QualityMetricWatch(QualityMetric *parent1, QualityMetric *pa
     : m_parent1(parent1), m_parent2(parent2)
 {
     // TODO: just assuming success.
-    clock_gettime(CLOCK_MONOTONIC, &m_start);
+    MonotonicClock::now(m_start);
 }
 
 QualityMetricWatch::~QualityMetricWatch()
@@ -19,9 +25,9 @@ QualityMetricWatch::~QualityMetricWatch()
     if (m_parent1 && m_parent2)
     {
         timespec stop;
-        clock_gettime(CLOCK_MONOTONIC, &stop);
+        MonotonicClock::now(stop);
         int ms = 1000*(stop.tv_sec - m_start.tv_sec) + (stop.tv_nsec - m_start.tv_nsec)/1e6;
-        edm::LogVerbatim("XrdAdaptorInternal") << "Finished timer after " << ms << std::endl;
+        XRD_ADAPTOR_TRACE_EVENT(QualityWatch, m_parent1, ms, 0);
         m_parent1->finishWatch(stop, ms);
         m_parent2->finishWatch(stop, ms);
     }
@@ -54,78 +60,51 @@ QualityMetricWatch::swap(QualityMetricWatch &that)
 }
 
 
+static unsigned
+timeMS(const timespec &ts)
+{
+    return static_cast<unsigned>(static_cast<unsigned long long>(ts.tv_sec)*1000 + ts.tv_nsec/1000000);
+}
+
+unsigned long long
+QualityMetric::pack(unsigned time_ms, unsigned value)
+{
+    return (static_cast<unsigned long long>(time_ms) << 32) | value;
+}
+
 QualityMetric::QualityMetric(timespec now, int default_value)
-    : m_value(default_value),
-      m_interval0_n(0),
-      m_interval0_val(-1),
-      m_interval0_start(now.tv_sec),
-      m_interval1_val(-1),
-      m_interval2_val(-1),
-      m_interval3_val(-1),
-      m_interval4_val(-1)
+    : m_state(pack(timeMS(now), default_value*value_scale)),
+      m_sampled(false)
 {
 }
 
 void
 QualityMetric::finishWatch(timespec stop, int ms)
 {
-    m_value = -1;
-    if (stop.tv_sec > m_interval0_start+interval_length)
-    {
-        m_interval4_val = m_interval3_val;
-        m_interval3_val = m_interval2_val;
-        m_interval2_val = m_interval1_val;
-        m_interval1_val = m_interval0_val;
-        m_interval0_n = 1;
-        m_interval0_val = ms;
-        m_interval0_start = stop.tv_sec;
-    }
-    else
+    unsigned now = timeMS(stop);
+    double sample = static_cast<double>(std::max(ms, 0))*value_scale;
+    unsigned long long old_state = m_state.load(std::memory_order_relaxed);
+    unsigned long long new_state;
+    do
     {
-        int num = m_interval0_val * m_interval0_n + ms;
-        m_interval0_n++;
-        m_interval0_val = num / m_interval0_n;
+        unsigned last = old_state >> 32;
+        double value = static_cast<double>(old_state & 0xffffffff);
+        // Unsigned arithmetic copes with the 32-bit clock wrapping around.
+        unsigned elapsed = now - last;
+        // A racing update may carry a slightly later timestamp than ours.
+        if (elapsed > 0x80000000) elapsed = 0;
+        double weight = std::max(1.0/min_weight_inverse, 1.0 - exp(-static_cast<double>(elapsed)/time_constant_ms));
+        value += weight*(sample - value);
+        new_state = pack(elapsed ? now : last, static_cast<unsigned>(std::min(value, 4294967295.0)));
     }
+    while (!m_state.compare_exchange_weak(old_state, new_state, std::memory_order_relaxed));
+    m_sampled.store(true, std::memory_order_relaxed);
 }
 
 unsigned
-QualityMetric::get()
+QualityMetric::get() const
 {
-    if (m_value == -1)
-    {
-        unsigned den = 0;
-        m_value = 0;
-        if (m_interval0_val >= 0)
-        {
-            den += 16;
-            m_value = 16*m_interval0_val;
-        }
-        if (m_interval1_val >= 0)
-        {
-            den += 8;
-            m_value += 8*m_interval1_val;
-        }
-        if (m_interval2_val >= 0)
-        {
-            den += 4;
-            m_value += 4*m_interval2_val;
-        }
-        if (m_interval3_val >= 0)
-        {
-            den += 2;
-            m_value += 2*m_interval3_val;
-        }
-        if (m_interval4_val >= 0)
-        {
-            den += 1;
-            m_value += m_interval4_val;
-        }
-        if (den)
-            m_value /= den;
-        else
-            m_value = 260;
-    }
-    return m_value;
+    return (m_state.load(std::memory_order_relaxed) & 0xffffffff) / value_scale;
 }
 
 QualityMetricFactory * QualityMetricFactory::m_instance = new QualityMetricFactory();
@@ -133,11 +112,22 @@ QualityMetricFactory * QualityMetricFactory::m_instance = new QualityMetricFacto
 std::unique_ptr<QualityMetricSource>
 QualityMetricFactory::get(timespec now, const std::string &id)
 {
+    std::lock_guard<std::mutex> sentry(m_instance->m_mutex);
+    if (!m_instance->m_store_loaded) m_instance->loadStore();
     MetricMap::const_iterator it = m_instance->m_sources.find(id);
     QualityMetricUniqueSource *source;
     if (it == m_instance->m_sources.end())
     {
-        source = new QualityMetricUniqueSource(now);
+        auto stored = m_instance->m_stored.find(id);
+        if (stored != m_instance->m_stored.end())
+        {
+            edm::LogVerbatim("XrdAdaptorInternal") << "Using cached quality " << stored->second << " for source " << id;
+            source = new QualityMetricUniqueSource(now, stored->second);
+        }
+        else
+        {
+            source = new QualityMetricUniqueSource(now);
+        }
         m_instance->m_sources[id] = source;
     }
     else
@@ -147,6 +137,108 @@ QualityMetricFactory::get(timespec now, const std::string &id)
     return source->newSource(now);
 }
 
+unsigned
+QualityMetricFactory::estimate(const std::string &id)
+{
+    std::lock_guard<std::mutex> sentry(m_instance->m_mutex);
+    if (!m_instance->m_store_loaded) m_instance->loadStore();
+    MetricMap::const_iterator it = m_instance->m_sources.find(id);
+    if (it != m_instance->m_sources.end()) return it->second->get();
+    auto stored = m_instance->m_stored.find(id);
+    return (stored != m_instance->m_stored.end()) ? stored->second : 260;
+}
+
+void
+QualityMetricFactory::loadStore()
+{
+    m_store_loaded = true;
+    const char *path = getenv("XRD_ADAPTOR_QUALITY_CACHE");
+    if (!path || !*path) return;
+    m_store.reset(new QualityMetricStore(path));
+    m_store->load(m_stored, 260);
+    atexit(&QualityMetricFactory::flush);
+}
+
+void
+QualityMetricFactory::flush()
+{
+    std::lock_guard<std::mutex> sentry(m_instance->m_mutex);
+    if (!m_instance->m_store) return;
+    QualityMetricStore::ValueMap values;
+    for (const auto & it : m_instance->m_sources)
+    {
+        if (it.second->sampled()) values[it.first] = it.second->get();
+    }
+    m_instance->m_store->store(values);
+}
+
+ServerHealth * ServerHealth::m_instance = new ServerHealth();
+const unsigned ServerHealth::max_backoff;
+
+static time_t
+monotonicSeconds()
+{
+    timespec now;
+    MonotonicClock::now(now);
+    return now.tv_sec;
+}
+
+void
+ServerHealth::reportFailure(const std::string &id)
+{
+    m_instance->report(id, failure_expiry_s, true);
+}
+
+void
+ServerHealth::reportSlow(const std::string &id)
+{
+    m_instance->report(id, slow_expiry_s, false);
+}
+
+void
+ServerHealth::report(const std::string &id, unsigned expiry_s, bool failure)
+{
+    time_t now = monotonicSeconds();
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    auto it = m_servers.find(id);
+    if ((it != m_servers.end()) && (it->second.m_expires <= now)) {m_servers.erase(it); it = m_servers.end();}
+    if (it == m_servers.end())
+    {
+        edm::LogVerbatim("XrdAdaptorInternal") << "Marking server " << id << " as " << (failure ? "failed" : "slow")
+          << " for all files for " << expiry_s << "s";
+        it = m_servers.emplace(id, Entry{now, 0}).first;
+    }
+    Entry &entry = it->second;
+    if (failure)
+    {
+        expiry_s <<= std::min(entry.m_failures, max_backoff);
+        entry.m_failures++;
+    }
+    entry.m_expires = std::max(entry.m_expires, now + static_cast<time_t>(expiry_s));
+}
+
+bool
+ServerHealth::isBad(const std::string &id)
+{
+    time_t now = monotonicSeconds();
+    std::lock_guard<std::mutex> sentry(m_instance->m_mutex);
+    auto it = m_instance->m_servers.find(id);
+    return (it != m_instance->m_servers.end()) && (it->second.m_expires > now);
+}
+
+void
+ServerHealth::getBadServers(std::vector<std::string> &ids)
+{
+    time_t now = monotonicSeconds();
+    std::lock_guard<std::mutex> sentry(m_instance->m_mutex);
+    for (auto it = m_instance->m_servers.begin(); it != m_instance->m_servers.end(); )
+    {
+        if (it->second.m_expires <= now) {it = m_instance->m_servers.erase(it); continue;}
+        ids.push_back(it->first);
+        ++it;
+    }
+}
+
 QualityMetricSource::QualityMetricSource(QualityMetricUniqueSource &parent, timespec now, int default_value)
     : QualityMetric(now, default_value),
       m_parent(parent)
@@ -159,8 +251,8 @@ QualityMetricSource::startWatch(QualityMetricWatch & watch)
     watch.swap(tmp);
 }
 
-QualityMetricUniqueSource::QualityMetricUniqueSource(timespec now)
-    : QualityMetric(now)
+QualityMetricUniqueSource::QualityMetricUniqueSource(timespec now, int default_value)
+    : QualityMetric(now, default_value)
 {}
 
 std::unique_ptr<QualityMetricSource>
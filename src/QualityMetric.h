@@ -3,8 +3,11 @@
 
 #include <time.h>
 
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 
 #include <boost/utility.hpp>
 
@@ -31,41 +34,135 @@ private:
     QualityMetric *m_parent2;
 };
 
+/**
+ * The quality of a source: an exponentially-weighted moving average of the
+ * request response time, in milliseconds.
+ *
+ * The weight of a new sample grows with the time since the previous one
+ * (1 - exp(-dt/time_constant_ms)), with a floor of 1/min_weight_inverse, so
+ * old history decays continuously rather than in fixed intervals.  The value
+ * and the time of the last update are packed into a single atomic word;
+ * updates use compare-and-swap and reads never lock.
+ */
 class QualityMetric : boost::noncopyable {
 friend class QualityMetricWatch;
 
 public:
     QualityMetric(timespec now, int default_value=260);
-    unsigned get();
+    unsigned get() const;
+
+    /**
+     * True once a request has been timed; until then get() is just the
+     * default value.
+     */
+    bool sampled() const {return m_sampled.load(std::memory_order_relaxed);}
 
 private:
     void finishWatch(timespec now, int ms);
 
-    static const unsigned interval_length = 60;
+    static const unsigned time_constant_ms = 10000;
+    static const unsigned min_weight_inverse = 16;
+    // The value is stored in fixed point with this many fractional steps per ms.
+    static const unsigned value_scale = 16;
 
-    int m_value;
-    int m_interval0_n;
-    int m_interval0_val;
-    time_t m_interval0_start;
-    int m_interval1_val;
-    int m_interval2_val;
-    int m_interval3_val;
-    int m_interval4_val;
+    static unsigned long long pack(unsigned time_ms, unsigned value);
 
+    // High 32 bits: monotonic time of last update, in ms (wrapping).
+    // Low 32 bits: value in units of 1/value_scale ms.
+    std::atomic<unsigned long long> m_state;
+    std::atomic<bool> m_sampled;
 };
 
+class QualityMetricStore;
+
+/**
+ * Hands out per-source metrics, sharing the history of each source ID within
+ * the process.  If the XRD_ADAPTOR_QUALITY_CACHE environment variable names a
+ * file, qualities are also seeded from it on first use and written back at
+ * process exit, so they carry over between jobs on the same node.
+ */
 class QualityMetricFactory {
 
 friend class Source;
 
+public:
+    /**
+     * The current quality of a source ID, or its persisted quality if it
+     * has not been used in this process; used to rank servers before any
+     * of them is opened.
+     */
+    static unsigned estimate(const std::string &id);
+
 private:
     static
     std::unique_ptr<QualityMetricSource> get(timespec now, const std::string &id);
 
+    /**
+     * Write the qualities measured in this process to the persistent store;
+     * registered with atexit.  Those only seeded from the store keep their
+     * stored value and last-seen time.
+     */
+    static void flush();
+
+    void loadStore();
+
     static QualityMetricFactory *m_instance;
 
     typedef std::unordered_map<std::string, QualityMetricUniqueSource*> MetricMap;
     MetricMap m_sources;
+    std::unique_ptr<QualityMetricStore> m_store;
+    // Initial values loaded from m_store for sources not yet seen.
+    std::unordered_map<std::string, unsigned> m_stored;
+    bool m_store_loaded = false;
+    // Sources are created from XrdCl callback threads as well as the framework.
+    std::mutex m_mutex;
+};
+
+/**
+ * A process-wide record of the servers which recently failed or were dropped
+ * for poor quality, shared by every open file so that a server which failed
+ * for one file is not tried again for the next.  Entries expire after a
+ * fixed time; a server that keeps failing stays bad for longer.
+ */
+class ServerHealth {
+
+public:
+    /**
+     * Record that a request or open at the server ID failed.
+     */
+    static void reportFailure(const std::string &id);
+
+    /**
+     * Record that the server ID was removed from the active sources for
+     * being much slower than the others.
+     */
+    static void reportSlow(const std::string &id);
+
+    static bool isBad(const std::string &id);
+
+    /**
+     * Append the IDs of all the servers currently considered bad.
+     */
+    static void getBadServers(std::vector<std::string> &ids);
+
+private:
+    void report(const std::string &id, unsigned expiry_s, bool failure);
+
+    static const unsigned failure_expiry_s = 10*60;
+    static const unsigned slow_expiry_s = 2*60;
+    // Repeated failures double the expiry, up to this many times.
+    static const unsigned max_backoff = 3;
+
+    struct Entry {
+        time_t m_expires;
+        unsigned m_failures;
+    };
+
+    static ServerHealth *m_instance;
+
+    std::unordered_map<std::string, Entry> m_servers;
+    // Reports come from XrdCl callback threads as well as the framework.
+    std::mutex m_mutex;
 };
 
 /**
@@ -93,7 +190,7 @@ class QualityMetricUniqueSource final : public QualityMetric {
 friend class QualityMetricFactory;
 
 private:
-    QualityMetricUniqueSource(timespec now);
+    QualityMetricUniqueSource(timespec now, int default_value=260);
     std::unique_ptr<QualityMetricSource> newSource(timespec now);
 };
 
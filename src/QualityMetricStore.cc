@@ -0,0 +1,176 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include "FWCore/MessageLogger/interface/MessageLogger.h"
+
+#include "QualityMetricStore.h"
+
+using namespace XrdAdaptor;
+
+namespace {
+  // Holds a flock() for the lifetime of the object.
+  class FileLock : boost::noncopyable {
+  public:
+    FileLock(int fd, int operation) : m_fd(fd), m_locked(false)
+    {
+      int retval;
+      while (((retval = flock(m_fd, operation)) == -1) && (errno == EINTR)) {}
+      m_locked = (retval == 0);
+    }
+    ~FileLock() {if (m_locked) flock(m_fd, LOCK_UN);}
+    bool locked() const {return m_locked;}
+  private:
+    int m_fd;
+    bool m_locked;
+  };
+}
+
+QualityMetricStore::QualityMetricStore(const std::string &path)
+    : m_path(path),
+      m_fd(-1),
+      m_map(nullptr),
+      m_size(sizeof(Header) + slots*sizeof(Entry))
+{
+    if (!map())
+    {
+        edm::LogWarning("XrdAdaptorInternal") << "Unable to use source quality cache " << m_path
+          << ": " << strerror(errno) << "; sources will start with default quality.";
+    }
+}
+
+QualityMetricStore::~QualityMetricStore()
+{
+    if (m_map) munmap(m_map, m_size);
+    if (m_fd >= 0) close(m_fd);
+}
+
+bool
+QualityMetricStore::map()
+{
+    m_fd = open(m_path.c_str(), O_RDWR|O_CREAT, 0644);
+    if (m_fd < 0) return false;
+
+    // Size and initialize a new file while holding the exclusive lock, so
+    // no other job maps it half-way through.
+    {
+        FileLock lock(m_fd, LOCK_EX);
+        if (!lock.locked()) return false;
+        struct stat buf;
+        if (fstat(m_fd, &buf) == -1) return false;
+        // Start afresh with a file of another layout, or one whose creation
+        // was interrupted.
+        Header existing;
+        if ((static_cast<size_t>(buf.st_size) != m_size)
+            || (pread(m_fd, &existing, sizeof(existing), 0) != sizeof(existing))
+            || (existing.m_magic != magic) || (existing.m_version != version) || (existing.m_slots != slots))
+        {
+            if ((ftruncate(m_fd, 0) == -1) || (ftruncate(m_fd, m_size) == -1)) return false;
+            Header header = {magic, version, slots, 0};
+            if (pwrite(m_fd, &header, sizeof(header), 0) != sizeof(header)) return false;
+        }
+    }
+
+    void *ptr = mmap(nullptr, m_size, PROT_READ|PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (ptr == MAP_FAILED) return false;
+    const Header *header = static_cast<const Header*>(ptr);
+    if ((header->m_magic != magic) || (header->m_version != version) || (header->m_slots != slots))
+    {
+        munmap(ptr, m_size);
+        errno = EINVAL;
+        return false;
+    }
+    m_map = ptr;
+    return true;
+}
+
+size_t
+QualityMetricStore::hash(const std::string &id)
+{
+    // FNV-1a, like the checksum: every job sharing the file must agree on
+    // where an ID lives, whichever standard library it was built with.
+    uint32_t result = 2166136261u;
+    for (const char c : id)
+    {
+        result = (result ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return result % slots;
+}
+
+uint32_t
+QualityMetricStore::checksum(const Entry &entry)
+{
+    // FNV-1a over everything but the checksum itself.
+    uint32_t result = 2166136261u;
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&entry);
+    for (size_t idx = 0; idx < offsetof(Entry, m_checksum); idx++)
+    {
+        result = (result ^ bytes[idx]) * 16777619u;
+    }
+    return result;
+}
+
+void
+QualityMetricStore::load(ValueMap &values, unsigned default_value)
+{
+    if (!m_map) return;
+    FileLock lock(m_fd, LOCK_SH);
+    if (!lock.locked()) return;
+
+    time_t now = time(NULL);
+    const Entry *table = entries();
+    for (uint32_t idx = 0; idx < slots; idx++)
+    {
+        const Entry &entry = table[idx];
+        if (!valid(entry)) continue;
+        std::string id(entry.m_id, strnlen(entry.m_id, sizeof(entry.m_id)));
+        double age = std::max(static_cast<double>(now - entry.m_last_seen), 0.0);
+        double weight = exp(-age/decay_seconds);
+        values[id] = static_cast<unsigned>(default_value + weight*(static_cast<double>(entry.m_value) - default_value));
+    }
+}
+
+void
+QualityMetricStore::store(const ValueMap &values)
+{
+    if (!m_map) return;
+    FileLock lock(m_fd, LOCK_EX);
+    if (!lock.locked()) return;
+
+    time_t now = time(NULL);
+    Entry *table = entries();
+    for (const auto & it : values)
+    {
+        if (it.first.size() >= sizeof(table[0].m_id)) continue;
+        // Linear probing; if the table is full, replace the stalest entry.
+        size_t start = hash(it.first);
+        Entry *slot = nullptr;
+        Entry *oldest = &table[start];
+        for (uint32_t probe = 0; probe < slots; probe++)
+        {
+            Entry &entry = table[(start + probe) % slots];
+            if (!valid(entry) || !strncmp(entry.m_id, it.first.c_str(), sizeof(entry.m_id)))
+            {
+                slot = &entry;
+                break;
+            }
+            if (entry.m_last_seen < oldest->m_last_seen) oldest = &entry;
+        }
+        if (!slot) slot = oldest;
+        memset(slot->m_id, 0, sizeof(slot->m_id));
+        memcpy(slot->m_id, it.first.c_str(), it.first.size());
+        slot->m_value = it.second;
+        slot->m_last_seen = now;
+        slot->m_checksum = checksum(*slot);
+    }
+    msync(m_map, m_size, MS_SYNC);
+}
@@ -0,0 +1,82 @@
+#ifndef Utilities_XrdAdaptor_QualityMetricStore_h
+#define Utilities_XrdAdaptor_QualityMetricStore_h
+
+#include <time.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+
+#include <boost/utility.hpp>
+
+namespace XrdAdaptor {
+
+/**
+ * An on-disk table of source qualities shared by all jobs on a node, so
+ * that a new job starts with what the previous ones learned.
+ *
+ * The file is a fixed-size, open-addressed hash table keyed by server ID and
+ * mapped into memory with MAP_SHARED.  Readers hold a shared flock() and
+ * writers an exclusive one, so concurrent jobs never see a partial update.
+ * A job which dies mid-update can still leave an entry half-written, so
+ * each entry carries a checksum and one which fails it is treated as
+ * unused.  All failures are non-fatal: the store simply behaves as if empty.
+ */
+class QualityMetricStore : boost::noncopyable {
+
+public:
+    typedef std::unordered_map<std::string, unsigned> ValueMap;
+
+    explicit QualityMetricStore(const std::string &path);
+    ~QualityMetricStore();
+
+    /**
+     * Read every entry, decaying each value towards default_value according
+     * to how long ago it was last seen.
+     */
+    void load(ValueMap &values, unsigned default_value);
+
+    /**
+     * Record the given values, with the current time as their last-seen time.
+     */
+    void store(const ValueMap &values);
+
+private:
+    struct Header {
+        uint32_t m_magic;
+        uint32_t m_version;
+        uint32_t m_slots;
+        uint32_t m_padding;
+    };
+
+    struct Entry {
+        char m_id[240];
+        // Wall-clock seconds; 0 for an unused slot.
+        int64_t m_last_seen;
+        uint32_t m_value;
+        // Of the fields above; see valid().
+        uint32_t m_checksum;
+    };
+
+    static const uint32_t magic = 0x58514d53; // "XQMS"
+    static const uint32_t version = 3;
+    static const uint32_t slots = 1024;
+    // Stored values relax towards the default with this time constant.
+    static const unsigned decay_seconds = 3600;
+
+    bool map();
+    Entry *entries() const {return reinterpret_cast<Entry*>(static_cast<char*>(m_map) + sizeof(Header));}
+    static size_t hash(const std::string &id);
+    static uint32_t checksum(const Entry &entry);
+    // In use, and not torn by a crash during store().
+    static bool valid(const Entry &entry) {return entry.m_last_seen && (entry.m_checksum == checksum(entry));}
+
+    const std::string m_path;
+    int m_fd;
+    void *m_map;
+    size_t m_size;
+};
+
+}
+
+#endif
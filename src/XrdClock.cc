@@ -0,0 +1,6 @@
+
+#include "XrdClock.h"
+
+using namespace XrdAdaptor;
+
+std::atomic<MonotonicClock::NowFunction> MonotonicClock::m_function(nullptr);
@@ -0,0 +1,41 @@
+#ifndef Utilities_XrdAdaptor_XrdClock_h
+#define Utilities_XrdAdaptor_XrdClock_h
+
+#include <time.h>
+
+#include <atomic>
+
+namespace XrdAdaptor {
+
+/**
+ * The monotonic clock behind every timing decision of the adaptor: quality
+ * metrics, source checks, hedging, windows and read-ahead.
+ *
+ * By default it reads CLOCK_MONOTONIC.  A simulation may install its own
+ * source of time, so that the minutes-long behavior of the source selection
+ * can be run in simulated time; this must happen before any file is opened.
+ */
+class MonotonicClock {
+
+public:
+    typedef void (*NowFunction)(timespec &now);
+
+    static void now(timespec &ts)
+    {
+        NowFunction function = m_function.load(std::memory_order_relaxed);
+        if (function) function(ts);
+        else clock_gettime(CLOCK_MONOTONIC, &ts);
+    }
+
+    /**
+     * Install a source of time; nullptr restores CLOCK_MONOTONIC.
+     */
+    static void setNowFunction(NowFunction function) {m_function.store(function, std::memory_order_relaxed);}
+
+private:
+    static std::atomic<NowFunction> m_function;
+};
+
+}
+
+#endif
@@ -0,0 +1,150 @@
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "XrdCoalescer.h"
+
+using namespace XrdAdaptor;
+
+void
+ReadCoalescer::Plan::scatter() const
+{
+    for (const auto & copy : m_copies)
+    {
+        memcpy(copy.m_to, copy.m_from, copy.m_size);
+    }
+}
+
+IOSize
+ReadCoalescer::Plan::finish(IOSize total, IOSize served) const
+{
+    IOSize gaps = (m_wire > m_requested) ? m_wire - m_requested : 0;
+    if (total != served + m_wire) return (total > gaps) ? total - gaps : 0;
+    scatter();
+    return served + m_requested;
+}
+
+ReadCoalescer::ReadCoalescer(IOSize max_gap, IOSize max_size)
+    : m_max_gap(max_gap),
+      m_max_size(max_size),
+      m_coalesced_bytes(0),
+      m_over_read_bytes(0),
+      m_free(new FreePlans())
+{
+}
+
+std::shared_ptr<ReadCoalescer::Plan>
+ReadCoalescer::acquirePlan(const RequestPool &pool)
+{
+    std::shared_ptr<FreePlans> plans = m_free;
+    std::unique_ptr<Plan> plan;
+    {
+        std::lock_guard<std::mutex> sentry(plans->m_mutex);
+        if (!plans->m_plans.empty())
+        {
+            plan = std::move(plans->m_plans.back());
+            plans->m_plans.pop_back();
+        }
+    }
+    if (!plan) plan.reset(new Plan());
+    return std::shared_ptr<Plan>(plan.release(), [plans](Plan *released) {
+        std::unique_ptr<Plan> owned(released);
+        if (owned->m_buffer.capacity() > max_recycled_buffer) return;
+        owned->m_copies.clear();
+        std::lock_guard<std::mutex> sentry(plans->m_mutex);
+        if (plans->m_plans.size() < max_free_plans) plans->m_plans.push_back(std::move(owned));
+    }, pool.allocator<char>());
+}
+
+std::shared_ptr<ReadCoalescer::Plan>
+ReadCoalescer::coalesce(const std::vector<IOPosBuffer> &iolist, std::vector<IOPosBuffer> &out, const RequestPool &pool)
+{
+    if (!m_max_gap || (iolist.size() < 2)) return std::shared_ptr<Plan>();
+
+    // Order the chunks by offset, keeping equal offsets in request order (the
+    // pointers are into iolist); std::stable_sort would allocate a buffer.
+    // Reused between calls on the same thread.
+    static thread_local std::vector<const IOPosBuffer*> sorted;
+    sorted.clear();
+    sorted.reserve(iolist.size());
+    for (const auto & it : iolist) sorted.push_back(&it);
+    std::sort(sorted.begin(), sorted.end(), [](const IOPosBuffer *a, const IOPosBuffer *b) {
+        return (a->offset() < b->offset()) || ((a->offset() == b->offset()) && (a < b));
+    });
+
+    // First pass: find the groups of chunks to merge.  A group is described
+    // by the index of its first chunk (in sorted) and its extent.
+    struct Group {
+        size_t m_first;
+        size_t m_count;
+        IOOffset m_start;
+        IOOffset m_end;
+    };
+    static thread_local std::vector<Group> groups;
+    groups.clear();
+    size_t merged_chunks = 0;
+    IOSize buffer_size = 0;
+    for (size_t idx = 0; idx < sorted.size(); idx++)
+    {
+        const IOPosBuffer &chunk = *sorted[idx];
+        IOOffset end = chunk.offset() + static_cast<IOOffset>(chunk.size());
+        if (!groups.empty())
+        {
+            Group &last = groups.back();
+            IOOffset merged_end = std::max(last.m_end, end);
+            if (chunk.size() && (chunk.offset() <= last.m_end + static_cast<IOOffset>(m_max_gap))
+                && (merged_end - last.m_start <= static_cast<IOOffset>(m_max_size)))
+            {
+                last.m_end = merged_end;
+                last.m_count++;
+                continue;
+            }
+        }
+        groups.push_back(Group{idx, 1, chunk.offset(), end});
+    }
+    for (const auto & group : groups)
+    {
+        if (group.m_count == 1) continue;
+        merged_chunks += group.m_count;
+        buffer_size += group.m_end - group.m_start;
+    }
+    if (!merged_chunks) return std::shared_ptr<Plan>();
+
+    // Second pass: lay the merged groups out in the scratch buffer.
+    std::shared_ptr<Plan> plan = acquirePlan(pool);
+    plan->m_buffer.resize(buffer_size);
+    plan->m_copies.reserve(merged_chunks);
+    plan->m_requested = 0;
+    plan->m_wire = 0;
+    out.clear();
+    out.reserve(groups.size());
+    char *buffer = plan->m_buffer.empty() ? nullptr : &plan->m_buffer[0];
+    IOSize coalesced = 0;
+    for (const auto & group : groups)
+    {
+        IOSize extent = group.m_end - group.m_start;
+        plan->m_wire += extent;
+        if (group.m_count == 1)
+        {
+            const IOPosBuffer &chunk = *sorted[group.m_first];
+            plan->m_requested += chunk.size();
+            out.push_back(chunk);
+            continue;
+        }
+        for (size_t idx = group.m_first; idx < group.m_first + group.m_count; idx++)
+        {
+            const IOPosBuffer &chunk = *sorted[idx];
+            Plan::Copy copy = {buffer + (chunk.offset() - group.m_start), static_cast<char*>(chunk.data()), chunk.size()};
+            plan->m_copies.push_back(copy);
+            plan->m_requested += chunk.size();
+            coalesced += chunk.size();
+        }
+        out.push_back(IOPosBuffer(group.m_start, buffer, extent));
+        buffer += extent;
+    }
+    m_coalesced_bytes += coalesced;
+    // Overlapping chunks may request more than the merged extent.
+    if (buffer_size > coalesced) m_over_read_bytes += buffer_size - coalesced;
+    return plan;
+}
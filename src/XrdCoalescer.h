@@ -0,0 +1,105 @@
+#ifndef Utilities_XrdAdaptor_XrdCoalescer_h
+#define Utilities_XrdAdaptor_XrdCoalescer_h
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <boost/utility.hpp>
+
+#include "Utilities/StorageFactory/interface/Storage.h"
+
+#include "XrdRequestPool.h"
+
+namespace XrdAdaptor {
+
+/**
+ * Merges the chunks of a vector read which are separated by small gaps.
+ *
+ * ROOT tends to request many small, nearly-adjacent chunks; each costs the
+ * server a seek and the protocol a chunk header.  Chunks whose gap is at
+ * most the threshold are instead read as a single range into a scratch
+ * buffer, and copied out to the client's buffers once the read completes.
+ * The bytes read for the gaps are counted so the threshold can be tuned.
+ */
+class ReadCoalescer : boost::noncopyable {
+
+public:
+    /**
+     * The merged reads for one vector read.
+     */
+    class Plan : boost::noncopyable {
+    friend class ReadCoalescer;
+
+    public:
+        /**
+         * Copy the merged reads out to the client's buffers.
+         */
+        void scatter() const;
+
+        /**
+         * Complete the client's read once total bytes have arrived, served
+         * of them straight into the client's chunks, and return the bytes
+         * the client sees.  A short read leaves the merged ranges
+         * incomplete, so nothing is copied out and the result is short.
+         */
+        IOSize finish(IOSize total, IOSize served) const;
+
+        IOSize requested() const {return m_requested;}
+        IOSize wire() const {return m_wire;}
+
+    private:
+        struct Copy {
+            const char *m_from;
+            char *m_to;
+            IOSize m_size;
+        };
+
+        std::vector<char> m_buffer;
+        std::vector<Copy> m_copies;
+        IOSize m_requested;
+        IOSize m_wire;
+    };
+
+    ReadCoalescer(IOSize max_gap, IOSize max_size);
+
+    /**
+     * Fill out with the chunks to read, sorted by offset.  Returns the plan
+     * to complete once the read finishes, or an empty pointer (leaving out
+     * untouched) if no chunks could be merged.  Plans are recycled, with
+     * their buffers, once released; the reference count comes from pool.
+     */
+    std::shared_ptr<Plan> coalesce(const std::vector<IOPosBuffer> &iolist, std::vector<IOPosBuffer> &out, const RequestPool &pool);
+
+    IOSize maxGap() const {return m_max_gap;}
+    IOOffset coalescedBytes() const {return m_coalesced_bytes;}
+    IOOffset overReadBytes() const {return m_over_read_bytes;}
+
+private:
+    // Keep enough plans for a few reads in flight per thread; a plan whose
+    // buffer grew past the limit is freed instead.
+    static const size_t max_free_plans = 16;
+    static const size_t max_recycled_buffer = 8*1024*1024;
+
+    struct FreePlans {
+        std::vector<std::unique_ptr<Plan> > m_plans;
+        std::mutex m_mutex;
+    };
+
+    std::shared_ptr<Plan> acquirePlan(const RequestPool &pool);
+
+    const IOSize m_max_gap;
+    // Merged ranges never exceed this, so they remain valid XrdCl chunks.
+    const IOSize m_max_size;
+    // Client bytes served by merged reads, and the gap bytes read with them.
+    std::atomic<IOOffset> m_coalesced_bytes;
+    std::atomic<IOOffset> m_over_read_bytes;
+    // Plans may outlive the coalescer (a read still outstanding when the
+    // file is closed), so they share ownership of the free list.
+    std::shared_ptr<FreePlans> m_free;
+};
+
+}
+
+#endif
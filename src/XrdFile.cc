@@ -1,13 +1,18 @@
 #include "Utilities/XrdAdaptor/src/XrdFile.h"
+#include "Utilities/XrdAdaptor/src/XrdClock.h"
 #include "Utilities/XrdAdaptor/src/XrdRequestManager.h"
+#include "Utilities/XrdAdaptor/src/XrdPrefetchCache.h"
+#include "Utilities/XrdAdaptor/src/XrdReadAhead.h"
+#include "Utilities/XrdAdaptor/src/XrdTrace.h"
+#include "Utilities/XrdAdaptor/src/XrdWriteBehind.h"
 #include "FWCore/Utilities/interface/EDMException.h"
 #include "FWCore/MessageLogger/interface/MessageLogger.h"
 #include "FWCore/Utilities/interface/Likely.h"
-#include "FWCore/Utilities/interface/CPUTimer.h"
 #include <vector>
 #include <sstream>
 #include <iostream>
 #include <assert.h>
+#include <stdlib.h>
 
 using namespace XrdAdaptor;
 
@@ -16,12 +21,134 @@ using namespace XrdAdaptor;
 
 #define XRD_CL_MAX_CHUNK 512*1024
 
+// Upper bound on the memory held by outstanding and unconsumed prefetches.
+#define XRD_ADAPTOR_PREFETCH_MAX_BYTES 64*1024*1024
+
+// Buffered writes are sent in blocks of this size, aligned in the file.
+#define XRD_ADAPTOR_WRITE_BLOCK 1024*1024
+// Upper bound on the memory held by buffered and in-flight writes; zero
+// sends every write synchronously.  Off unless requested: a buffered write
+// which fails is only reported by a later write, flush or close, and the
+// output modules check each write as it is made.
+#define XRD_ADAPTOR_WRITE_BEHIND_BYTES 0
+
+// Sequential reads are read ahead in blocks of this size, aligned in the
+// file, holding at most this much memory; zero disables read-ahead.  Off
+// unless requested: most clients read through TTreeCache, which already
+// reads ahead, and blocks they skip are wasted bandwidth.
+#define XRD_ADAPTOR_READAHEAD_BLOCK 512*1024
+#define XRD_ADAPTOR_READAHEAD_MAX_BYTES 0
+
+static IOSize
+readAheadBytes()
+{
+  const char *bytes = getenv("XRD_ADAPTOR_READAHEAD_MAX_BYTES");
+  return bytes ? strtoul(bytes, nullptr, 10) : XRD_ADAPTOR_READAHEAD_MAX_BYTES;
+}
+
+static IOSize
+writeBehindBytes()
+{
+  const char *bytes = getenv("XRD_ADAPTOR_WRITE_BEHIND_BYTES");
+  return bytes ? strtoul(bytes, nullptr, 10) : XRD_ADAPTOR_WRITE_BEHIND_BYTES;
+}
+
+/**
+ * Records one operation of the file, if recording is enabled, when it goes
+ * out of scope; an operation left by an exception is recorded as failed.
+ */
+class XrdFile::Recording {
+public:
+  Recording (XrdFile &file, Recorder::RecordType type, IOOffset offset, IOSize size,
+             const IOPosBuffer *chunks = nullptr, IOSize n = 0, uint8_t flags = 0)
+    : m_result(0), m_succeeded(false), m_deferred(false)
+  {
+    if (!file.m_recorder) return;
+    m_pending = std::make_shared<Pending>();
+    Pending &pending = *m_pending;
+    pending.m_recorder = file.m_recorder;
+    pending.m_file = file.m_record_file;
+    pending.m_type = type;
+    pending.m_thread = file.m_recorder->threadNumber();
+    pending.m_flags = flags;
+    pending.m_offset = offset;
+    pending.m_size = size;
+    // An asynchronous caller may reuse its chunk list once we return.
+    pending.m_chunks.assign(chunks, chunks + n);
+    pending.m_manager = file.m_requestmanager;
+    pending.m_done = false;
+    MonotonicClock::now(pending.m_start);
+    for (IOSize i = 0; i < n; i++)
+      pending.m_size += chunks[i].size();
+  }
+
+  ~Recording (void)
+  {
+    if (!m_pending) return;
+    // Without a result, the operation threw.  Once issued, an asynchronous
+    // operation is recorded by its completion hook.
+    if (m_deferred && m_succeeded) return;
+    m_pending->finish(m_result, !m_succeeded);
+  }
+
+  void setResult (IOSize result) { m_result = result; m_succeeded = true; }
+
+  /**
+   * For an asynchronous operation: a hook which records it when its future
+   * becomes ready.  Call setIssued() once the operation has been issued.
+   */
+  CompletionHook completionHook (void)
+  {
+    if (!m_pending) return CompletionHook();
+    m_deferred = true;
+    std::shared_ptr<Pending> pending = m_pending;
+    return [pending](IOSize result, std::exception_ptr error) {pending->finish(result, static_cast<bool>(error));};
+  }
+
+  void setIssued (void) { m_succeeded = true; }
+
+private:
+  struct Pending {
+    Recorder *m_recorder;
+    uint16_t m_file;
+    Recorder::RecordType m_type;
+    uint16_t m_thread;
+    uint8_t m_flags;
+    IOOffset m_offset;
+    IOSize m_size;
+    std::vector<IOPosBuffer> m_chunks;
+    // The hook may run after the file is closed.
+    std::weak_ptr<RequestManager> m_manager;
+    timespec m_start;
+    // Set by whichever of the hook and the destructor records the operation.
+    std::atomic<bool> m_done;
+
+    void finish (IOSize result, bool failed)
+    {
+      if (m_done.exchange(true)) return;
+      std::vector<std::string> sources;
+      std::shared_ptr<RequestManager> manager = m_manager.lock();
+      if (manager.get())
+        manager->getActiveSourceNames(sources);
+      uint8_t flags = m_flags | (failed ? Recorder::Failed : 0);
+      m_recorder->record(m_type, m_file, m_start, m_thread, flags, m_offset, m_size,
+                         result, m_chunks.empty() ? nullptr : &m_chunks[0], m_chunks.size(), sources);
+    }
+  };
+
+  std::shared_ptr<Pending> m_pending;
+  IOSize m_result;
+  bool m_succeeded;
+  bool m_deferred;
+};
+
 XrdFile::XrdFile (void)
   :  m_offset (0),
     m_size(-1),
     m_close (false),
     m_name(),
-    m_op_count(0)
+    m_recorder(nullptr),
+    m_record_file(0)
 {
 }
 
@@ -32,7 +159,8 @@ XrdFile::XrdFile (const char *name,
     m_size(-1),
     m_close (false),
     m_name(),
-    m_op_count(0)
+    m_recorder(nullptr),
+    m_record_file(0)
 {
   open (name, flags, perms);
 }
@@ -44,7 +172,8 @@ XrdFile::XrdFile (const std::string &name,
     m_size(-1),
     m_close (false),
     m_name(),
-    m_op_count(0)
+    m_recorder(nullptr),
+    m_record_file(0)
 {
   open (name.c_str (), flags, perms);
 }
@@ -55,6 +184,13 @@ XrdFile::~XrdFile (void)
     edm::LogError("XrdFileError")
       << "Destructor called on XROOTD file '" << m_name
       << "' but the file is still open";
+  // Requests in flight may keep the request manager alive past us; stop its
+  // work here, once any buffered writes are sent.
+  m_writebehind.reset();
+  m_readahead.reset();
+  m_prefetch.reset();
+  if (m_requestmanager.get())
+    m_requestmanager->close();
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -143,7 +279,15 @@ XrdFile::open (const char *name,
   modeflags |= (perms & S_IWOTH) ? XrdCl::Access::GW : XrdCl::Access::None;
   modeflags |= (perms & S_IXOTH) ? XrdCl::Access::GX : XrdCl::Access::None;
 
-  m_requestmanager.reset(new RequestManager(name, openflags, modeflags));
+  m_requestmanager = RequestManager::getInstance(name, openflags, modeflags);
+  m_prefetch.reset(new PrefetchCache(*m_requestmanager, XRD_ADAPTOR_PREFETCH_MAX_BYTES));
+  IOSize readAhead = readAheadBytes();
+  if (readAhead)
+    m_readahead.reset(new ReadAhead(*m_requestmanager, XRD_ADAPTOR_READAHEAD_BLOCK, readAhead));
+  // Writes are buffered unless the caller asked otherwise.
+  IOSize writeBehind = writeBehindBytes();
+  if ((flags & IOFlags::OpenWrite) && !(flags & IOFlags::OpenUnbuffered) && writeBehind)
+    m_writebehind.reset(new WriteBehind(*m_requestmanager, XRD_ADAPTOR_WRITE_BLOCK, writeBehind));
   m_name = name;
 
   // Stat the file so we can keep track of the offset better.
@@ -166,6 +310,10 @@ XrdFile::open (const char *name,
   m_offset = 0;
   m_close = true;
 
+  m_recorder = Recorder::instance();
+  if (m_recorder)
+    m_record_file = m_recorder->open(m_name, flags);
+
   // Send the monitoring info, if available.
   // Note: getenv is not reentrant.
   // Commenting out until this is available in the new client.
@@ -201,43 +349,101 @@ XrdFile::close (void)
     return;
   }
 
+  // Buffered writes must complete before the file is closed; a failure is
+  // reported once the file is closed regardless.
+  XrdCl::XRootDStatus status;
+  if (m_writebehind.get())
+    status = m_writebehind->flush();
+
+  // The prefetch cache and buffered writes must drain before their request
+  // manager goes away.
+  m_writebehind.reset();
+  m_readahead.reset();
+  m_prefetch.reset();
+  m_requestmanager->close();
   m_requestmanager.reset();
 
+  if (m_recorder)
+    m_recorder->close(m_record_file);
+  m_recorder = nullptr;
   m_close = false;
   m_offset = 0;
   m_size = -1;
+  if (!status.IsOK()) {
+    cms::Exception ex("FileWriteError");
+    ex << "XrdFile::close(name='" << m_name
+       << "') buffered write failed with error '" << status.ToString()
+       << "' (errno=" << status.errNo << ", code=" << status.code << ")";
+    ex.addContext("Calling XrdFile::close()");
+    throw ex;
+  }
   edm::LogInfo("XrdFileInfo") << "Closed " << m_name;
 }
 
 void
 XrdFile::abort (void)
 {
-  m_requestmanager.reset(nullptr);
+  // Unlike close, buffered writes are dropped rather than sent.
+  if (m_writebehind.get())
+    m_writebehind->discard();
+  m_writebehind.reset(nullptr);
+  m_readahead.reset(nullptr);
+  m_prefetch.reset(nullptr);
+  if (m_requestmanager.get())
+    m_requestmanager->close();
+  m_requestmanager.reset();
+  if (m_recorder)
+    m_recorder->close(m_record_file);
+  m_recorder = nullptr;
   m_close = false;
   m_offset = 0;
   m_size = -1;
 }
 
 //////////////////////////////////////////////////////////////////////
+static std::future<IOSize>
+readyFuture (IOSize value, const CompletionHook &hook = CompletionHook())
+{
+  if (hook) hook(value, std::exception_ptr());
+  std::promise<IOSize> promise;
+  promise.set_value(value);
+  return promise.get_future();
+}
+
 IOSize
 XrdFile::read (void *into, IOSize n)
 {
-  if (n > 0x7fffffff) {
-    edm::Exception ex(edm::errors::FileReadError);
-    ex << "XrdFile::read(name='" << m_name << "', n=" << n
-       << ") too many bytes, limit is 0x7fffffff";
-    ex.addContext("Calling XrdFile::read()");
-    addConnection(ex);
-    throw ex;
-  }
-
-  uint32_t bytesRead = m_requestmanager->handle(into, n, m_offset).get();
+  IOSize bytesRead = read(into, n, m_offset);
   m_offset += bytesRead;
   return bytesRead;
 }
 
 IOSize
 XrdFile::read (void *into, IOSize n, IOOffset pos)
+{
+  Recording recording(*this, Recorder::Read, pos, n);
+
+  // Only blocking reads are read ahead: serving from the window may wait.
+  // A write drops the window, so the reads which restart it go through
+  // startRead() and flush the writes first.
+  IOSize bytesRead;
+  if (!m_readahead.get() || !m_readahead->read(into, n, pos, m_size, bytesRead))
+    bytesRead = startRead(into, n, pos, true).get();
+  recording.setResult(bytesRead);
+  return bytesRead;
+}
+
+std::future<IOSize>
+XrdFile::readAsync (void *into, IOSize n, IOOffset pos)
+{
+  Recording recording(*this, Recorder::Read, pos, n, nullptr, 0, Recorder::Async);
+  std::future<IOSize> future = startRead(into, n, pos, false, recording.completionHook());
+  recording.setIssued();
+  return future;
+}
+
+std::future<IOSize>
+XrdFile::startRead (void *into, IOSize n, IOOffset pos, bool blocking, const CompletionHook &hook)
 {
   if (n > 0x7fffffff) {
     edm::Exception ex(edm::errors::FileReadError);
@@ -248,9 +454,59 @@ XrdFile::read (void *into, IOSize n, IOOffset pos)
     throw ex;
   }
 
-  uint32_t bytesRead = m_requestmanager->handle(into, n, pos).get();
+  // Reads must see the data of earlier writes.
+  if (m_writebehind.get() && m_writebehind->pending())
+    flushWrites("read");
+
+  // Large reads may be split into vector reads, which fail (rather than
+  // come up short) beyond the end of the file.  The file may have grown
+  // since it was opened, so check its size before cutting a read short.
+  // That Stat is synchronous; a non-blocking read is instead sent whole
+  // and comes up short wherever the file now ends.
+  bool split = true;
+  if ((m_size >= 0) && (pos + static_cast<IOOffset>(n) > m_size))
+  {
+    if (blocking)
+    {
+      refreshSize();
+      IOOffset size = m_size;
+      if (pos + static_cast<IOOffset>(n) > size)
+      {
+        n = (pos < size) ? size - pos : 0;
+        if (!n) return readyFuture(0, hook);
+      }
+    }
+    else
+    {
+      split = false;
+    }
+  }
 
-  return bytesRead;
+  IOSize bytesRead;
+  if (m_prefetch->hasData() && m_prefetch->read(into, n, pos, bytesRead, blocking))
+  {
+    return readyFuture(bytesRead, hook);
+  }
+  return m_requestmanager->handle(into, n, pos, split, hook);
+}
+
+void
+XrdFile::refreshSize (void)
+{
+  XrdCl::StatInfo *statInfo = NULL;
+  try {
+    if (! getActiveFile()->Stat(true, statInfo).IsOK())
+      return;
+  } catch (cms::Exception &) {
+    // No source is open; the read reports it.
+    return;
+  }
+  assert(statInfo);
+  // Never shrink: our own writes may extend the file.
+  IOOffset size = statInfo->GetSize();
+  delete(statInfo);
+  IOOffset current = m_size;
+  while ((size > current) && !m_size.compare_exchange_weak(current, size)) {}
 }
 
 // This method is rarely used by CMS; hence, it is a small wrapper and not efficient.
@@ -274,23 +530,73 @@ XrdFile::readv (IOBuffer *into, IOSize n)
  */
 IOSize
 XrdFile::readv (IOPosBuffer *into, IOSize n)
+{
+  IOSize size = 0;
+  for (IOSize i=0; i<n; i++) {
+    size += into[i].size();
+  }
+  XRD_ADAPTOR_TRACE_EVENT(VectorReadStart, this, n, size);
+  Recording recording(*this, Recorder::VectorRead, 0, 0, into, n);
+  IOSize result;
+  try
+  {
+    result = startReadv(into, n, true).get();
+  }
+  catch (edm::Exception& ex)
+  {
+    ex.addContext("Calling XrdFile::readv()");
+    throw;
+  }
+  XRD_ADAPTOR_TRACE_EVENT(VectorReadDone, this, result, 0);
+  recording.setResult(result);
+  // A single chunk is sent as a plain read, which comes up short at the end
+  // of the file.
+  assert((n == 1) || (result == size));
+  return result;
+}
+
+std::future<IOSize>
+XrdFile::readvAsync (const IOPosBuffer *into, IOSize n)
+{
+  Recording recording(*this, Recorder::VectorRead, 0, 0, into, n, Recorder::Async);
+  std::future<IOSize> future = startReadv(into, n, false, recording.completionHook());
+  recording.setIssued();
+  return future;
+}
+
+std::future<IOSize>
+XrdFile::startReadv (const IOPosBuffer *into, IOSize n, bool blocking, const CompletionHook &hook)
 {
   // A trivial vector read - unlikely, considering ROOT data format.
   if (unlikely(n == 0)) {
-    return 0;
+    return readyFuture(0, hook);
   }
-  if (unlikely(n == 1)) {
-    return read(into[0].data(), into[0].size(), into[0].offset());
+
+  if (m_writebehind.get() && m_writebehind->pending())
+    flushWrites("readv");
+
+  // Serve whatever ranges we can from previously-prefetched data.
+  IOSize prefetched = 0;
+  std::vector<IOPosBuffer> misses;
+  if (m_prefetch->hasData()) {
+    prefetched = m_prefetch->readv(into, n, misses, blocking);
+    if (misses.empty()) {
+      return readyFuture(prefetched, hook);
+    }
+    into = &misses[0];
+    n = misses.size();
   }
 
-  std::shared_ptr<std::vector<IOPosBuffer> >cl(new std::vector<IOPosBuffer>);
+  if (unlikely((n == 1) && !prefetched)) {
+    return startRead(into[0].data(), into[0].size(), into[0].offset(), blocking, hook);
+  }
+
+  RequestPool::IOList cl = m_requestmanager->requestPool().acquireIOList();
   cl->reserve(n);
 
-  IOSize size = 0;
   for (IOSize i=0; i<n; i++) {
     IOOffset offset = into[i].offset();
     IOSize length = into[i].size();
-    size += length;
     char * buffer = static_cast<char *>(into[i].data());
     while (length > XRD_CL_MAX_CHUNK) {
       IOPosBuffer ci;
@@ -308,22 +614,8 @@ XrdFile::readv (IOPosBuffer *into, IOSize n)
     ci.set_data(buffer);
     cl->emplace_back(ci);
   }
-  edm::CPUTimer timer;
-  timer.start();
-  IOSize result;
-  try
-  {
-    result = m_requestmanager->handle(cl).get();
-  }
-  catch (edm::Exception& ex)
-  {
-    ex.addContext("Calling XrdFile::readv()");
-    throw;
-  }
-  timer.stop();
-  assert(result == size);
-  edm::LogVerbatim("XrdAdaptorInternal") << "[" << m_op_count.fetch_add(1) << "] Time for readv: " << static_cast<int>(1000*timer.realTime()) << std::endl;
-  return result;
+  // The bytes already served from the prefetch cache are added to the result.
+  return m_requestmanager->handle(cl, prefetched, hook);
 }
 
 IOSize
@@ -337,9 +629,15 @@ XrdFile::write (const void *from, IOSize n)
     addConnection(ex);
     throw ex;
   }
+  Recording recording(*this, Recorder::Write, m_offset, n);
   auto file = getActiveFile();
+  // Any prefetched data may be stale once we start writing.
+  m_prefetch->clear();
+  if (m_readahead.get())
+    m_readahead->clear();
 
-  XrdCl::XRootDStatus s = file->Write(m_offset, n, from);
+  // A buffered write reports the failure of any earlier one.
+  XrdCl::XRootDStatus s = m_writebehind.get() ? m_writebehind->write(from, n, m_offset) : file->Write(m_offset, n, from);
   if (!s.IsOK()) {
     cms::Exception ex("FileWriteError");
     ex << "XrdFile::write(name='" << m_name << "', n=" << n
@@ -354,6 +652,7 @@ XrdFile::write (const void *from, IOSize n)
   if (m_offset > m_size)
     m_size = m_offset;
 
+  recording.setResult(n);
   return n;
 }
 
@@ -368,9 +667,14 @@ XrdFile::write (const void *from, IOSize n, IOOffset pos)
     addConnection(ex);
     throw ex;
   }
+  Recording recording(*this, Recorder::Write, pos, n);
   auto file = getActiveFile();
+  // Any prefetched data may be stale once we start writing.
+  m_prefetch->clear();
+  if (m_readahead.get())
+    m_readahead->clear();
 
-  XrdCl::XRootDStatus s = file->Write(pos, n, from);
+  XrdCl::XRootDStatus s = m_writebehind.get() ? m_writebehind->write(from, n, pos) : file->Write(pos, n, from);
   if (!s.IsOK()) {
     cms::Exception ex("FileWriteError");
     ex << "XrdFile::write(name='" << m_name << "', n=" << n
@@ -384,15 +688,49 @@ XrdFile::write (const void *from, IOSize n, IOOffset pos)
   if (static_cast<IOOffset>(pos + n) > m_size)
     m_size = pos + n;
 
+  recording.setResult(n);
   return n;
 }
 
+void
+XrdFile::flush (void)
+{
+  if (! m_requestmanager.get()) {
+    cms::Exception ex("FileFlushError");
+    ex << "XrdFile::flush(name='" << m_name << "') called on a closed file";
+    ex.addContext("Calling XrdFile::flush()");
+    throw ex;
+  }
+  if (m_writebehind.get())
+    flushWrites("flush");
+}
+
+void
+XrdFile::flushWrites (const char *caller)
+{
+  XrdCl::XRootDStatus s = m_writebehind->flush();
+  if (!s.IsOK()) {
+    cms::Exception ex("FileWriteError");
+    ex << "XrdFile::" << caller << "(name='" << m_name
+       << "') buffered write failed with error '" << s.ToString()
+       << "' (errno=" << s.errNo << ", code=" << s.code << ")";
+    ex.addContext(std::string("Calling XrdFile::") + caller + "()");
+    addConnection(ex);
+    throw ex;
+  }
+}
+
 bool
 XrdFile::prefetch (const IOPosBuffer *what, IOSize n)
 {
-  // The new Xrootd client does not contain any internal buffers.
-  // Hence, prefetching is disabled completely.
-  return false;
+  // The new Xrootd client does not contain any internal buffers; instead,
+  // the ranges are read in the background into our own prefetch cache.
+  if (! m_prefetch.get())
+    return false;
+  Recording recording(*this, Recorder::Prefetch, 0, 0, what, n);
+  bool accepted = m_prefetch->prefetch(what, n);
+  recording.setResult(accepted);
+  return accepted;
 }
 
 //////////////////////////////////////////////////////////////////////
@@ -451,7 +789,21 @@ XrdFile::resize (IOOffset /* size */)
   throw ex;
 }
 
-std::shared_ptr<XrdCl::File>
+void
+XrdFile::getStatistics (XrdAdaptor::Statistics::Snapshot &total,
+                        std::vector<std::pair<std::string, XrdAdaptor::Statistics::Snapshot> > &sources)
+{
+  if (!m_requestmanager.get())
+  {
+    cms::Exception ex("XrdFileLogicError");
+    ex << "XrdFile::getStatistics(name='" << m_name << "') file is not open";
+    ex.addContext("Calling XrdFile::getStatistics()");
+    throw ex;
+  }
+  m_requestmanager->getStatistics(total, sources);
+}
+
+std::shared_ptr<XrdAdaptor::FileHandle>
 XrdFile::getActiveFile (void) 
 { 
   if (!m_requestmanager.get())
@@ -5,12 +5,21 @@
 # include "Utilities/StorageFactory/interface/IOFlags.h"
 # include "FWCore/Utilities/interface/Exception.h"
 # include "XrdCl/XrdClFile.hh"
+# include "Utilities/XrdAdaptor/src/XrdRecorder.h"
+# include "Utilities/XrdAdaptor/src/XrdRequest.h"
+# include "Utilities/XrdAdaptor/src/XrdStatistics.h"
 # include <string>
 # include <memory>
 # include <atomic>
+# include <future>
+# include <vector>
 
 namespace XrdAdaptor {
+class FileHandle;
 class RequestManager;
+class PrefetchCache;
+class ReadAhead;
+class WriteBehind;
 }
 
 class XrdFile : public Storage
@@ -48,28 +57,84 @@ public:
   virtual IOSize	write (const void *from, IOSize n);
   virtual IOSize	write (const void *from, IOSize n, IOOffset pos);
 
+  /**
+   * Non-blocking versions of read and readv: the IO is issued and a future
+   * for the number of bytes read is returned immediately.  The buffers must
+   * remain valid until the future is ready; errors are reported through it.
+   * These do not use or move the file position.  Prefetched data which is
+   * still in flight is read again rather than waited for.  If write-behind
+   * is enabled (XRD_ADAPTOR_WRITE_BEHIND_BYTES), they do block while the
+   * buffered writes are flushed.
+   */
+  std::future<IOSize>	readAsync (void *into, IOSize n, IOOffset pos);
+  std::future<IOSize>	readvAsync (const IOPosBuffer *into, IOSize n);
+
+  /**
+   * IO statistics for the whole file and for each of its current sources.
+   */
+  void			getStatistics (XrdAdaptor::Statistics::Snapshot &total,
+    				       std::vector<std::pair<std::string, XrdAdaptor::Statistics::Snapshot> > &sources);
+
   virtual IOOffset	position (IOOffset offset, Relative whence = SET);
   virtual void		resize (IOOffset size);
 
+  /**
+   * Waits for buffered writes to complete; throws if any of them failed.
+   */
+  virtual void		flush (void);
   virtual void		close (void);
   virtual void		abort (void);
 
 private:
 
+  /**
+   * Records an operation if XRD_ADAPTOR_RECORD is set; see XrdRecorder.h.
+   */
+  class Recording;
+
   void                  addConnection(cms::Exception &);
 
+  /**
+   * The bodies of readAsync and readvAsync, for use by the other reads
+   * so that each operation is recorded once.  Unless blocking is set,
+   * these never wait on prefetched data or Stat the file.  The hook, if
+   * any, is run as the returned future becomes ready.
+   */
+  std::future<IOSize>	startRead (void *into, IOSize n, IOOffset pos, bool blocking,
+    				   const XrdAdaptor::CompletionHook &hook = XrdAdaptor::CompletionHook());
+  std::future<IOSize>	startReadv (const IOPosBuffer *into, IOSize n, bool blocking,
+    				    const XrdAdaptor::CompletionHook &hook = XrdAdaptor::CompletionHook());
+
+  /**
+   * Complete the buffered writes, throwing on behalf of caller if any failed.
+   */
+  void                  flushWrites(const char *caller);
+
+  /**
+   * Update m_size from the server, if the file has grown; on failure the
+   * size is left as it was.
+   */
+  void                  refreshSize(void);
+
   /**
    * Returns a file handle from one of the active sources.
    * Verifies the file is open and throws an exception as necessary.
    */
-  std::shared_ptr<XrdCl::File>   getActiveFile();
+  std::shared_ptr<XrdAdaptor::FileHandle> getActiveFile();
 
-  std::unique_ptr<XrdAdaptor::RequestManager> m_requestmanager;
+  std::shared_ptr<XrdAdaptor::RequestManager> m_requestmanager;
+  std::unique_ptr<XrdAdaptor::PrefetchCache> m_prefetch;
+  std::unique_ptr<XrdAdaptor::ReadAhead> m_readahead;
+  // Set when writes are buffered; destroyed before the request manager.
+  std::unique_ptr<XrdAdaptor::WriteBehind> m_writebehind;
   IOOffset	 	         m_offset;
-  IOOffset                       m_size;
+  // Read concurrently by asynchronous reads, which may refresh it.
+  std::atomic<IOOffset>          m_size;
   bool			         m_close;
   std::string		         m_name;
-  std::atomic<unsigned int>      m_op_count;
+  // Set while the file is open, if recording is enabled.
+  XrdAdaptor::Recorder          *m_recorder;
+  uint16_t                       m_record_file;
 
 };
 
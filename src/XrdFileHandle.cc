@@ -0,0 +1,108 @@
+
+#include <mutex>
+
+#include "XrdCl/XrdClFileSystem.hh"
+
+#include "XrdFileHandle.h"
+
+using namespace XrdAdaptor;
+
+namespace {
+  class XrdClFileHandle final : public FileHandle {
+  public:
+    virtual XrdCl::XRootDStatus Open(const std::string &url, XrdCl::OpenFlags::Flags flags, XrdCl::Access::Mode mode) override
+    {
+      return m_file.Open(url, flags, mode);
+    }
+
+    virtual XrdCl::XRootDStatus Open(const std::string &url, XrdCl::OpenFlags::Flags flags, XrdCl::Access::Mode mode, XrdCl::ResponseHandler *handler) override
+    {
+      return m_file.Open(url, flags, mode, handler);
+    }
+
+    virtual XrdCl::XRootDStatus Close() override {return m_file.Close();}
+
+    virtual XrdCl::XRootDStatus Stat(bool force, XrdCl::StatInfo *&response) override
+    {
+      return m_file.Stat(force, response);
+    }
+
+    virtual XrdCl::XRootDStatus Read(uint64_t offset, uint32_t size, void *buffer, XrdCl::ResponseHandler *handler) override
+    {
+      return m_file.Read(offset, size, buffer, handler);
+    }
+
+    virtual XrdCl::XRootDStatus VectorRead(const XrdCl::ChunkList &chunks, void *buffer, XrdCl::ResponseHandler *handler) override
+    {
+      return m_file.VectorRead(chunks, buffer, handler);
+    }
+
+    virtual XrdCl::XRootDStatus Write(uint64_t offset, uint32_t size, const void *buffer) override
+    {
+      return m_file.Write(offset, size, buffer);
+    }
+
+    virtual XrdCl::XRootDStatus Write(uint64_t offset, uint32_t size, const void *buffer, XrdCl::ResponseHandler *handler) override
+    {
+      return m_file.Write(offset, size, buffer, handler);
+    }
+
+    virtual XrdCl::XRootDStatus Locate(const std::string &url, std::vector<std::string> &servers) override
+    {
+      XrdCl::URL parsed(url);
+      XrdCl::FileSystem fs(parsed);
+      XrdCl::LocationInfo *info = nullptr;
+      // A deep locate resolves any intermediate managers down to data servers.
+      XrdCl::XRootDStatus status = fs.DeepLocate(parsed.GetPath(), XrdCl::OpenFlags::None, info);
+      std::unique_ptr<XrdCl::LocationInfo> sentry(info);
+      if (!status.IsOK() || !info) return status;
+      for (auto it = info->Begin(); it != info->End(); ++it)
+      {
+        if (it->IsServer()) servers.push_back(it->GetAddress());
+      }
+      return status;
+    }
+
+    virtual std::string GetDataServer() override {return m_file.GetDataServer();}
+
+  private:
+    XrdCl::File m_file;
+  };
+
+  std::mutex g_factory_mutex;
+  FileHandle::Factory g_factory;
+  FileHandle::WaitFunction g_wait;
+}
+
+std::unique_ptr<FileHandle>
+FileHandle::create()
+{
+    Factory factory;
+    {
+        std::lock_guard<std::mutex> sentry(g_factory_mutex);
+        factory = g_factory;
+    }
+    if (factory) return factory();
+    return std::unique_ptr<FileHandle>(new XrdClFileHandle());
+}
+
+void
+FileHandle::setFactory(Factory factory)
+{
+    std::lock_guard<std::mutex> sentry(g_factory_mutex);
+    g_factory = factory;
+}
+
+void
+FileHandle::setWaitFunction(WaitFunction wait)
+{
+    std::lock_guard<std::mutex> sentry(g_factory_mutex);
+    g_wait = wait;
+}
+
+FileHandle::WaitFunction
+FileHandle::waitFunction()
+{
+    std::lock_guard<std::mutex> sentry(g_factory_mutex);
+    return g_wait;
+}
@@ -0,0 +1,76 @@
+#ifndef Utilities_XrdAdaptor_XrdFileHandle_h
+#define Utilities_XrdAdaptor_XrdFileHandle_h
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/utility.hpp>
+
+#include "XrdCl/XrdClFile.hh"
+
+namespace XrdAdaptor {
+
+/**
+ * The operations the adaptor performs on a file at a single server.
+ *
+ * Normally this is a thin wrapper around XrdCl::File; the methods carry the
+ * same names and semantics.  A different implementation may be installed
+ * process-wide with setFactory (for example, to run the adaptor against
+ * simulated servers when benchmarking); this must happen before any file
+ * is opened.
+ */
+class FileHandle : boost::noncopyable {
+
+public:
+    typedef std::function<std::unique_ptr<FileHandle>()> Factory;
+    typedef std::function<bool()> WaitFunction;
+
+    virtual ~FileHandle() {}
+
+    /**
+     * Create a new, unopened handle using the installed factory.
+     */
+    static std::unique_ptr<FileHandle> create();
+
+    static void setFactory(Factory factory);
+
+    /**
+     * Install a function the adaptor calls in place of blocking while it
+     * waits for responses (such as replica opens); it should deliver one or
+     * more, and return false once there are none left to deliver.  Used by
+     * simulations, which deliver the responses on the waiting thread.
+     */
+    static void setWaitFunction(WaitFunction wait);
+
+    /**
+     * The installed wait function; empty if the adaptor should block.
+     */
+    static WaitFunction waitFunction();
+
+    virtual XrdCl::XRootDStatus Open(const std::string &url, XrdCl::OpenFlags::Flags flags, XrdCl::Access::Mode mode) = 0;
+    virtual XrdCl::XRootDStatus Open(const std::string &url, XrdCl::OpenFlags::Flags flags, XrdCl::Access::Mode mode, XrdCl::ResponseHandler *handler) = 0;
+    virtual XrdCl::XRootDStatus Close() = 0;
+    virtual XrdCl::XRootDStatus Stat(bool force, XrdCl::StatInfo *&response) = 0;
+    virtual XrdCl::XRootDStatus Read(uint64_t offset, uint32_t size, void *buffer, XrdCl::ResponseHandler *handler) = 0;
+    virtual XrdCl::XRootDStatus VectorRead(const XrdCl::ChunkList &chunks, void *buffer, XrdCl::ResponseHandler *handler) = 0;
+    virtual XrdCl::XRootDStatus Write(uint64_t offset, uint32_t size, const void *buffer) = 0;
+    virtual XrdCl::XRootDStatus Write(uint64_t offset, uint32_t size, const void *buffer, XrdCl::ResponseHandler *handler) = 0;
+
+    /**
+     * Ask the redirector named in url for the data servers (as host:port)
+     * holding the file.  Unlike the other methods, this may be called on a
+     * handle which is not open.
+     */
+    virtual XrdCl::XRootDStatus Locate(const std::string &url, std::vector<std::string> &servers) = 0;
+
+    /**
+     * The server the file was opened at, as host:port.
+     */
+    virtual std::string GetDataServer() = 0;
+};
+
+}
+
+#endif
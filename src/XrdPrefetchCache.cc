@@ -0,0 +1,240 @@
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "FWCore/Utilities/interface/EDMException.h"
+#include "FWCore/MessageLogger/interface/MessageLogger.h"
+
+#include "XrdPrefetchCache.h"
+#include "XrdRequestManager.h"
+#include "XrdTrace.h"
+
+#define XRD_CL_MAX_CHUNK 512*1024
+
+using namespace XrdAdaptor;
+
+PrefetchCache::PrefetchCache(RequestManager &manager, IOSize maxBytes)
+    : m_manager(manager),
+      m_max_bytes(maxBytes),
+      m_bytes(0)
+{
+}
+
+PrefetchCache::~PrefetchCache()
+{
+    // Outstanding IO writes into our buffers; we must not free them early.
+    clear();
+}
+
+bool
+PrefetchCache::wait(const Block &block)
+{
+    try
+    {
+        return block.m_future.get() == block.m_expected;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+bool
+PrefetchCache::finished(const Block &block)
+{
+    return block.m_future.valid() && (block.m_future.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+}
+
+PrefetchCache::BlockPtr
+PrefetchCache::find(IOOffset off, IOSize size) const
+{
+    // Blocks may overlap, so any block starting at or before off may cover
+    // the range; none is larger than m_max_bytes.
+    BlockPtr found;
+    for (auto it = m_index.upper_bound(off); it != m_index.begin(); )
+    {
+        --it;
+        const Block &block = *it->second;
+        if (block.m_off + static_cast<IOOffset>(m_max_bytes) < off) break;
+        if (off + static_cast<IOOffset>(size) > block.m_off + static_cast<IOOffset>(block.m_size)) continue;
+        if (finished(block)) return it->second;
+        if (!found) found = it->second;
+    }
+    return found;
+}
+
+void
+PrefetchCache::remove(const BlockPtr &block)
+{
+    auto it = m_index.find(block->m_off);
+    if ((it == m_index.end()) || (it->second != block)) return;
+    m_index.erase(it);
+    for (auto fit = m_fifo.begin(); fit != m_fifo.end(); ++fit)
+    {
+        if (*fit == block) {m_fifo.erase(fit); break;}
+    }
+    m_bytes -= block->m_size;
+}
+
+void
+PrefetchCache::retire(const BlockPtr &block)
+{
+    remove(block);
+    if (!finished(*block))
+    {
+        m_retired.push_back(block);
+        m_bytes += block->m_size;
+    }
+}
+
+void
+PrefetchCache::reap()
+{
+    auto it = std::partition(m_retired.begin(), m_retired.end(), [](const BlockPtr &block) {return !finished(*block);});
+    for (auto fit = it; fit != m_retired.end(); ++fit) m_bytes -= (*fit)->m_size;
+    m_retired.erase(it, m_retired.end());
+}
+
+bool
+PrefetchCache::prefetch(const IOPosBuffer *what, IOSize n)
+{
+    // Serialize batches so every block outside the current one has a future.
+    std::lock_guard<std::mutex> issue_sentry(m_issue_mutex);
+    std::vector<BlockPtr> blocks;
+    std::shared_ptr<std::vector<IOPosBuffer> > iolist(new std::vector<IOPosBuffer>);
+    iolist->reserve(n);
+    IOSize expected = 0;
+    {
+        std::lock_guard<std::mutex> sentry(m_mutex);
+        if (!m_retired.empty()) reap();
+        for (IOSize i=0; i<n; i++)
+        {
+            IOOffset offset = what[i].offset();
+            IOSize length = what[i].size();
+            if (!length || (length > m_max_bytes) || find(offset, length)) continue;
+            // Make room by dropping the oldest blocks - but never those
+            // belonging to this batch, as their IO has not been issued yet.
+            while (!m_fifo.empty() && (m_bytes + length > m_max_bytes))
+            {
+                BlockPtr victim = m_fifo.front();
+                if (!blocks.empty() && (victim == blocks.front())) break;
+                retire(victim);
+            }
+            if (m_bytes + length > m_max_bytes) break;
+            if (m_index.count(offset)) continue;
+
+            BlockPtr block(new Block());
+            block->m_off = offset;
+            block->m_size = length;
+            block->m_buffer.resize(length);
+            m_index[offset] = block;
+            m_fifo.push_back(block);
+            m_bytes += length;
+            blocks.push_back(block);
+            expected += length;
+
+            char *buffer = &block->m_buffer[0];
+            while (length > XRD_CL_MAX_CHUNK)
+            {
+                iolist->emplace_back(IOPosBuffer(offset, buffer, XRD_CL_MAX_CHUNK));
+                length -= XRD_CL_MAX_CHUNK;
+                offset += XRD_CL_MAX_CHUNK;
+                buffer += XRD_CL_MAX_CHUNK;
+            }
+            iolist->emplace_back(IOPosBuffer(offset, buffer, length));
+        }
+    }
+
+    if (blocks.empty()) return false;
+
+    std::shared_future<IOSize> future;
+    try
+    {
+        future = m_manager.handle(iolist).share();
+    }
+    catch (cms::Exception &)
+    {
+        edm::LogWarning("XrdAdaptorInternal") << "Failed to issue prefetch for "
+          << m_manager.getFilename() << "; will read on demand instead.";
+        std::lock_guard<std::mutex> sentry(m_mutex);
+        for (const auto & block : blocks) remove(block);
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> sentry(m_mutex);
+        for (const auto & block : blocks)
+        {
+            block->m_future = future;
+            block->m_expected = expected;
+        }
+    }
+    XRD_ADAPTOR_TRACE_EVENT(Prefetch, &m_manager, blocks.size(), expected);
+    return true;
+}
+
+bool
+PrefetchCache::read(void *into, IOSize size, IOOffset off, IOSize &result, bool blocking)
+{
+    BlockPtr block;
+    {
+        std::lock_guard<std::mutex> sentry(m_mutex);
+        block = find(off, size);
+        // A block without a future is still being issued by prefetch().
+        if (!block || !block->m_future.valid()) return false;
+    }
+    if (!blocking && (block->m_future.wait_for(std::chrono::seconds(0)) != std::future_status::ready))
+    {
+        return false;
+    }
+
+    bool ok = wait(*block);
+    if (ok)
+    {
+        memcpy(into, &block->m_buffer[off - block->m_off], size);
+        result = size;
+    }
+    // Drop blocks that failed or have been consumed in their entirety.
+    if (!ok || ((off == block->m_off) && (size == block->m_size)))
+    {
+        std::lock_guard<std::mutex> sentry(m_mutex);
+        remove(block);
+    }
+    return ok;
+}
+
+IOSize
+PrefetchCache::readv(const IOPosBuffer *into, IOSize n, std::vector<IOPosBuffer> &misses, bool blocking)
+{
+    IOSize served = 0;
+    for (IOSize i=0; i<n; i++)
+    {
+        IOSize result;
+        if (read(into[i].data(), into[i].size(), into[i].offset(), result, blocking))
+        {
+            served += result;
+        }
+        else
+        {
+            misses.push_back(into[i]);
+        }
+    }
+    return served;
+}
+
+void
+PrefetchCache::clear()
+{
+    std::lock_guard<std::mutex> issue_sentry(m_issue_mutex);
+    std::deque<BlockPtr> blocks;
+    std::vector<BlockPtr> retired;
+    {
+        std::lock_guard<std::mutex> sentry(m_mutex);
+        blocks.swap(m_fifo);
+        retired.swap(m_retired);
+        m_index.clear();
+        m_bytes = 0;
+    }
+    for (const auto & block : blocks) wait(*block);
+    for (const auto & block : retired) wait(*block);
+}
@@ -0,0 +1,125 @@
+#ifndef Utilities_XrdAdaptor_XrdPrefetchCache_h
+#define Utilities_XrdAdaptor_XrdPrefetchCache_h
+
+#include <atomic>
+#include <deque>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <boost/utility.hpp>
+
+#include "Utilities/StorageFactory/interface/Storage.h"
+
+namespace XrdAdaptor {
+
+class RequestManager;
+
+/**
+ * A memory-bounded cache of data requested via Storage::prefetch.
+ *
+ * Prefetch hints are sent to the RequestManager as background vector reads
+ * into buffers owned by the cache.  Later reads falling completely inside a
+ * prefetched range are served from the cache; blocking reads wait on the
+ * in-flight request if it has not yet completed.
+ */
+class PrefetchCache : boost::noncopyable {
+
+public:
+    PrefetchCache(RequestManager &manager, IOSize maxBytes);
+
+    ~PrefetchCache();
+
+    /**
+     * Start background reads for the given ranges.  Ranges which are already
+     * cached or which do not fit in the memory bound are skipped.
+     * Returns true if any read was issued.
+     */
+    bool prefetch(const IOPosBuffer *what, IOSize n);
+
+    /**
+     * Try to serve a contiguous read from the cache.
+     * Returns true (and fills in result) if the read was fully satisfied.
+     * Unless blocking is set, data still in flight counts as a miss.
+     */
+    bool read(void *into, IOSize size, IOOffset off, IOSize &result, bool blocking = true);
+
+    /**
+     * Serve as much of a vector read as possible from the cache.  Chunks
+     * which could not be served are appended to misses.
+     * Returns the number of bytes served from the cache.
+     */
+    IOSize readv(const IOPosBuffer *into, IOSize n, std::vector<IOPosBuffer> &misses, bool blocking = true);
+
+    /**
+     * True if there is any cached or in-flight data.
+     */
+    bool hasData() const {return m_bytes.load(std::memory_order_relaxed) != 0;}
+
+    /**
+     * Drop all cached data, waiting for any outstanding reads first.
+     */
+    void clear();
+
+private:
+    struct Block {
+        IOOffset m_off;
+        IOSize m_size;
+        std::vector<char> m_buffer;
+        // Shared by all the blocks issued by a single prefetch call.
+        std::shared_future<IOSize> m_future;
+        IOSize m_expected;
+    };
+    typedef std::shared_ptr<Block> BlockPtr;
+
+    /**
+     * Locate a block containing [off, off+size), preferring one whose data
+     * has arrived; must hold m_mutex.
+     */
+    BlockPtr find(IOOffset off, IOSize size) const;
+
+    /**
+     * Remove a block from the index; must hold m_mutex.
+     */
+    void remove(const BlockPtr &block);
+
+    /**
+     * Evict a block; if its read is still outstanding, keep its buffer in
+     * m_retired until the read completes.  Must hold m_mutex.
+     */
+    void retire(const BlockPtr &block);
+
+    /**
+     * Free the retired blocks whose reads have completed; must hold m_mutex.
+     */
+    void reap();
+
+    static bool finished(const Block &block);
+
+    /**
+     * Wait until the block's data is available.
+     * Returns false if the underlying read failed.
+     */
+    static bool wait(const Block &block);
+
+    RequestManager &m_manager;
+    const IOSize m_max_bytes;
+    // Memory held by the indexed and retired blocks.  Updated only with
+    // m_mutex held; read without it as a hint.
+    std::atomic<IOSize> m_bytes;
+
+    std::map<IOOffset, BlockPtr> m_index;
+    // Blocks in insertion order; the front is evicted first.
+    std::deque<BlockPtr> m_fifo;
+    // Evicted blocks whose reads have not yet completed.
+    std::vector<BlockPtr> m_retired;
+    mutable std::mutex m_mutex;
+    // Held while a prefetch batch is being issued or the cache cleared.
+    std::mutex m_issue_mutex;
+};
+
+}
+
+#endif
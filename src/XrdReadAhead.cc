@@ -0,0 +1,219 @@
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "FWCore/Utilities/interface/EDMException.h"
+
+#include "XrdClock.h"
+#include "XrdReadAhead.h"
+#include "XrdRequestManager.h"
+#include "XrdTrace.h"
+
+// Sequential reads in a row before reading ahead.
+#define XRD_ADAPTOR_READAHEAD_TRIGGER 2
+
+// Weight of each new rate and latency sample.
+#define XRD_ADAPTOR_READAHEAD_SMOOTHING 0.25
+
+using namespace XrdAdaptor;
+
+static double
+seconds(const timespec &a, const timespec &b)
+{
+    return (a.tv_sec - b.tv_sec) + (a.tv_nsec - b.tv_nsec)/1e9;
+}
+
+ReadAhead::ReadAhead(RequestManager &manager, IOSize block_size, IOSize max_bytes)
+    : m_manager(manager),
+      m_block_size(block_size),
+      // Room for the minimum window of two blocks.
+      m_max_bytes(std::max(max_bytes, 2*block_size)),
+      m_next(-1),
+      m_hits(0),
+      m_ahead(0),
+      m_window(2*block_size),
+      m_bytes(0),
+      m_rate(0),
+      m_latency(0),
+      m_last_read({0, 0})
+{
+}
+
+ReadAhead::~ReadAhead()
+{
+    clear();
+}
+
+bool
+ReadAhead::read(void *into, IOSize size, IOOffset off, IOOffset file_size, IOSize &result)
+{
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    timespec now;
+    MonotonicClock::now(now);
+    if (!m_retired.empty()) reap();
+
+    // Small skips forward still count as sequential, but only a read which
+    // continues exactly where the last ended may grow the window.
+    bool contiguous = (off == m_next);
+    if ((off >= m_next) && (off - m_next <= static_cast<IOOffset>(m_block_size)))
+    {
+        double elapsed = seconds(now, m_last_read);
+        if (m_hits && (elapsed > 0))
+        {
+            double sample = size / elapsed;
+            m_rate = m_rate ? m_rate + XRD_ADAPTOR_READAHEAD_SMOOTHING*(sample - m_rate) : sample;
+        }
+        m_hits++;
+    }
+    else
+    {
+        if (m_hits >= XRD_ADAPTOR_READAHEAD_TRIGGER) reset();
+        m_hits = 0;
+    }
+    m_next = off + size;
+    m_last_read = now;
+    if (m_hits < XRD_ADAPTOR_READAHEAD_TRIGGER) return false;
+
+    // Drop the blocks before this read; they were skipped over.
+    while (!m_blocks.empty() && (m_blocks.front()->m_off + static_cast<IOOffset>(m_blocks.front()->m_size) <= off))
+    {
+        m_retired.emplace_back(std::move(m_blocks.front()));
+        m_blocks.pop_front();
+    }
+    if (!m_blocks.empty() && (m_blocks.front()->m_off > off)) reset();
+    if (m_blocks.empty()) m_ahead = off;
+    // Blocks issued below for this very read were not read ahead; waiting
+    // for them says nothing about the window.
+    IOOffset ahead = m_ahead;
+    extend(off + size, file_size);
+
+    char *to = static_cast<char *>(into);
+    IOOffset pos = off;
+    bool eof = false;
+    for (auto & block : m_blocks)
+    {
+        if (pos >= off + static_cast<IOOffset>(size)) break;
+        if (!wait(*block, now, contiguous && (block->m_off < ahead)))
+        {
+            // Leave the error to be reported by a normal read.
+            reset();
+            return false;
+        }
+        IOOffset end = std::min(block->m_off + static_cast<IOOffset>(block->m_valid), off + static_cast<IOOffset>(size));
+        if (pos < end)
+        {
+            memcpy(to + (pos - off), &block->m_buffer[pos - block->m_off], end - pos);
+            pos = end;
+        }
+        // A short block means the end of the file.
+        if (block->m_valid < block->m_size) {eof = true; break;}
+    }
+    // Not covered by the blocks (for instance, beyond the memory bound).
+    if ((pos < off + static_cast<IOOffset>(size)) && !eof) return false;
+    result = pos - off;
+
+    // Blocks read in full are no longer needed.
+    while (!m_blocks.empty() && m_blocks.front()->m_done && (m_blocks.front()->m_off + static_cast<IOOffset>(m_blocks.front()->m_size) <= pos))
+    {
+        m_bytes -= m_blocks.front()->m_size;
+        m_blocks.pop_front();
+    }
+    return true;
+}
+
+bool
+ReadAhead::wait(Block &block, const timespec &now, bool grow)
+{
+    if (block.m_done) return true;
+    bool stalled = block.m_future.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+    try
+    {
+        block.m_valid = block.m_future.get();
+    }
+    catch (...)
+    {
+        block.m_done = true;
+        return false;
+    }
+    block.m_done = true;
+    if (stalled)
+    {
+        // The block arrived just now, so this is a good latency sample.
+        timespec done;
+        MonotonicClock::now(done);
+        double sample = seconds(done, block.m_issued);
+        m_latency = m_latency ? m_latency + XRD_ADAPTOR_READAHEAD_SMOOTHING*(sample - m_latency) : sample;
+        if (grow)
+        {
+            IOSize target = static_cast<IOSize>(std::min(2*m_rate*m_latency, static_cast<double>(m_max_bytes)));
+            m_window = std::min(std::min(2*m_window, std::max(target, m_window)), m_max_bytes);
+            XRD_ADAPTOR_TRACE_EVENT(ReadAheadWindow, this, m_window, static_cast<uint64_t>(1000*seconds(done, now)));
+        }
+    }
+    return true;
+}
+
+void
+ReadAhead::extend(IOOffset end, IOOffset file_size)
+{
+    while ((m_ahead < file_size) && (m_ahead < end + static_cast<IOOffset>(m_window)) && (m_bytes + m_block_size <= m_max_bytes))
+    {
+        BlockPtr block(new Block());
+        block->m_off = m_ahead;
+        // Blocks end on a multiple of the block size in the file.
+        block->m_size = m_block_size - m_ahead % m_block_size;
+        block->m_buffer.resize(block->m_size);
+        block->m_done = false;
+        block->m_valid = 0;
+        MonotonicClock::now(block->m_issued);
+        try
+        {
+            block->m_future = m_manager.handle(&block->m_buffer[0], block->m_size, block->m_off);
+        }
+        catch (cms::Exception &)
+        {
+            // Reads of this range will be issued (and fail) normally.
+            break;
+        }
+        m_ahead += block->m_size;
+        m_bytes += block->m_size;
+        m_blocks.emplace_back(std::move(block));
+    }
+}
+
+void
+ReadAhead::reset()
+{
+    for (auto & block : m_blocks) m_retired.emplace_back(std::move(block));
+    m_blocks.clear();
+    if (m_window != 2*m_block_size) XRD_ADAPTOR_TRACE_EVENT(ReadAheadWindow, this, 2*m_block_size, 0);
+    m_window = 2*m_block_size;
+    m_rate = 0;
+}
+
+void
+ReadAhead::reap()
+{
+    auto finished = [](const BlockPtr &block) {
+        return block->m_done || (block->m_future.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+    };
+    auto it = std::partition(m_retired.begin(), m_retired.end(), [&finished](const BlockPtr &block) {return !finished(block);});
+    for (auto fit = it; fit != m_retired.end(); ++fit) m_bytes -= (*fit)->m_size;
+    m_retired.erase(it, m_retired.end());
+}
+
+void
+ReadAhead::clear()
+{
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    reset();
+    for (auto & block : m_retired)
+    {
+        if (!block->m_done) block->m_future.wait();
+    }
+    m_retired.clear();
+    m_bytes = 0;
+    m_hits = 0;
+    m_next = -1;
+}
@@ -0,0 +1,117 @@
+#ifndef Utilities_XrdAdaptor_XrdReadAhead_h
+#define Utilities_XrdAdaptor_XrdReadAhead_h
+
+#include <time.h>
+
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <boost/utility.hpp>
+
+#include "Utilities/StorageFactory/interface/Storage.h"
+
+namespace XrdAdaptor {
+
+class RequestManager;
+
+/**
+ * Read-ahead for clients which read a file sequentially in small pieces.
+ *
+ * Reads which continue where the previous one ended are counted; after a
+ * few, blocks beyond the current position are read in the background and
+ * later reads are served from them.  The amount read ahead (the window)
+ * starts at two blocks.  Whenever a read continuing exactly where the last
+ * one ended has to wait for a block read ahead for it, it grows towards
+ * twice the bandwidth-delay product of the stream - the rate at which the
+ * client consumes data times the time a block takes to arrive - at most
+ * doubling each time.  A read elsewhere in the file drops the blocks and
+ * resets the window.
+ */
+class ReadAhead : boost::noncopyable {
+
+public:
+    ReadAhead(RequestManager &manager, IOSize block_size, IOSize max_bytes);
+
+    /**
+     * Waits for outstanding reads; they write into our buffers.
+     */
+    ~ReadAhead();
+
+    /**
+     * Note a read of [off, off+size) in a file of file_size bytes, and try
+     * to serve it from the blocks read ahead.  Returns true (and fills in
+     * result, which is short only at the end of the file) if it was served.
+     */
+    bool read(void *into, IOSize size, IOOffset off, IOOffset file_size, IOSize &result);
+
+    /**
+     * Drop all blocks, waiting for any outstanding reads first.
+     */
+    void clear();
+
+    IOSize window() const {return m_window;}
+
+private:
+    struct Block {
+        IOOffset m_off;
+        IOSize m_size;
+        std::vector<char> m_buffer;
+        std::future<IOSize> m_future;
+        timespec m_issued;
+        // Set once m_future has been consumed; the bytes actually read.
+        bool m_done;
+        IOSize m_valid;
+    };
+    typedef std::unique_ptr<Block> BlockPtr;
+
+    /**
+     * Wait for a block; returns false if its read failed.  If grow is set
+     * and the block was not ready, the window was too small and is grown.
+     */
+    bool wait(Block &block, const timespec &now, bool grow);
+
+    /**
+     * Read ahead until the window beyond end is covered.
+     */
+    void extend(IOOffset end, IOOffset file_size);
+
+    /**
+     * Stop reading ahead; blocks still being read are kept until they finish.
+     */
+    void reset();
+
+    /**
+     * Free the buffers of dropped blocks whose reads have finished.
+     */
+    void reap();
+
+    RequestManager &m_manager;
+    const IOSize m_block_size;
+    const IOSize m_max_bytes;
+
+    // Where the next sequential read is expected, and how many reads in a
+    // row were sequential.
+    IOOffset m_next;
+    unsigned m_hits;
+    // End of the last block issued.
+    IOOffset m_ahead;
+    IOSize m_window;
+    // Memory held by m_blocks and m_retired.
+    IOSize m_bytes;
+    // Smoothed client consumption rate (bytes/s) and block latency (s).
+    double m_rate;
+    double m_latency;
+    timespec m_last_read;
+
+    // Contiguous and in file order.
+    std::deque<BlockPtr> m_blocks;
+    std::vector<BlockPtr> m_retired;
+    std::mutex m_mutex;
+};
+
+}
+
+#endif
@@ -0,0 +1,162 @@
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "FWCore/MessageLogger/interface/MessageLogger.h"
+
+#include "XrdClock.h"
+#include "XrdRecorder.h"
+
+using namespace XrdAdaptor;
+
+const char Recorder::file_magic[8] = {'X', 'R', 'D', 'R', 'E', 'C', 'O', 'R'};
+
+// Intentionally leaked: files may still be closed during static destruction.
+Recorder *Recorder::m_instance = nullptr;
+std::once_flag Recorder::m_once;
+
+namespace {
+
+const char * const g_names[Recorder::RecordTypeCount] = {
+    "Open", "Read", "VectorRead", "Prefetch", "Write", "Close", "SourceName"
+};
+
+std::atomic<uint16_t> g_next_thread(0);
+thread_local int t_thread = -1;
+
+}
+
+Recorder *
+Recorder::instance()
+{
+    std::call_once(m_once, []()
+    {
+        const char *path = getenv("XRD_ADAPTOR_RECORD");
+        if (!path || !*path) return;
+        FILE *fp = fopen(path, "w");
+        if (!fp)
+        {
+            edm::LogWarning("XrdAdaptorInternal") << "Unable to record IO to " << path;
+            return;
+        }
+        m_instance = new Recorder(fp);
+        atexit(&Recorder::flushAtExit);
+    });
+    return m_instance;
+}
+
+Recorder::Recorder(FILE *fp)
+    : m_fp(fp),
+      m_ok(true),
+      m_next_file(0)
+{
+    write(file_magic, sizeof(file_magic));
+}
+
+void
+Recorder::flushAtExit()
+{
+    std::lock_guard<std::mutex> sentry(m_instance->m_mutex);
+    if ((fflush(m_instance->m_fp) != 0) || !m_instance->m_ok)
+    {
+        edm::LogWarning("XrdAdaptorInternal") << "Error writing IO recording";
+    }
+}
+
+void
+Recorder::write(const void *data, size_t size)
+{
+    m_ok = m_ok && (!size || (fwrite(data, size, 1, m_fp) == 1));
+}
+
+uint16_t
+Recorder::threadNumber()
+{
+    if (t_thread < 0) t_thread = g_next_thread++;
+    return t_thread;
+}
+
+void
+Recorder::writeName(RecordType type, uint16_t number, const std::string &name, int flags)
+{
+    timespec now;
+    MonotonicClock::now(now);
+    Record record = {};
+    record.m_time_ns = static_cast<uint64_t>(now.tv_sec)*1000000000ull + now.tv_nsec;
+    record.m_offset = flags;
+    record.m_count = name.size();
+    record.m_type = type;
+    record.m_file = number;
+    record.m_thread = threadNumber();
+    write(&record, sizeof(record));
+    write(name.data(), name.size());
+}
+
+uint16_t
+Recorder::open(const std::string &name, int flags)
+{
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    uint16_t file = m_next_file++;
+    writeName(Open, file, name, flags);
+    return file;
+}
+
+void
+Recorder::close(uint16_t file)
+{
+    timespec now;
+    MonotonicClock::now(now);
+    record(Close, file, now, threadNumber(), 0, 0, 0, 0, nullptr, 0, std::vector<std::string>());
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    fflush(m_fp);
+}
+
+void
+Recorder::record(RecordType type, uint16_t file, const timespec &start, uint16_t thread, uint8_t flags,
+                 IOOffset offset, IOSize size, IOSize result,
+                 const IOPosBuffer *chunks, IOSize n, const std::vector<std::string> &sources)
+{
+    timespec now;
+    MonotonicClock::now(now);
+    Record record = {};
+    record.m_time_ns = static_cast<uint64_t>(start.tv_sec)*1000000000ull + start.tv_nsec;
+    record.m_offset = offset;
+    record.m_size = size;
+    record.m_result = result;
+    record.m_latency_us = (now.tv_sec - start.tv_sec)*1000000 + (now.tv_nsec - start.tv_nsec)/1000;
+    record.m_count = n;
+    record.m_type = type;
+    record.m_file = file;
+    record.m_thread = thread;
+    record.m_sources = std::min<size_t>(sources.size(), 255);
+    record.m_flags = flags;
+
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    std::vector<uint16_t> numbers;
+    numbers.reserve(record.m_sources);
+    for (size_t idx = 0; idx < record.m_sources; idx++)
+    {
+        auto it = m_source_numbers.find(sources[idx]);
+        if (it == m_source_numbers.end())
+        {
+            it = m_source_numbers.emplace(sources[idx], m_source_numbers.size()).first;
+            writeName(SourceName, it->second, sources[idx], 0);
+        }
+        numbers.push_back(it->second);
+    }
+    write(&record, sizeof(record));
+    for (IOSize idx = 0; idx < n; idx++)
+    {
+        Chunk chunk = {static_cast<uint64_t>(chunks[idx].offset()), chunks[idx].size()};
+        write(&chunk, sizeof(chunk));
+    }
+    if (!numbers.empty()) write(&numbers[0], numbers.size()*sizeof(uint16_t));
+}
+
+const char *
+Recorder::typeName(unsigned type)
+{
+    return (type < RecordTypeCount) ? g_names[type] : "Unknown";
+}
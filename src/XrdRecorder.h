@@ -0,0 +1,137 @@
+#ifndef Utilities_XrdAdaptor_XrdRecorder_h
+#define Utilities_XrdAdaptor_XrdRecorder_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/utility.hpp>
+
+#include "Utilities/StorageFactory/interface/Storage.h"
+
+namespace XrdAdaptor {
+
+/**
+ * Records every operation the framework asks of XrdFile, so that a job's
+ * access pattern can later be replayed offline by xrdadaptor_replay.
+ *
+ * Unlike Trace, which keeps a bounded ring of the adaptor's internal events,
+ * the recording is complete and is written as it goes: each read, vector
+ * read (with its full chunk list), prefetch and write, with its start time,
+ * latency, result and the sources active when it finished.  Recording is
+ * enabled by setting XRD_ADAPTOR_RECORD to an output path; it takes a lock
+ * per operation, so is meant for diagnosis rather than to be left on.
+ *
+ * File layout: file_magic, then records.  A record is a Record header
+ * followed by m_count Chunks (VectorRead, Prefetch) or m_count bytes of name
+ * (Open, SourceName), then m_sources uint16_t source numbers.
+ */
+class Recorder : boost::noncopyable {
+
+public:
+    enum RecordType {
+        // m_file: new file number; m_offset: IOFlags; name follows.
+        Open = 0,
+        Read,
+        VectorRead,
+        Prefetch,
+        Write,
+        Close,
+        // m_file: new source number; name follows.
+        SourceName,
+        RecordTypeCount
+    };
+
+    enum RecordFlags {
+        // Issued through readAsync / readvAsync; recorded once the future
+        // became ready, so it may follow later records of its thread.
+        Async = 1,
+        // The operation threw.
+        Failed = 2
+    };
+
+    /**
+     * The on-disk record header; 48 bytes, written in native byte order.
+     */
+    struct Record {
+        // CLOCK_MONOTONIC time the operation started.
+        uint64_t m_time_ns;
+        uint64_t m_offset;
+        // Bytes requested, and bytes returned (for Prefetch, 1 if accepted).
+        uint64_t m_size;
+        uint64_t m_result;
+        uint32_t m_latency_us;
+        uint32_t m_count;
+        uint16_t m_type;
+        uint16_t m_file;
+        // Small sequential number of the calling thread.
+        uint16_t m_thread;
+        uint8_t m_sources;
+        uint8_t m_flags;
+    };
+
+    struct Chunk {
+        uint64_t m_offset;
+        uint64_t m_size;
+    };
+
+    static const char file_magic[8];
+
+    /**
+     * The process' recorder, or nullptr if recording is not enabled.
+     */
+    static Recorder *instance();
+
+    /**
+     * Record the opening of a file; returns its number for later records.
+     */
+    uint16_t open(const std::string &name, int flags);
+
+    void close(uint16_t file);
+
+    /**
+     * Record an operation started at start by the given thread, which has
+     * just finished.  chunks is given for vector reads and prefetches, and
+     * sources names the sources active at the end.
+     */
+    void record(RecordType type, uint16_t file, const timespec &start, uint16_t thread, uint8_t flags,
+                IOOffset offset, IOSize size, IOSize result,
+                const IOPosBuffer *chunks, IOSize n, const std::vector<std::string> &sources);
+
+    /**
+     * Small sequential number of the calling thread.
+     */
+    uint16_t threadNumber();
+
+    /**
+     * Printable name of a record type.
+     */
+    static const char *typeName(unsigned type);
+
+private:
+    explicit Recorder(FILE *fp);
+
+    void write(const void *data, size_t size);
+    void writeName(RecordType type, uint16_t number, const std::string &name, int flags);
+
+    static void flushAtExit();
+
+    // All protected by m_mutex.
+    FILE *m_fp;
+    bool m_ok;
+    uint16_t m_next_file;
+    std::unordered_map<std::string, uint16_t> m_source_numbers;
+    std::mutex m_mutex;
+
+    static Recorder *m_instance;
+    static std::once_flag m_once;
+};
+
+}
+
+#endif
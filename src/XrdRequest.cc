@@ -1,10 +1,14 @@
 
 #include <iostream>
+#include <string.h>
 
 #include "FWCore/MessageLogger/interface/MessageLogger.h"
 
+#include "XrdClock.h"
 #include "XrdRequest.h"
 #include "XrdRequestManager.h"
+#include "XrdSource.h"
+#include "XrdTrace.h"
 
 using namespace XrdAdaptor;
 
@@ -17,6 +21,52 @@ int g_fakeError = 0;
 int g_fakeError = 0;
 #endif
 
+// The promise state comes from the manager's pool, like the request itself.
+XrdAdaptor::ClientRequest::ClientRequest(RequestManager &manager, void *into, IOSize size, IOOffset off)
+    : m_failure_count(0),
+      m_into(into),
+      m_size(size),
+      m_off(off),
+      m_iolist(nullptr),
+      m_manager(manager.m_self),
+      m_hedged(false),
+      m_probe(false),
+      m_fulfilled(false),
+      m_promise(std::allocator_arg, manager.requestPool().allocator<IOSize>())
+{
+}
+
+XrdAdaptor::ClientRequest::ClientRequest(RequestManager &manager, std::shared_ptr<std::vector<IOPosBuffer> > iolist)
+    : m_failure_count(0),
+      m_into(nullptr),
+      m_size(0),
+      m_off(0),
+      m_iolist(iolist),
+      m_manager(manager.m_self),
+      m_hedged(false),
+      m_probe(false),
+      m_fulfilled(false),
+      m_promise(std::allocator_arg, manager.requestPool().allocator<IOSize>())
+{
+    for (const auto & it : *m_iolist) m_size += it.size();
+}
+
+XrdAdaptor::ClientRequest::ClientRequest(RequestManager &manager, std::shared_ptr<ClientRequest> primary, ScratchPool::Buffer scratch)
+    : m_failure_count(0),
+      m_into(primary->m_into),
+      m_size(primary->m_size),
+      m_off(primary->m_off),
+      m_iolist(primary->m_iolist),
+      m_manager(manager.m_self),
+      m_primary(primary),
+      m_scratch(scratch),
+      m_hedged(true),
+      m_probe(false),
+      m_fulfilled(false),
+      m_promise(std::allocator_arg, manager.requestPool().allocator<IOSize>())
+{
+}
+
 XrdAdaptor::ClientRequest::~ClientRequest() {}
 
 void 
@@ -28,54 +78,186 @@ XrdAdaptor::ClientRequest::HandleResponse(XrdCl::XRootDStatus *stat, XrdCl::AnyO
         QualityMetricWatch qmw;
         m_qmw.swap(qmw);
     }
-    if ((!FAKE_ERROR_COUNTER || ((++g_fakeError % FAKE_ERROR_COUNTER) != 0)) && (status->IsOK() && resp))
+    std::shared_ptr<Source> source_ptr = m_source;
+    bool success = (!FAKE_ERROR_COUNTER || ((++g_fakeError % FAKE_ERROR_COUNTER) != 0)) && (status->IsOK() && resp);
+    bool idle = source_ptr->requestDone(this, success);
+    if (!success) source_ptr->statistics().addFailure();
+    // Empty if the file has been closed and its manager is gone; held until
+    // we return, so the manager may be destroyed on this thread.
+    std::shared_ptr<RequestManager> manager = m_manager.lock();
+    if (success)
     {
+        // Let a source with room in its window take queued work from the others.
+        if (idle && manager) manager->stealWork(source_ptr);
+        IOSize size;
         if (m_into)
         {
             XrdCl::ChunkInfo *read_info;
             response->Get(read_info);
-            m_promise.set_value(read_info->length);
+            size = read_info->length;
         }
         else
         {
             XrdCl::VectorReadInfo *read_info;
             response->Get(read_info);
-            m_promise.set_value(read_info->GetSize());
+            size = read_info->GetSize();
+        }
+        timespec now;
+        MonotonicClock::now(now);
+        unsigned latency_ms = 1000*(now.tv_sec - m_issued.tv_sec) + (now.tv_nsec - m_issued.tv_nsec)/1000000;
+        source_ptr->statistics().addResponse(size, latency_ms);
+        XRD_ADAPTOR_TRACE_EVENT(RequestDone, this, size, latency_ms);
+        // If this request was hedged, only the first copy to finish counts.
+        ClientRequest &target = m_primary ? *m_primary : *this;
+        if (m_probe)
+        {
+            XRD_ADAPTOR_TRACE_EVENT(ProbeDone, source_ptr.get(), size, source_ptr->getQuality());
+        }
+        else if (!target.m_fulfilled.exchange(true))
+        {
+            if (m_scratch) scatter(size);
+            if (m_primary) source_ptr->statistics().addHedgeWin();
+            target.setValue(size);
+        }
+        else
+        {
+            XRD_ADAPTOR_TRACE_EVENT(LateResponse, this, size, reinterpret_cast<uintptr_t>(source_ptr.get()));
         }
     }
+    else if (m_probe)
+    {
+        // Nothing depends on a probe, so one failing after close is ignored.
+        if (manager)
+        {
+            edm::LogWarning("XrdAdaptorInternal") << "XrdRequestManager::handle(name='"
+              << manager->getFilename() << ") probe of inactive source " << source_ptr->ID()
+              << " failed with error '" << status->ToString() << "' (errno="
+              << status->errNo << ", code=" << status->code << ").";
+            manager->probeFailure(source_ptr);
+        }
+    }
+    else if (m_primary || m_fulfilled)
+    {
+        // A failed speculative copy is not retried; likewise for a failed
+        // original whose speculative copy has already fulfilled the request.
+        edm::LogWarning("XrdAdaptorInternal") << "XrdRequestManager::handle(name='"
+          << (manager ? manager->getFilename() : "(closed)") << ") failure of a hedged request when reading from "
+          << source_ptr->ID() << "; failed with error '" << status->ToString()
+          << "' (errno=" << status->errNo << ", code=" << status->code << ").";
+    }
+    else if (!manager)
+    {
+        edm::Exception ex(edm::errors::FileReadError);
+        ex << "XrdRequestManager::handle() read from " << source_ptr->ID()
+           << " failed after the file was closed, with error '" << status->ToString()
+           << "' (errno=" << status->errNo << ", code=" << status->code << ").";
+        if (!m_fulfilled.exchange(true)) setException(std::make_exception_ptr(ex));
+    }
     else
     {
         Source *source = m_source.get();
         edm::LogWarning("XrdAdaptorInternal") << "XrdRequestManager::handle(name='"
-          << m_manager.getFilename() << ") failure when reading from "
+          << manager->getFilename() << ") failure when reading from "
           << (source ? source->ID() : "(unknown source)")
           << "; failed with error '" << status->ToString() << "' (errno="
           << status->errNo << ", code=" << status->code << ").";
         m_failure_count++;
         try
         {
-            m_manager.requestFailure(m_self_reference);
+            manager->requestFailure(m_self_reference);
             return;
         }
         catch (edm::Exception& ex)
         {
             ex.addContext("In XrdAdaptor::ClientRequest::HandleResponse() case for failure");
             //m_promise.set_exception(std::make_exception_ptr(ex));
-            m_promise.set_exception(std::current_exception());
+            if (!m_fulfilled.exchange(true)) setException(std::current_exception());
         }
         catch (...)
         {
             edm::Exception ex(edm::errors::FileReadError);
-            ex << "XrdRequestManager::handle(name='" << m_manager.getFilename()
+            ex << "XrdRequestManager::handle(name='" << manager->getFilename()
                << ") failed with error '" << status->ToString()
                << "' (errno=" << status->errNo << ", code="
                << status->code << ").  Unknown exception occurred when running"
                << " connection recovery.";
             ex.addContext("Calling XrdRequestManager::handle()");
-            m_manager.addConnections(ex);
-            m_promise.set_exception(std::make_exception_ptr(ex));
+            manager->addConnections(ex);
+            if (!m_fulfilled.exchange(true)) setException(std::make_exception_ptr(ex));
         }
     }
     m_self_reference = nullptr;
 }
 
+void
+XrdAdaptor::ClientRequest::scatter(IOSize size)
+{
+    const char *scratch = &(*m_scratch)[0];
+    if (m_into)
+    {
+        memcpy(m_into, scratch, size);
+        return;
+    }
+    for (const auto & it : *m_iolist)
+    {
+        memcpy(it.data(), scratch, it.size());
+        scratch += it.size();
+    }
+}
+
+void
+XrdAdaptor::ClientRequest::setValue(IOSize size)
+{
+    if (m_join)
+    {
+        m_join->complete(size);
+        return;
+    }
+    if (m_hook) m_hook(size, std::exception_ptr());
+    m_promise.set_value(size);
+}
+
+void
+XrdAdaptor::ClientRequest::setException(std::exception_ptr error)
+{
+    if (m_join)
+    {
+        m_join->fail(error);
+        return;
+    }
+    if (m_hook) m_hook(0, error);
+    m_promise.set_exception(error);
+}
+
+void
+XrdAdaptor::RequestJoin::complete(IOSize size)
+{
+    m_total += size;
+    release();
+}
+
+void
+XrdAdaptor::RequestJoin::fail(std::exception_ptr error)
+{
+    {
+        std::lock_guard<std::mutex> sentry(m_mutex);
+        if (!m_error) m_error = error;
+    }
+    release();
+}
+
+void
+XrdAdaptor::RequestJoin::release()
+{
+    if (--m_remaining) return;
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    if (m_error)
+    {
+        if (m_hook) m_hook(0, m_error);
+        m_promise.set_exception(m_error);
+        return;
+    }
+    IOSize result = m_plan ? m_plan->finish(m_total, m_served) : static_cast<IOSize>(m_total);
+    if (m_hook) m_hook(result, std::exception_ptr());
+    m_promise.set_value(result);
+}
@@ -1,7 +1,11 @@
 #ifndef Utilities_XrdAdaptor_XrdRequest_h
 #define Utilities_XrdAdaptor_XrdRequest_h
 
+#include <atomic>
+#include <functional>
 #include <future>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include <boost/utility.hpp>
@@ -10,6 +14,9 @@
 #include "Utilities/StorageFactory/interface/Storage.h"
 
 #include "QualityMetric.h"
+#include "XrdCoalescer.h"
+#include "XrdRequestPool.h"
+#include "XrdScratchPool.h"
 
 namespace XrdAdaptor {
 
@@ -17,32 +24,86 @@ class Source;
 
 class RequestManager;
 
+/**
+ * Called once with the result, or the error, of a client request just
+ * before its future becomes ready; used to record asynchronous reads.
+ */
+typedef std::function<void(IOSize, std::exception_ptr)> CompletionHook;
+
+/**
+ * Collects the results of the pieces of a split client request and fulfills
+ * a single promise once every piece has completed.
+ *
+ * The join starts with one outstanding reference, held by whoever is
+ * splitting the request; it must call complete(0) once all the pieces
+ * have been added.
+ */
+class RequestJoin : boost::noncopyable {
+
+public:
+    explicit RequestJoin(const RequestPool &pool)
+      : m_remaining(1),
+        m_total(0),
+        m_promise(std::allocator_arg, pool.allocator<IOSize>()),
+        m_served(0)
+    {}
+
+    std::future<IOSize> get_future() {return m_promise.get_future();}
+
+    /**
+     * Note another piece is outstanding.
+     */
+    void add() {m_remaining++;}
+
+    void complete(IOSize size);
+
+    /**
+     * Record a failed piece.  The promise is failed with the first error
+     * only once all the other pieces are done, as they still write into
+     * the client's buffers.
+     */
+    void fail(std::exception_ptr error);
+
+    /**
+     * Complete a coalesced read with plan once every piece has succeeded;
+     * served bytes of it went straight to the client's chunks.  The promise
+     * is fulfilled with what the plan returns.
+     */
+    void setPlan(std::shared_ptr<ReadCoalescer::Plan> plan, IOSize served) {m_plan = std::move(plan); m_served = served;}
+
+    void setHook(CompletionHook hook) {m_hook = std::move(hook);}
+
+private:
+    void release();
+
+    std::atomic<unsigned> m_remaining;
+    std::atomic<IOSize> m_total;
+    std::exception_ptr m_error;
+    std::mutex m_mutex;
+    std::promise<IOSize> m_promise;
+    std::shared_ptr<ReadCoalescer::Plan> m_plan;
+    IOSize m_served;
+    CompletionHook m_hook;
+};
+
 class ClientRequest : boost::noncopyable, public XrdCl::ResponseHandler {
 
 friend class Source;
+friend class RequestManager;
 
 public:
 
-    ClientRequest(RequestManager &manager, void *into, IOSize size, IOOffset off)
-        : m_failure_count(0),
-          m_into(into),
-          m_size(size),
-          m_off(off),
-          m_iolist(nullptr),
-          m_manager(manager)
-    {
-    }
+    ClientRequest(RequestManager &manager, void *into, IOSize size, IOOffset off);
 
-    ClientRequest(RequestManager &manager, std::shared_ptr<std::vector<IOPosBuffer> > iolist)
-        : m_failure_count(0),
-          m_into(nullptr),
-          m_size(0),
-          m_off(0),
-          m_iolist(iolist),
-          m_manager(manager)
-    {
-        // TODO: calculate size here.
-    }
+    ClientRequest(RequestManager &manager, std::shared_ptr<std::vector<IOPosBuffer> > iolist);
+
+    /**
+     * Create a speculative copy of a straggling request.  The copy reads into
+     * the given scratch buffer; whichever of the two completes first
+     * fulfills the original's promise.  The other is left to complete on
+     * its own, possibly after the file has been closed.
+     */
+    ClientRequest(RequestManager &manager, std::shared_ptr<ClientRequest> primary, ScratchPool::Buffer scratch);
 
     virtual ~ClientRequest();
 
@@ -64,14 +125,70 @@ public:
      */
     std::shared_ptr<Source> getCurrentSource() const {return m_source;}
 
+    /**
+     * Read into scratch space rather than the client's buffers.  Only such
+     * requests are eligible to be hedged.
+     */
+    void setScratch(ScratchPool::Buffer scratch) {m_scratch = scratch;}
+
+    bool isSpeculative() const {return m_primary.get();}
+
+    /**
+     * Report the result to the given join rather than our own promise.
+     */
+    void setJoin(std::shared_ptr<RequestJoin> join) {join->add(); m_join = join;}
+
+    /**
+     * Run hook when our own promise is fulfilled.
+     */
+    void setHook(CompletionHook hook) {m_hook = std::move(hook);}
+
+    /**
+     * Turn this request into an active probe: it reads into the given scratch
+     * space purely to measure its source, and its result is discarded.
+     */
+    void setProbe(ScratchPool::Buffer scratch) {m_scratch = scratch; m_probe = true; m_hedged = true;}
+
 private:
+    /**
+     * Copy the size bytes read into our scratch space into the client's buffers.
+     */
+    void scatter(IOSize size);
+
+    /**
+     * Fulfill the request, either via our promise or the join we belong to.
+     */
+    void setValue(IOSize size);
+    void setException(std::exception_ptr error);
+
     unsigned m_failure_count;
     void *m_into;
     IOSize m_size;
     IOOffset m_off;
     std::shared_ptr<std::vector<IOPosBuffer> > m_iolist;
-    RequestManager &m_manager;
+    // Probes, the losing copies of hedged requests and reads whose futures
+    // were dropped may complete after the file is closed, so the manager is
+    // only reached through this, and only while handling the response.
+    std::weak_ptr<RequestManager> m_manager;
     std::shared_ptr<Source> m_source;
+    // When the request was last sent to a server, and the delivery state of
+    // that source at the time.
+    timespec m_issued;
+    IOSize m_delivered;
+    timespec m_delivered_time;
+    // Set if the source had no more work queued; such a request may
+    // understate the rate the source can deliver.
+    bool m_app_limited;
+
+    // For a speculative copy, the request being duplicated.
+    std::shared_ptr<ClientRequest> m_primary;
+    ScratchPool::Buffer m_scratch;
+    // Set once a speculative copy has been made; protected by the mutex of
+    // the source the request is outstanding on.
+    bool m_hedged;
+    bool m_probe;
+    // Set by whichever copy of the request is first to fulfill the promise.
+    std::atomic<bool> m_fulfilled;
 
     // Some explanation is due here.  When an IO is outstanding,
     // Xrootd takes a raw pointer to this object.  Hence we cannot
@@ -81,6 +198,8 @@ private:
     std::shared_ptr<ClientRequest> m_self_reference;
 
     std::promise<IOSize> m_promise;
+    std::shared_ptr<RequestJoin> m_join;
+    CompletionHook m_hook;
 
     QualityMetricWatch m_qmw;
 };
@@ -1,27 +1,71 @@
 
 #include <assert.h>
+#include <stdlib.h>
 #include <iostream>
 #include <algorithm>
+#include <limits>
 
 #include "XrdCl/XrdClFile.hh"
 
-#include "FWCore/Utilities/interface/CPUTimer.h"
 #include "FWCore/Utilities/interface/EDMException.h"
 #include "FWCore/MessageLogger/interface/MessageLogger.h"
 
+#include "Utilities/XrdAdaptor/src/XrdClock.h"
 #include "Utilities/XrdAdaptor/src/XrdRequestManager.h"
+#include "Utilities/XrdAdaptor/src/XrdTrace.h"
 
 #define XRD_CL_MAX_CHUNK 512*1024
 
+// Vector reads are queued on a source in requests of at most this many
+// bytes; this is the granularity at which work may be stolen.
+#define XRD_ADAPTOR_STEAL_UNIT 2*1024*1024
+
+// The most chunks in a single request; the xrootd protocol limit for a
+// vector read is 1024 elements.
+#define XRD_ADAPTOR_MAX_READV_CHUNKS 1024
+
+// Bounds the memory available to requests which may be hedged; each buffer
+// holds up to one XRD_ADAPTOR_STEAL_UNIT.
+#define XRD_ADAPTOR_SCRATCH_BUFFERS 16
+
+// After a straggler is seen which could not be hedged, new requests read
+// into scratch space, so that they may be, for this many seconds.
+#define XRD_ADAPTOR_HEDGE_SECONDS 60
+
+// Active probes may use at most this percentage of the bytes read by the client.
+#define XRD_ADAPTOR_PROBE_BUDGET_PERCENT 2
+
+// Chunks of a vector read separated by at most this many bytes are read as
+// one; overridden by the XRD_ADAPTOR_COALESCE_GAP environment variable.
+#define XRD_ADAPTOR_COALESCE_GAP 4*1024
+
 #define XRD_ADAPTOR_SHORT_OPEN_DELAY 5
 
+// Requests parked after the last active source failed are failed if no new
+// source opens within this many seconds.
+#define XRD_ADAPTOR_PARKED_TIMEOUT 60
+
+// Number of replicas to locate and open in parallel when a file is opened
+// for reading; zero opens a single source through the redirector and finds
+// more over time.  Overridden by the XRD_ADAPTOR_LOCATE_SOURCES environment
+// variable.
+#define XRD_ADAPTOR_LOCATE_SOURCES 0
+
+// Maximum number of sources used concurrently for a file.
+#ifndef XRD_ADAPTOR_MAX_ACTIVE_SOURCES
+#define XRD_ADAPTOR_MAX_ACTIVE_SOURCES 2
+#endif
+
 #ifdef XRD_FAKE_OPEN_PROBE
 #define XRD_ADAPTOR_OPEN_PROBE_PERCENT 100
+// Chance, per MB of client request, of duplicating the request to an inactive source
+#define XRD_ADAPTOR_PROBE_PERCENT_PER_MB 100
 #define XRD_ADAPTOR_LONG_OPEN_DELAY 20
 // This is the minimal difference in quality required to swap an active and inactive source
 #define XRD_ADAPTOR_SOURCE_QUALITY_FUDGE 0
 #else
 #define XRD_ADAPTOR_OPEN_PROBE_PERCENT 10
+#define XRD_ADAPTOR_PROBE_PERCENT_PER_MB 0.25
 #define XRD_ADAPTOR_LONG_OPEN_DELAY 2*60
 #define XRD_ADAPTOR_SOURCE_QUALITY_FUDGE 100
 #endif
@@ -35,53 +79,357 @@ long long timeDiffMS(const timespec &a, const timespec &b)
   return diff;
 }
 
+static long long
+timeMS(const timespec &a)
+{
+  return static_cast<long long>(a.tv_sec)*1000 + a.tv_nsec/1000000;
+}
+
+static IOSize
+requestSize(const std::vector<IOPosBuffer> &iolist)
+{
+  IOSize size = 0;
+  for (const auto & it : iolist) size += it.size();
+  return size;
+}
+
+static IOSize
+coalesceGap()
+{
+  const char *gap = getenv("XRD_ADAPTOR_COALESCE_GAP");
+  return gap ? strtoul(gap, nullptr, 10) : XRD_ADAPTOR_COALESCE_GAP;
+}
+
+static unsigned
+locateSources()
+{
+  const char *count = getenv("XRD_ADAPTOR_LOCATE_SOURCES");
+  return count ? strtoul(count, nullptr, 10) : XRD_ADAPTOR_LOCATE_SOURCES;
+}
+
+/*
+ * Returns the URL with its host replaced by the given server, or an empty
+ * string if the URL has no host.
+ */
+static std::string
+replicaURL(const std::string &url, const std::string &server)
+{
+  size_t host = url.find("://");
+  if (host == std::string::npos) return "";
+  host += 3;
+  size_t path = url.find('/', host);
+  if (path == std::string::npos) return "";
+  return url.substr(0, host) + server + url.substr(path);
+}
+
+/*
+ * Returns a uniform random number in [0, 100), advancing the shared seed
+ * without locking (splitmix64).
+ */
+static float
+lockFreePercent(std::atomic<unsigned long long> &seed)
+{
+  unsigned long long z = seed.fetch_add(0x9E3779B97F4A7C15ULL, std::memory_order_relaxed) + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z = z ^ (z >> 31);
+  return 100.0f * static_cast<float>(z >> 40) / static_cast<float>(1ULL << 24);
+}
+
 RequestManager::RequestManager(const std::string &filename, XrdCl::OpenFlags::Flags flags, XrdCl::Access::Mode perms)
-    : m_nextInitialSourceToggle(false),
+    : m_sources_generation(0),
+      m_closed(false),
+      m_nextInitialSource(0),
+      m_hedgeUntilMS(0),
       m_name(filename),
       m_flags(flags),
       m_perms(perms),
       m_distribution(0,100),
-      m_open_handler(*this)
+      m_scratch_pool(XRD_ADAPTOR_SCRATCH_BUFFERS, XRD_ADAPTOR_STEAL_UNIT),
+      m_probe_pool(1, XRD_ADAPTOR_STEAL_UNIT),
+      m_bytes_read(0),
+      m_probe_bytes(0),
+      m_probe_seed(reinterpret_cast<unsigned long long>(this)),
+      m_statistics(new Statistics()),
+      m_ticker_handle(0),
+      m_coalescer(coalesceGap(), XRD_CL_MAX_CHUNK),
+      m_replicas_pending(0),
+      m_replica_opened(false)
 {
-  std::unique_ptr<XrdCl::File> file(new XrdCl::File());
-  XrdCl::XRootDStatus status;
-  if (! (status = file->Open(filename, flags, perms)).IsOK())
+  XRD_ADAPTOR_TRACE_NAME(this, m_name);
   {
-    edm::Exception ex(edm::errors::FileOpenError);
-    ex << "XrdCl::File::Open(name='" << filename
-       << "', flags=0x" << std::hex << flags
-       << ", permissions=0" << std::oct << perms << std::dec
-       << ") => error '" << status.ToStr()
-       << "' (errno=" << status.errNo << ", code=" << status.code << ")";
-    ex.addContext("Calling XrdFile::open()");
-    addConnections(ex);
-    throw ex;
+    // An open failure reports the (so far empty) set of sources.
+    std::lock_guard<std::recursive_mutex> sentry(m_source_mutex);
+    publishSources();
   }
+}
 
-  timespec ts;
-  clock_gettime(CLOCK_MONOTONIC, &ts);
+std::shared_ptr<RequestManager>
+RequestManager::getInstance(const std::string &filename, XrdCl::OpenFlags::Flags flags, XrdCl::Access::Mode perms)
+{
+  std::shared_ptr<RequestManager> instance(new RequestManager(filename, flags, perms));
+  instance->initialize(instance);
+  return instance;
+}
+
+void
+RequestManager::initialize(std::weak_ptr<RequestManager> self)
+{
+  m_self = self;
+  m_open_handler = std::make_shared<OpenHandler>(self);
 
-  std::shared_ptr<Source> source(new Source(ts, std::move(file)));
+  if (!openReplicas())
   {
+    // Steer the redirector away from servers which recently failed; if
+    // they are all it has, try them anyway.
+    std::string name = m_name + prepareOpaqueString();
+    std::unique_ptr<FileHandle> file = FileHandle::create();
+    XrdCl::XRootDStatus status = file->Open(name, m_flags, m_perms);
+    if (!status.IsOK() && (name != m_name))
+    {
+      edm::LogVerbatim("XrdAdaptorInternal") << "Opening " << name << " failed (" << status.ToStr()
+        << "); retrying without excluding any servers";
+      name = m_name;
+      file = FileHandle::create();
+      status = file->Open(name, m_flags, m_perms);
+    }
+    if (!status.IsOK())
+    {
+      edm::Exception ex(edm::errors::FileOpenError);
+      ex << "XrdCl::File::Open(name='" << name
+         << "', flags=0x" << std::hex << m_flags
+         << ", permissions=0" << std::oct << m_perms << std::dec
+         << ") => error '" << status.ToStr()
+         << "' (errno=" << status.errNo << ", code=" << status.code << ")";
+      ex.addContext("Calling XrdFile::open()");
+      addConnections(ex);
+      throw ex;
+    }
+
+    timespec ts;
+    MonotonicClock::now(ts);
+    std::shared_ptr<Source> source(new Source(ts, std::move(file), m_statistics));
     std::lock_guard<std::recursive_mutex> sentry(m_source_mutex);
     m_activeSources.push_back(source);
+    publishSources();
+  }
+
+  timespec ts;
+  MonotonicClock::now(ts);
+  {
+    std::lock_guard<std::recursive_mutex> sentry(m_source_mutex);
+    m_lastSourceCheck = ts;
+    ts.tv_sec += XRD_ADAPTOR_SHORT_OPEN_DELAY;
+    m_nextActiveSourceCheck = ts;
+    updateNextSourceCheck();
   }
 
-  m_lastSourceCheck = ts;
-  ts.tv_sec += XRD_ADAPTOR_SHORT_OPEN_DELAY;
-  m_nextActiveSourceCheck = ts;
+  // close() removes the callback before we can go away.
+  m_ticker_handle = Ticker::instance().add([this]() {checkHedges(); checkParked();});
 }
 
 RequestManager::~RequestManager()
-{}
+{
+  close();
+}
+
+void
+RequestManager::close()
+{
+  std::vector<std::shared_ptr<Source> > sources;
+  {
+    std::lock_guard<std::recursive_mutex> sentry(m_source_mutex);
+    if (m_closed) return;
+    m_closed = true;
+    sources.insert(sources.end(), m_activeSources.begin(), m_activeSources.end());
+    sources.insert(sources.end(), m_inactiveSources.begin(), m_inactiveSources.end());
+    sources.insert(sources.end(), m_disabledSources.begin(), m_disabledSources.end());
+  }
+  // Once this returns, checkHedges and checkParked are not running.
+  if (m_ticker_handle) Ticker::instance().remove(m_ticker_handle);
+
+  Statistics::Snapshot total;
+  std::vector<std::pair<std::string, Statistics::Snapshot> > stats;
+  getStatistics(total, stats);
+  edm::LogInfo("XrdAdaptor") << "IO summary for " << m_name << ": " << total;
+  for (const auto & source : stats)
+  {
+    edm::LogInfo("XrdAdaptor") << "IO summary for " << m_name << " at " << source.first << ": " << source.second;
+  }
+  if (m_coalescer.coalescedBytes())
+  {
+    edm::LogVerbatim("XrdAdaptor") << "Coalesced vector reads of " << m_name << ": "
+      << m_coalescer.coalescedBytes() << " bytes requested, " << m_coalescer.overReadBytes()
+      << " extra bytes read for gaps of at most " << m_coalescer.maxGap() << " bytes";
+  }
+
+  // Nothing will send the queued or parked requests now.
+  std::vector<std::shared_ptr<ClientRequest> > requests;
+  {
+    std::lock_guard<std::recursive_mutex> sentry(m_source_mutex);
+    m_activeSources.clear();
+    m_inactiveSources.clear();
+    publishSources();
+    requests.swap(m_parked);
+  }
+  for (const auto & source : sources) source->drainQueue(requests);
+  if (!requests.empty())
+  {
+    edm::Exception ex(edm::errors::FileReadError);
+    ex << "XrdRequestManager::close(name='" << m_name
+       << "') file closed with " << requests.size() << " requests not yet sent";
+    failRequests(requests, std::make_exception_ptr(ex));
+  }
+  for (const auto & source : sources) source->close();
+}
+
+bool
+RequestManager::openReplicas()
+{
+  unsigned count = locateSources();
+  // Writes must go wherever the redirector sends them.
+  if (!count || (m_flags & (XrdCl::OpenFlags::Update | XrdCl::OpenFlags::New | XrdCl::OpenFlags::Delete))) return false;
+
+  std::vector<std::string> servers;
+  XrdCl::XRootDStatus status = FileHandle::create()->Locate(m_name, servers);
+  if (!status.IsOK() || (servers.size() < 2))
+  {
+    edm::LogVerbatim("XrdAdaptorInternal") << "Locating replicas of " << m_name << " found "
+      << servers.size() << " (" << status.ToStr() << "); opening through the redirector";
+    return false;
+  }
+  // Best first, by the quality seen in this process or a previous job.
+  // Servers which recently failed for any file are dropped, unless no
+  // other server has the file.
+  std::vector<std::pair<unsigned, std::string> > ranked;
+  for (const auto & server : servers)
+  {
+    if (!ServerHealth::isBad(server)) ranked.emplace_back(QualityMetricFactory::estimate(server), server);
+  }
+  if (ranked.empty())
+  {
+    for (const auto & server : servers) ranked.emplace_back(QualityMetricFactory::estimate(server), server);
+  }
+  std::stable_sort(ranked.begin(), ranked.end(),
+      [](const std::pair<unsigned, std::string> &r1, const std::pair<unsigned, std::string> &r2) {return r1.first < r2.first;});
+  if (ranked.size() > count) ranked.resize(count);
+
+  {
+    std::lock_guard<std::mutex> sentry(m_replica_mutex);
+    m_replicas_pending += ranked.size();
+  }
+  for (const auto & replica : ranked)
+  {
+    std::string url = replicaURL(m_name, replica.second);
+    // The response may arrive before Open returns.
+    ReplicaHandler *handler = new ReplicaHandler(m_self, replica.second, url);
+    if (url.empty() || !(status = handler->open()).IsOK())
+    {
+      if (!url.empty()) ServerHealth::reportFailure(replica.second);
+      delete handler;
+      replicaDone(false);
+    }
+  }
+
+  // Any one replica is enough to start with; the rest join as they open.
+  FileHandle::WaitFunction wait = FileHandle::waitFunction();
+  std::unique_lock<std::mutex> sentry(m_replica_mutex);
+  while (m_replicas_pending && !m_replica_opened)
+  {
+    if (!wait)
+    {
+      m_replica_cv.wait(sentry);
+      continue;
+    }
+    // The responses are delivered on this thread; let them through.
+    sentry.unlock();
+    bool more = wait();
+    sentry.lock();
+    if (!more) break;
+  }
+  return m_replica_opened;
+}
+
+void
+RequestManager::replicaDone(bool opened)
+{
+  std::lock_guard<std::mutex> sentry(m_replica_mutex);
+  m_replicas_pending--;
+  if (opened) m_replica_opened = true;
+  // Notify with the lock held: the destructor may be waiting to proceed.
+  m_replica_cv.notify_all();
+}
+
+namespace {
+  // Generations are unique across managers, so a cached generation which
+  // matches identifies both the manager and its current snapshot.
+  std::atomic<unsigned long long> g_sources_generation(0);
+  // Snapshots cached per thread, for as many files read at once.
+  const unsigned kCachedSources = 4;
+}
+
+void
+RequestManager::publishSources()
+{
+  std::shared_ptr<SourceSet> sources(new SourceSet());
+  sources->m_active = m_activeSources;
+  sources->m_inactive = m_inactiveSources;
+  std::lock_guard<std::mutex> sentry(m_snapshot_mutex);
+  m_sources = sources;
+  m_sources_generation.store(++g_sources_generation, std::memory_order_release);
+}
+
+std::shared_ptr<const RequestManager::SourceSet>
+RequestManager::getSources() const
+{
+  struct Cached {
+    unsigned long long m_generation;
+    // Weak, so that a thread which stops reading does not keep the sources
+    // of a closed file alive.
+    std::weak_ptr<const SourceSet> m_sources;
+  };
+  static thread_local Cached t_cached[kCachedSources];
+  static thread_local unsigned t_next = 0;
+
+  unsigned long long generation = m_sources_generation.load(std::memory_order_acquire);
+  for (const auto & cached : t_cached)
+  {
+    if (cached.m_generation != generation) continue;
+    // Fails only if a newer snapshot has just replaced the cached one.
+    std::shared_ptr<const SourceSet> sources = cached.m_sources.lock();
+    if (sources) return sources;
+    break;
+  }
+
+  std::shared_ptr<const SourceSet> sources;
+  {
+    std::lock_guard<std::mutex> sentry(m_snapshot_mutex);
+    sources = m_sources;
+    generation = m_sources_generation.load(std::memory_order_relaxed);
+  }
+  Cached &cached = t_cached[t_next++ % kCachedSources];
+  cached.m_generation = generation;
+  cached.m_sources = sources;
+  return sources;
+}
+
+void
+RequestManager::updateNextSourceCheck()
+{
+  m_nextSourceCheckMS.store(std::max(timeMS(m_lastSourceCheck)+1000, timeMS(m_nextActiveSourceCheck)), std::memory_order_relaxed);
+}
 
 void
 RequestManager::checkSources(timespec &now, IOSize requestSize)
 {
-  edm::LogVerbatim("XrdAdaptorInternal") << "Time since last check "
-    << timeDiffMS(now, m_lastSourceCheck) << "; last check "
-    << m_lastSourceCheck.tv_sec << "; now " <<now.tv_sec
-    << "; next check " << m_nextActiveSourceCheck.tv_sec << std::endl;  
+  // Lock-free test for the common case on the read path.
+  if (timeMS(now) <= m_nextSourceCheckMS.load(std::memory_order_relaxed)) return;
+  // If another thread holds the lock, it is either checking the sources or
+  // changing them; either way, there's no need to wait for it.
+  std::unique_lock<std::recursive_mutex> sentry(m_source_mutex, std::try_to_lock);
+  if (!sentry.owns_lock()) return;
+
+  XRD_ADAPTOR_TRACE_EVENT(CheckSources, this, timeDiffMS(now, m_lastSourceCheck), 0);
   if (timeDiffMS(now, m_lastSourceCheck) > 1000 && timeDiffMS(now, m_nextActiveSourceCheck) > 0)
   {   
     checkSourcesImpl(now, requestSize);
@@ -94,32 +442,28 @@ RequestManager::checkSourcesImpl(timespec &now, IOSize requestSize)
   std::lock_guard<std::recursive_mutex> sentry(m_source_mutex);
 
   bool findNewSource = false;
-  if (m_activeSources.size() <= 1)
+  if (m_activeSources.size() < XRD_ADAPTOR_MAX_ACTIVE_SOURCES)
     findNewSource = true;
-  else if (m_activeSources.size() > 1)
+  if (m_activeSources.size() > 1)
   {
-    edm::LogVerbatim("XrdAdaptorInternal") << "Source 0 quality " << m_activeSources[0]->getQuality() << ", source 1 quality " << m_activeSources[1]->getQuality() << std::endl;
-    if ((m_activeSources[0]->getQuality() > 5130) ||
-        ((m_activeSources[0]->getQuality() > 260) && (m_activeSources[1]->getQuality()*4 < m_activeSources[0]->getQuality())))
-    {
-        edm::LogWarning("XrdAdaptorInternal") << "Removing "
-          << m_activeSources[0]->ID() << " from active sources due to poor quality ("
-          << m_activeSources[0]->getQuality() << ")" << std::endl;
-        if (m_activeSources[0]->getLastDowngrade().tv_sec != 0) findNewSource = true;
-        m_activeSources[0]->setLastDowngrade(now);
-        m_inactiveSources.emplace_back(m_activeSources[0]);
-        m_activeSources.erase(m_activeSources.begin());
-    }
-    else if ((m_activeSources[1]->getQuality() > 5130) ||
-        ((m_activeSources[1]->getQuality() > 260) && (m_activeSources[0]->getQuality()*4 < m_activeSources[1]->getQuality())))
+    std::vector<std::shared_ptr<Source> >::iterator bestActiveSource = std::min_element(m_activeSources.begin(), m_activeSources.end(),
+        [](const std::shared_ptr<Source> &s1, const std::shared_ptr<Source> &s2) {return s1->getQuality() < s2->getQuality();});
+    std::vector<std::shared_ptr<Source> >::iterator worstActiveSource = std::max_element(m_activeSources.begin(), m_activeSources.end(),
+        [](const std::shared_ptr<Source> &s1, const std::shared_ptr<Source> &s2) {return s1->getQuality() < s2->getQuality();});
+    XRD_ADAPTOR_TRACE_EVENT(SourceQuality, bestActiveSource->get(), (*bestActiveSource)->getQuality(), 1);
+    XRD_ADAPTOR_TRACE_EVENT(SourceQuality, worstActiveSource->get(), (*worstActiveSource)->getQuality(), 1);
+    if (((*worstActiveSource)->getQuality() > 5130) ||
+        (((*worstActiveSource)->getQuality() > 260) && ((*bestActiveSource)->getQuality()*4 < (*worstActiveSource)->getQuality())))
     {
         edm::LogWarning("XrdAdaptorInternal") << "Removing "
-          << m_activeSources[1]->ID() << " from active sources due to poor quality ("
-          << m_activeSources[1]->getQuality() << ")" << std::endl;
-        if (m_activeSources[1]->getLastDowngrade().tv_sec != 0) findNewSource = true;
-        m_activeSources[1]->setLastDowngrade(now);
-        m_inactiveSources.emplace_back(m_activeSources[1]);
-        m_activeSources.erase(m_activeSources.begin()+1);
+          << (*worstActiveSource)->ID() << " from active sources due to poor quality ("
+          << (*worstActiveSource)->getQuality() << ")" << std::endl;
+        if ((*worstActiveSource)->getLastDowngrade().tv_sec != 0) findNewSource = true;
+        (*worstActiveSource)->setLastDowngrade(now);
+        (*worstActiveSource)->statistics().addDemotion();
+        ServerHealth::reportSlow((*worstActiveSource)->ID());
+        m_inactiveSources.emplace_back(*worstActiveSource);
+        m_activeSources.erase(worstActiveSource);
     }
     // NOTE: We could probably replace the copy with a better sort function at the cost of mental capacity.
     std::vector<std::shared_ptr<Source> > eligibleInactiveSources; eligibleInactiveSources.reserve(m_inactiveSources.size());
@@ -127,17 +471,16 @@ RequestManager::checkSourcesImpl(timespec &now, IOSize requestSize)
     //for (const auto & source : m_inactiveSources) eligibleInactiveSources.push_back(source);
     std::vector<std::shared_ptr<Source> >::iterator bestInactiveSource = std::min_element(eligibleInactiveSources.begin(), eligibleInactiveSources.end(),
         [](const std::shared_ptr<Source> &s1, const std::shared_ptr<Source> &s2) {return s1->getQuality() < s2->getQuality();});
-    std::vector<std::shared_ptr<Source> >::iterator worstActiveSource = std::max_element(m_activeSources.begin(), m_activeSources.end(),
+    worstActiveSource = std::max_element(m_activeSources.begin(), m_activeSources.end(),
         [](const std::shared_ptr<Source> &s1, const std::shared_ptr<Source> &s2) {return s1->getQuality() < s2->getQuality();});
     if (bestInactiveSource != eligibleInactiveSources.end() && bestInactiveSource->get())
     {
-        edm::LogVerbatim("XrdAdaptorInternal") << "Best inactive source: " <<(*bestInactiveSource)->ID()
-            << ", quality " << (*bestInactiveSource)->getQuality();
+        XRD_ADAPTOR_TRACE_EVENT(SourceQuality, bestInactiveSource->get(), (*bestInactiveSource)->getQuality(), 0);
     }
-    edm::LogVerbatim("XrdAdaptorInternal") << "Worst active source: " <<(*worstActiveSource)->ID() 
-        << ", quality " << (*worstActiveSource)->getQuality();
-    if ((bestInactiveSource != eligibleInactiveSources.end()) && m_activeSources.size() == 1)
+    XRD_ADAPTOR_TRACE_EVENT(SourceQuality, worstActiveSource->get(), (*worstActiveSource)->getQuality(), 1);
+    if ((bestInactiveSource != eligibleInactiveSources.end()) && m_activeSources.size() < XRD_ADAPTOR_MAX_ACTIVE_SOURCES)
     {
+        (*bestInactiveSource)->statistics().addPromotion();
         m_activeSources.push_back(*bestInactiveSource);
         for (auto it = m_inactiveSources.begin(); it != m_inactiveSources.end(); it++) if (it->get() == bestInactiveSource->get()) {m_inactiveSources.erase(it); break;}
     }
@@ -148,6 +491,8 @@ RequestManager::checkSourcesImpl(timespec &now, IOSize requestSize)
             << ") and promoting " << (*bestInactiveSource)->ID() << " (quality: "
             << (*bestInactiveSource)->getQuality() << ")" << std::endl;
         (*worstActiveSource)->setLastDowngrade(now);
+        (*worstActiveSource)->statistics().addDemotion();
+        (*bestInactiveSource)->statistics().addPromotion();
         for (auto it = m_inactiveSources.begin(); it != m_inactiveSources.end(); it++) if (it->get() == bestInactiveSource->get()) {m_inactiveSources.erase(it); break;}
         m_inactiveSources.emplace_back(std::move(*worstActiveSource));
         m_activeSources.erase(worstActiveSource);
@@ -170,27 +515,56 @@ RequestManager::checkSourcesImpl(timespec &now, IOSize requestSize)
   }
   if (findNewSource)
   {
-    m_open_handler.open();
+    m_open_handler->open();
     m_lastSourceCheck = now;
   }
 
+  publishSources();
+
   now.tv_sec += XRD_ADAPTOR_SHORT_OPEN_DELAY;
   m_nextActiveSourceCheck = now;
+  updateNextSourceCheck();
 }
 
-std::shared_ptr<XrdCl::File>
+void
+RequestManager::getStatistics(Statistics::Snapshot &total, std::vector<std::pair<std::string, Statistics::Snapshot> > &sources)
+{
+  m_statistics->snapshot(total);
+  std::shared_ptr<const SourceSet> current = getSources();
+  for (const auto & list : {&current->m_active, &current->m_inactive})
+  {
+    for (const auto & source : *list)
+    {
+      sources.emplace_back(source->ID(), Statistics::Snapshot());
+      source->statistics().snapshot(sources.back().second);
+    }
+  }
+}
+
+std::shared_ptr<FileHandle>
 RequestManager::getActiveFile()
 {
-  std::lock_guard<std::recursive_mutex> sentry(m_source_mutex);
-  return m_activeSources[0]->getFileHandle();
+  std::shared_ptr<const SourceSet> sources = getSources();
+  if (sources->m_active.empty())
+  {
+    edm::Exception ex(edm::errors::FileReadError);
+    ex << "XrdAdaptor::RequestManager::getActiveFile(name='" << m_name
+       << "', flags=0x" << std::hex << m_flags
+       << ", permissions=0" << std::oct << m_perms << std::dec
+       << ") => no active source, as the last one failed";
+    ex.addContext("In XrdAdaptor::RequestManager::getActiveFile()");
+    addConnections(ex);
+    throw ex;
+  }
+  return sources->m_active[0]->getFileHandle();
 }
 
 void
 RequestManager::getActiveSourceNames(std::vector<std::string> & sources)
 {
-  std::lock_guard<std::recursive_mutex> sentry(m_source_mutex);
-  sources.reserve(m_activeSources.size());
-  for (auto const& source : m_activeSources) {
+  std::shared_ptr<const SourceSet> current = getSources();
+  sources.reserve(current->m_active.size());
+  for (auto const& source : current->m_active) {
     sources.push_back(source->ID());
   }
 }
@@ -222,62 +596,69 @@ RequestManager::addConnections(cms::Exception &ex)
   }
 }
 
+std::future<IOSize>
+RequestManager::handle(void * into, IOSize size, IOOffset off, bool split, CompletionHook hook)
+{
+  // With one source there is nothing to gain from splitting.
+  if (split && (size > XRD_ADAPTOR_STEAL_UNIT) && (getSources()->m_active.size() > 1))
+  {
+    // Vector read elements are limited in size; cut the buffer into chunks
+    // which the coalescer will leave alone.
+    RequestPool::IOList iolist = m_request_pool.acquireIOList();
+    iolist->reserve(size/XRD_CL_MAX_CHUNK + 1);
+    char *buffer = static_cast<char *>(into);
+    for (IOSize pos = 0; pos < size; pos += XRD_CL_MAX_CHUNK)
+    {
+      iolist->emplace_back(IOPosBuffer(off + pos, buffer + pos, std::min(size - pos, static_cast<IOSize>(XRD_CL_MAX_CHUNK))));
+    }
+    return handle(iolist, 0, std::move(hook));
+  }
+  std::shared_ptr<XrdAdaptor::ClientRequest> c_ptr = m_request_pool.make<XrdAdaptor::ClientRequest>(*this, into, size, off);
+  if (hook) c_ptr->setHook(std::move(hook));
+  return handle(c_ptr);
+}
+
 std::future<IOSize>
 RequestManager::handle(std::shared_ptr<XrdAdaptor::ClientRequest> c_ptr)
 {
   assert(c_ptr.get());
   timespec now;
-  clock_gettime(CLOCK_MONOTONIC, &now);
+  MonotonicClock::now(now);
   checkSources(now, c_ptr->getSize());
 
-  std::shared_ptr<Source> source = nullptr;
+  std::shared_ptr<const SourceSet> sources = getSources();
+  std::future<IOSize> future = c_ptr->get_future();
+  if (sources->m_active.empty())
   {
-    std::lock_guard<std::recursive_mutex> sentry(m_source_mutex);
-    if (m_activeSources.size() == 2)
-    {
-        if (m_nextInitialSourceToggle)
-        {
-            source = m_activeSources[0];
-            m_nextInitialSourceToggle = false;
-        }
-        else
-        {
-            source = m_activeSources[1];
-            m_nextInitialSourceToggle = true;
-        }
-    }
-    else
-    {
-        source = m_activeSources[0];
-    }
+    parkRequests(std::vector<std::shared_ptr<ClientRequest> >(1, c_ptr));
+    return future;
   }
+  std::shared_ptr<Source> source = sources->m_active[m_nextInitialSource++ % sources->m_active.size()];
+  prepareHedge(*c_ptr, *sources);
+  issueProbe(*c_ptr, *sources);
   source->handle(c_ptr);
-  return c_ptr->get_future();
+  return future;
 }
 
 std::string
 RequestManager::prepareOpaqueString()
 {
+    // Servers which failed for other files in this process are skipped too.
+    std::vector<std::string> ids;
+    ServerHealth::getBadServers(ids);
     std::lock_guard<std::recursive_mutex> sentry(m_source_mutex);
+    for ( const auto & it : m_activeSources ) ids.push_back(it->ID());
+    for ( const auto & it : m_inactiveSources ) ids.push_back(it->ID());
+    ids.insert(ids.end(), m_disabledSourceStrings.begin(), m_disabledSourceStrings.end());
+    std::set<std::string> hosts;
     std::stringstream ss;
-    ss << "?tried=";
-    size_t count = 0;
-    for ( const auto & it : m_activeSources )
-    {
-        count++;
-        ss << it->ID().substr(0, it->ID().find(":")) << ",";
-    }
-    for ( const auto & it : m_inactiveSources )
-    {
-        count++;
-        ss << it->ID().substr(0, it->ID().find(":")) << ",";
-    }
-    for ( const auto & it : m_disabledSourceStrings )
+    ss << ((m_name.find('?') == std::string::npos) ? "?" : "&") << "tried=";
+    for ( const auto & it : ids )
     {
-        count++;
-        ss << it.substr(0, it.find(":")) << ",";
+        std::string host = it.substr(0, it.find(":"));
+        if (hosts.insert(host).second) ss << host << ",";
     }
-    if (count)
+    if (hosts.size())
     {
         std::string tmp_str = ss.str();
         return tmp_str.substr(0, tmp_str.size()-1);
@@ -286,14 +667,16 @@ RequestManager::prepareOpaqueString()
 }
 
 void 
-XrdAdaptor::RequestManager::handleOpen(XrdCl::XRootDStatus &status, std::shared_ptr<Source> source)
+XrdAdaptor::RequestManager::handleOpen(XrdCl::XRootDStatus &status, std::shared_ptr<Source> source, std::exception_ptr error)
 {
-    std::lock_guard<std::recursive_mutex> sentry(m_source_mutex);
+    std::unique_lock<std::recursive_mutex> sentry(m_source_mutex);
+    // A source which opens after close() is simply dropped.
+    if (m_closed) return;
     if (status.IsOK())
     {
         edm::LogVerbatim("XrdAdaptorInternal") << "Successfully opened new source: " << source->ID() << std::endl;
 
-        if (m_activeSources.size() < 2)
+        if (m_activeSources.size() < XRD_ADAPTOR_MAX_ACTIVE_SOURCES)
         {
             m_activeSources.push_back(source);
         }
@@ -301,79 +684,181 @@ XrdAdaptor::RequestManager::handleOpen(XrdCl::XRootDStatus &status, std::shared_
         {
             m_inactiveSources.push_back(source);
         }
+        publishSources();
+        // Resume the requests parked by requestFailure.
+        std::vector<std::shared_ptr<ClientRequest> > parked;
+        parked.swap(m_parked);
+        std::shared_ptr<Source> new_source = m_activeSources[0];
+        sentry.unlock();
+        for (const auto & c_ptr : parked) new_source->handle(c_ptr);
     }
     else
     {   // File-open failure - wait at least 120s before next attempt.
         edm::LogVerbatim("XrdAdaptorInternal") << "Got failure when trying to open a new source" << std::endl;
         m_nextActiveSourceCheck.tv_sec += XRD_ADAPTOR_LONG_OPEN_DELAY - XRD_ADAPTOR_SHORT_OPEN_DELAY;
+        updateNextSourceCheck();
+        if (!m_parked.empty())
+        {
+            sentry.unlock();
+            if (!error)
+            {
+                edm::Exception ex(edm::errors::FileOpenError);
+                ex << "XrdCl::File::Open(name='" << m_name
+                   << "') => error '" << status.ToStr()
+                   << "' (errno=" << status.errNo << ", code=" << status.code << ")";
+                ex.addContext("In XrdAdaptor::RequestManager::handleOpen()");
+                error = std::make_exception_ptr(ex);
+            }
+            failParked(error);
+        }
     }
 }
 
 std::future<IOSize>
-XrdAdaptor::RequestManager::handle(std::shared_ptr<std::vector<IOPosBuffer> > iolist)
+XrdAdaptor::RequestManager::handle(std::shared_ptr<std::vector<IOPosBuffer> > iolist, IOSize served, CompletionHook hook)
 {
-    std::lock_guard<std::recursive_mutex> sentry(m_source_mutex);
-
     timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
+    MonotonicClock::now(now);
 
-    edm::CPUTimer timer;
-    timer.start();
+    assert(iolist.get());
+    // Merge nearby chunks; the plan copies them out once all the pieces are in.
+    RequestPool::IOList wire = m_request_pool.acquireIOList();
+    std::shared_ptr<ReadCoalescer::Plan> plan = m_coalescer.coalesce(*iolist, *wire, m_request_pool);
+    if (plan) iolist = wire;
 
-    assert(m_activeSources.size());
-    if (m_activeSources.size() == 1)
+    checkSources(now, iolist->size());
+    // Work against a snapshot: a concurrent change to the sources will not
+    // affect the request being split.
+    std::shared_ptr<const SourceSet> sources = getSources();
+    const std::vector<std::shared_ptr<Source> > &active = sources->m_active;
+    // Small requests go out as-is; larger ones are pipelined as bounded pieces.
+    if ((active.size() == 1) && !served && !plan && (iolist->size() <= XRD_ADAPTOR_MAX_READV_CHUNKS) && (requestSize(*iolist) <= XRD_ADAPTOR_STEAL_UNIT))
     {
-        std::shared_ptr<XrdAdaptor::ClientRequest> c_ptr(new XrdAdaptor::ClientRequest(*this, iolist));
-        checkSources(now, c_ptr->getSize());
-        m_activeSources[0]->handle(c_ptr);
+        std::shared_ptr<XrdAdaptor::ClientRequest> c_ptr = m_request_pool.make<XrdAdaptor::ClientRequest>(*this, iolist);
+        if (hook) c_ptr->setHook(std::move(hook));
+        issueProbe(*c_ptr, *sources);
+        active[0]->handle(c_ptr);
         return c_ptr->get_future();
     }
 
-    assert(iolist.get());
-    std::shared_ptr<std::vector<IOPosBuffer> > req1(new std::vector<IOPosBuffer>);
-    std::shared_ptr<std::vector<IOPosBuffer> > req2(new std::vector<IOPosBuffer>);
-    splitClientRequest(*iolist, *req1, *req2);
+    ThreadScratch<std::vector<std::vector<IOPosBuffer> > > tmp;
+    std::vector<std::vector<IOPosBuffer> > &requests = tmp.get();
+    if (active.size())
+    {
+        splitClientRequest(*iolist, active, requests);
+        issueProbe(*iolist, *sources);
+    }
+    else
+    {
+        // No source to split across; the pieces are parked below.
+        requests.resize(1);
+        requests[0].assign(iolist->begin(), iolist->end());
+    }
 
-    checkSources(now, req1->size() + req2->size());
-    // CheckSources may have removed a source
-    if (m_activeSources.size() == 1)
+    std::shared_ptr<RequestJoin> join = m_request_pool.make<RequestJoin>(m_request_pool);
+    std::future<IOSize> future = join->get_future();
+    if (plan) join->setPlan(plan, served);
+    if (hook) join->setHook(std::move(hook));
+    // With no source, the last one failed and its replacement is not yet open.
+    if (active.empty()) queueRequests(nullptr, requests[0], join, *sources);
+    for (size_t idx = 0; idx < active.size(); idx++)
     {
-        std::shared_ptr<XrdAdaptor::ClientRequest> c_ptr(new XrdAdaptor::ClientRequest(*this, iolist));
-        m_activeSources[0]->handle(c_ptr);
-        return c_ptr->get_future();
+        queueRequests(active[idx], requests[idx], join, *sources);
     }
+    // Release the reference held while the pieces were being queued.
+    join->complete(served);
+    return future;
+}
 
-    std::shared_ptr<XrdAdaptor::ClientRequest> c_ptr1, c_ptr2;
-    std::future<IOSize> future1, future2;
-    if (req1->size())
+void
+RequestManager::stealWork(const std::shared_ptr<Source> &idle)
+{
+    std::shared_ptr<const SourceSet> sources = getSources();
+    const std::vector<std::shared_ptr<Source> > &active = sources->m_active;
+    if (std::find(active.begin(), active.end(), idle) == active.end())
     {
-        c_ptr1.reset(new XrdAdaptor::ClientRequest(*this, req1));
-        m_activeSources[0]->handle(c_ptr1);
-        future1 = c_ptr1->get_future();
+        return;
     }
-    if (req2->size())
+    // Fill the window of the idle source; a fast source takes work queued
+    // behind the slower ones.
+    bool stolen = false;
+    do
     {
-        c_ptr2.reset(new XrdAdaptor::ClientRequest(*this, req2));
-        m_activeSources[1]->handle(c_ptr2);
-        future2 = c_ptr2->get_future();
+        std::shared_ptr<ClientRequest> c_ptr;
+        for (const auto & source : active)
+        {
+            if (source == idle) continue;
+            c_ptr = source->stealRequest();
+            if (c_ptr)
+            {
+                XRD_ADAPTOR_TRACE_EVENT(Steal, source.get(), c_ptr->getSize(), reinterpret_cast<uintptr_t>(idle.get()));
+                idle->statistics().addSteal();
+                idle->handle(c_ptr);
+                stolen = true;
+                break;
+            }
+        }
+        if (!c_ptr) break;
     }
-    if (req1->size() && req2->size())
+    while (idle->hasRoom());
+    // Nothing left to steal; perhaps another source is sitting on a straggler.
+    if (!stolen) checkHedges();
+}
+
+void
+RequestManager::checkHedges()
+{
+    std::shared_ptr<const SourceSet> sources = getSources();
+    const std::vector<std::shared_ptr<Source> > &active = sources->m_active;
+    if (active.size() < 2) return;
+
+    timespec now;
+    MonotonicClock::now(now);
+    for (const auto & slow : active)
     {
-        std::future<IOSize> task = std::async(std::launch::deferred,
-            [](std::future<IOSize> a, std::future<IOSize> b){
-                return b.get() + a.get();
-            },
-            std::move(future1),
-            std::move(future2));
-        timer.stop();
-        //edm::LogVerbatim("XrdAdaptorInternal") << "Total time to create requests " << static_cast<int>(1000*timer.realTime()) << std::endl;
-        return task;
+        for (const auto & fast : active)
+        {
+            if ((fast == slow) || !fast->queueEmpty()) continue;
+            bool unprepared = false;
+            std::shared_ptr<ClientRequest> straggler = slow->takeStraggler(now, unprepared);
+            if (unprepared) m_hedgeUntilMS.store(timeMS(now) + 1000*XRD_ADAPTOR_HEDGE_SECONDS, std::memory_order_relaxed);
+            if (!straggler) break;
+            // Speculative reads are limited by the scratch pool; a straggler
+            // without one is left to complete on its own.
+            ScratchPool::Buffer scratch = m_scratch_pool.acquire(straggler->getSize());
+            if (!scratch) return;
+            XRD_ADAPTOR_TRACE_EVENT(Hedge, slow.get(), straggler->getSize(), reinterpret_cast<uintptr_t>(fast.get()));
+            std::shared_ptr<ClientRequest> c_ptr = m_request_pool.make<ClientRequest>(*this, straggler, scratch);
+            fast->handle(c_ptr);
+            break;
+        }
     }
-    if (req1->size()) return future1;
-    if (req2->size()) return future2;
+}
 
-    std::promise<IOSize> p; p.set_value(0);
-    return p.get_future();
+void
+RequestManager::probeFailure(std::shared_ptr<Source> source)
+{
+    std::lock_guard<std::recursive_mutex> sentry(m_source_mutex);
+    m_disabledSourceStrings.insert(source->ID());
+    m_disabledSources.insert(source);
+    ServerHealth::reportFailure(source->ID());
+    auto it = std::find(m_inactiveSources.begin(), m_inactiveSources.end(), source);
+    if (it != m_inactiveSources.end()) m_inactiveSources.erase(it);
+    publishSources();
+}
+
+void
+RequestManager::prepareHedge(ClientRequest &c, const SourceSet &sources)
+{
+    if ((sources.m_active.size() > 1) && (c.getSize() <= m_scratch_pool.bufferSize()))
+    {
+        timespec now;
+        MonotonicClock::now(now);
+        if (timeMS(now) < m_hedgeUntilMS.load(std::memory_order_relaxed))
+        {
+            c.setScratch(m_scratch_pool.acquire(c.getSize()));
+        }
+    }
 }
 
 void
@@ -381,69 +866,144 @@ RequestManager::requestFailure(std::shared_ptr<XrdAdaptor::ClientRequest> c_ptr)
 {
     std::unique_lock<std::recursive_mutex> sentry(m_source_mutex);
     std::shared_ptr<Source> source_ptr = c_ptr->getCurrentSource();
+    if (m_closed)
+    {
+        sentry.unlock();
+        edm::Exception ex(edm::errors::FileReadError);
+        ex << "XrdRequestManager::handle(name='" << m_name
+           << "') read from " << source_ptr->ID() << " failed after the file was closed";
+        failRequests(std::vector<std::shared_ptr<ClientRequest> >(1, c_ptr), std::make_exception_ptr(ex));
+        return;
+    }
 
     // Note that we do not delete the Source itself.  That is because this
     // function may be called from within XrdCl::ResponseHandler::HandleResponseWithHosts
     // In such a case, if you close a file in the handler, it will deadlock
     m_disabledSourceStrings.insert(source_ptr->ID());
     m_disabledSources.insert(source_ptr);
+    ServerHealth::reportFailure(source_ptr->ID());
 
-    if ((m_activeSources.size() > 0) && (m_activeSources[0].get() == source_ptr.get()))
+    auto it = std::find(m_activeSources.begin(), m_activeSources.end(), source_ptr);
+    if (it != m_activeSources.end())
     {
-        m_activeSources.erase(m_activeSources.begin());
+        m_activeSources.erase(it);
     }
-    else if ((m_activeSources.size() > 1) && (m_activeSources[1].get() == source_ptr.get()))
+    // With no active source left, readers see an empty set and park their
+    // requests until handleOpen publishes the replacement.
+    publishSources();
+
+    // Anything still queued on the failed source goes along with the failed request.
+    std::vector<std::shared_ptr<ClientRequest> > requests(1, c_ptr);
+    source_ptr->drainQueue(requests);
+    if (m_activeSources.size())
     {
-        m_activeSources.erase(m_activeSources.begin()+1);
+        std::shared_ptr<Source> new_source = m_activeSources[0];
+        sentry.unlock();
+        for (const auto & request : requests) new_source->handle(request);
+        return;
     }
-    std::shared_ptr<Source> new_source;
-    if (m_activeSources.size() == 0)
+
+    // This is usually an XrdCl callback thread, so we must not wait for the
+    // new source here; the requests are parked until handleOpen resubmits
+    // them, or checkParked gives up on the open.
+    sentry.unlock();
+    parkRequests(requests);
+}
+
+void
+RequestManager::parkRequests(const std::vector<std::shared_ptr<ClientRequest> > &requests)
+{
+    std::unique_lock<std::recursive_mutex> sentry(m_source_mutex);
+    if (m_closed)
     {
-        std::shared_future<std::shared_ptr<Source> > future = m_open_handler.open();
-        timespec now;
-        clock_gettime(CLOCK_MONOTONIC, &now);
-        m_lastSourceCheck = now;
-        // Note we only wait for 60 seconds here.  This is because we've already failed
-        // once and the likelihood the program has some inconsistent state is decent.
-        // We'd much rather fail hard than deadlock!
         sentry.unlock();
-        std::future_status status = future.wait_for(std::chrono::seconds(60));
-        if (status == std::future_status::timeout)
-        {
-            edm::Exception ex(edm::errors::FileOpenError);
-            ex << "XrdCl::File::Open(name='" << m_name
-               << "', flags=0x" << std::hex << m_flags
-               << ", permissions=0" << std::oct << m_perms << std::dec
-               << ", old source=" << source_ptr->ID()
-               << ") => timeout when waiting for file open";
-            ex.addContext("In XrdAdaptor::RequestManager::requestFailure()");
-            addConnections(ex);
-        }
-        else
-        {
-            try
-            {
-                new_source = future.get();
-            }
-            catch (edm::Exception &ex)
-            {
-                ex.addContext("Handling XrdAdaptor::RequestManager::requestFailure()");
-                throw;
-            }
-        }
-        sentry.lock();
+        edm::Exception ex(edm::errors::FileReadError);
+        ex << "XrdRequestManager::handle(name='" << m_name
+           << "') no source to read from, as the file was closed";
+        failRequests(requests, std::make_exception_ptr(ex));
+        return;
     }
-    else
+    // handleOpen may have published a new source since the caller looked.
+    if (m_activeSources.size())
+    {
+        std::shared_ptr<Source> new_source = m_activeSources[0];
+        sentry.unlock();
+        for (const auto & request : requests) new_source->handle(request);
+        return;
+    }
+    timespec now;
+    MonotonicClock::now(now);
+    if (m_parked.empty())
+    {
+        m_parkedDeadline = now;
+        m_parkedDeadline.tv_sec += XRD_ADAPTOR_PARKED_TIMEOUT;
+    }
+    IOSize bytes = 0;
+    for (const auto & request : requests) bytes += request->getSize();
+    XRD_ADAPTOR_TRACE_EVENT(Parked, this, requests.size(), bytes);
+    m_parked.insert(m_parked.end(), requests.begin(), requests.end());
+    m_lastSourceCheck = now;
+    updateNextSourceCheck();
+    sentry.unlock();
+
+    // If an open is already in progress, this simply returns.
+    try
     {
-        new_source = m_activeSources[0];
+        m_open_handler->open();
+    }
+    catch (edm::Exception &ex)
+    {
+        ex.addContext("Handling XrdAdaptor::RequestManager::parkRequests()");
+        failParked(std::current_exception());
+    }
+}
+
+void
+RequestManager::checkParked()
+{
+    timespec now;
+    MonotonicClock::now(now);
+    {
+        std::lock_guard<std::recursive_mutex> sentry(m_source_mutex);
+        if (m_parked.empty() || (timeDiffMS(now, m_parkedDeadline) < 0)) return;
+    }
+    // We've already failed once and the likelihood the program has some
+    // inconsistent state is decent; we'd much rather fail hard than hang.
+    edm::Exception ex(edm::errors::FileOpenError);
+    ex << "XrdCl::File::Open(name='" << m_name
+       << "', flags=0x" << std::hex << m_flags
+       << ", permissions=0" << std::oct << m_perms << std::dec
+       << ") => timeout when waiting for file open";
+    ex.addContext("In XrdAdaptor::RequestManager::checkParked()");
+    addConnections(ex);
+    failParked(std::make_exception_ptr(ex));
+}
+
+void
+RequestManager::failParked(std::exception_ptr error)
+{
+    std::vector<std::shared_ptr<ClientRequest> > parked;
+    {
+        std::lock_guard<std::recursive_mutex> sentry(m_source_mutex);
+        parked.swap(m_parked);
+    }
+    failRequests(parked, error);
+}
+
+void
+RequestManager::failRequests(const std::vector<std::shared_ptr<ClientRequest> > &requests, std::exception_ptr error)
+{
+    for (const auto & c_ptr : requests)
+    {
+        if (!c_ptr->m_fulfilled.exchange(true)) c_ptr->setException(error);
+        c_ptr->m_self_reference = nullptr;
     }
-    new_source->handle(c_ptr);
 }
 
 static void
-consumeChunkFront(size_t &front, std::vector<IOPosBuffer> &input, std::vector<IOPosBuffer> &output, IOSize chunksize)
+consumeChunkFront(size_t &front, std::vector<IOPosBuffer> &input, std::vector<IOPosBuffer> &output, IOSize chunksize, size_t maxchunks = XRD_ADAPTOR_MAX_READV_CHUNKS)
 {
-    while ((chunksize > 0) && (front < input.size()))
+    for (size_t taken = 0; (chunksize > 0) && (front < input.size()) && (taken < maxchunks); taken++)
     {
         IOPosBuffer &io = input[front];
         if (io.size() > chunksize)
@@ -466,95 +1026,202 @@ consumeChunkFront(size_t &front, std::vector<IOPosBuffer> &input, std::vector<IO
     }
 }
 
-static void
-consumeChunkBack(size_t front, std::vector<IOPosBuffer> &input, std::vector<IOPosBuffer> &output, IOSize chunksize)
+void
+RequestManager::issueProbe(const ClientRequest &c, const SourceSet &sources)
 {
-    while ((chunksize > 0) && (front < input.size()))
+    if (c.m_into)
     {
-        IOPosBuffer &io = input.back();
-        if (io.size() > chunksize)
-        {
-            IOSize newsize = io.size() - chunksize;
-            IOOffset newoffset = io.offset() + chunksize;
-            void* newdata = static_cast<char*>(io.data()) + chunksize;
-            output.emplace_back(IOPosBuffer(io.offset(), io.data(), chunksize));
-            io.set_offset(newoffset);
-            io.set_data(newdata);
-            io.set_size(newsize);
-            chunksize = 0;
-        }
-        else
-        {
-            output.push_back(io);
-            chunksize -= io.size();
-            input.pop_back();
-        }
+        issueProbe(c.m_off, c.m_size, nullptr, sources);
+    }
+    else
+    {
+        issueProbe(0, c.m_size, c.m_iolist.get(), sources);
     }
 }
 
 void
-XrdAdaptor::RequestManager::splitClientRequest(const std::vector<IOPosBuffer> &iolist, std::vector<IOPosBuffer> &req1, std::vector<IOPosBuffer> &req2)
+RequestManager::issueProbe(const std::vector<IOPosBuffer> &iolist, const SourceSet &sources)
 {
-    if (iolist.size() == 0) return;
-    std::vector<IOPosBuffer> tmp_iolist(iolist.begin(), iolist.end());
-    req1.reserve(iolist.size()/2+1);
-    req2.reserve(iolist.size()/2+1);
-    size_t front=0;
+    IOSize size = 0;
+    for (const auto & it : iolist) size += it.size();
+    issueProbe(0, size, &iolist, sources);
+}
+
+void
+RequestManager::issueProbe(IOOffset off, IOSize request_size, const std::vector<IOPosBuffer> *iolist, const SourceSet &sources)
+{
+    m_bytes_read += request_size;
+    const std::vector<std::shared_ptr<Source> > &inactive = sources.m_inactive;
+    if (inactive.empty()) return;
 
-    float q1 = static_cast<float>(m_activeSources[0]->getQuality());
-    float q2 = static_cast<float>(m_activeSources[1]->getQuality());
-    IOSize chunk1, chunk2;
-    chunk1 = static_cast<float>(XRD_CL_MAX_CHUNK)*(q2/(q1+q2));
-    chunk2 = static_cast<float>(XRD_CL_MAX_CHUNK)*(q1/(q1+q2));
+    float chance = XRD_ADAPTOR_PROBE_PERCENT_PER_MB * static_cast<float>(request_size) / (1024*1024);
+    float r = lockFreePercent(m_probe_seed);
+    if (r >= chance) return;
 
-    while (tmp_iolist.size()-front > 0)
+    IOSize size = std::min(request_size, m_probe_pool.bufferSize());
+    if (100*(m_probe_bytes + static_cast<IOOffset>(size)) > XRD_ADAPTOR_PROBE_BUDGET_PERCENT*m_bytes_read) return;
+    ScratchPool::Buffer scratch = m_probe_pool.acquire(size);
+    if (!scratch) return;
+
+    // r is uniform in [0, chance); reuse it to pick the source.
+    std::shared_ptr<Source> source = inactive[std::min(static_cast<size_t>(inactive.size()*r/chance), inactive.size()-1)];
+
+    std::shared_ptr<ClientRequest> probe;
+    if (!iolist)
+    {
+        probe = m_request_pool.make<ClientRequest>(*this, &(*scratch)[0], size, off);
+    }
+    else
     {
-        consumeChunkFront(front, tmp_iolist, req1, chunk1);
-        consumeChunkBack(front, tmp_iolist, req2, chunk2);
+        // Only duplicate as much of the vector read as fits in the scratch buffer.
+        ThreadScratch<std::vector<IOPosBuffer> > tmp;
+        std::vector<IOPosBuffer> &tmp_iolist = tmp.get();
+        tmp_iolist.assign(iolist->begin(), iolist->end());
+        RequestPool::IOList prefix = m_request_pool.acquireIOList();
+        size_t front = 0;
+        consumeChunkFront(front, tmp_iolist, *prefix, size);
+        probe = m_request_pool.make<ClientRequest>(*this, prefix);
     }
+    probe->setProbe(scratch);
+    m_probe_bytes += size;
+    XRD_ADAPTOR_TRACE_EVENT(ProbeIssued, source.get(), size, source->getQuality());
+    source->handle(probe);
+}
 
-    IOSize size1 = 0, size2 = 0, size_orig = 0;
+void
+XrdAdaptor::RequestManager::splitClientRequest(const std::vector<IOPosBuffer> &iolist, const std::vector<std::shared_ptr<Source> > &active, std::vector<std::vector<IOPosBuffer> > &requests)
+{
+    // Empty the (possibly recycled) pieces but keep their capacity.
+    for (auto & request : requests) request.clear();
+    requests.resize(active.size());
+    if (iolist.size() == 0) return;
+    ThreadScratch<std::vector<IOPosBuffer> > tmp;
+    std::vector<IOPosBuffer> &tmp_iolist = tmp.get();
+    tmp_iolist.assign(iolist.begin(), iolist.end());
+
+    IOSize size_orig = 0;
     for (const auto & it : iolist) size_orig += it.size();
-    for (const auto & it : req1) size1 += it.size();
-    for (const auto & it : req2) size2 += it.size();
 
-    assert(size_orig == size1 + size2);
+    // A source's share is proportional to 1/quality; the quality is a latency.
+    ThreadScratch<std::vector<float> > tmp_weights;
+    std::vector<float> &weights = tmp_weights.get();
+    weights.clear();
+    float total_weight = 0;
+    for (const auto & source : active)
+    {
+        float weight = 1.0/static_cast<float>(std::max(source->getQuality(), 1u));
+        weights.push_back(weight);
+        total_weight += weight;
+    }
 
-    edm::LogVerbatim("XrdAdaptorInternal") << "Original request size " << iolist.size() << " (" << size_orig << " bytes) split into requests size " << req1.size() << " (" << size1 << " bytes) and " << req2.size() << " (" << size2 << " bytes)" << std::endl;
+    // Consecutive sources take consecutive pieces of the request, so each
+    // reads forward through its own region of the file.
+    size_t front = 0;
+    IOSize remaining = size_orig;
+    for (size_t idx = 0; idx < requests.size(); idx++)
+    {
+        IOSize share = (idx == requests.size()-1) ? remaining : std::min(remaining, static_cast<IOSize>(size_orig*(weights[idx]/total_weight)));
+        requests[idx].reserve(iolist.size()/requests.size()+1);
+        consumeChunkFront(front, tmp_iolist, requests[idx], share, std::numeric_limits<size_t>::max());
+        remaining -= share;
+    }
+    assert(front == tmp_iolist.size());
+
+#ifndef XRD_ADAPTOR_NO_TRACE
+    if (Trace::enabled())
+    {
+        Trace::record(Trace::Split, this, iolist.size(), size_orig);
+        for (const auto & request : requests) Trace::record(Trace::SplitPiece, this, request.size(), requestSize(request));
+    }
+#endif
 }
 
-XrdAdaptor::RequestManager::OpenHandler::OpenHandler(RequestManager & manager)
+XrdAdaptor::RequestManager::OpenHandler::OpenHandler(std::weak_ptr<RequestManager> manager)
   : m_manager(manager)
 {
 }
 
+XrdAdaptor::RequestManager::ReplicaHandler::ReplicaHandler(std::weak_ptr<RequestManager> manager, const std::string &server, const std::string &url)
+  : m_manager(manager),
+    m_server(server),
+    m_url(url),
+    m_file(FileHandle::create())
+{
+}
+
+XrdCl::XRootDStatus
+XrdAdaptor::RequestManager::ReplicaHandler::open()
+{
+    // Only called by openReplicas, so the manager is still with us.
+    std::shared_ptr<RequestManager> manager = m_manager.lock();
+    edm::LogVerbatim("XrdAdaptorInternal") << "Trying to open replica: " << m_url;
+    return m_file->Open(m_url, manager->m_flags, manager->m_perms, this);
+}
+
+void
+XrdAdaptor::RequestManager::ReplicaHandler::HandleResponseWithHosts(XrdCl::XRootDStatus *stat, XrdCl::AnyObject *resp, XrdCl::HostList *hosts)
+{
+    std::unique_ptr<XrdCl::XRootDStatus> status(stat);
+    std::unique_ptr<XrdCl::AnyObject> response(resp);
+    std::unique_ptr<XrdCl::HostList> hostList(hosts);
+    // The file may have been closed while the replica was opening.
+    std::shared_ptr<RequestManager> manager = m_manager.lock();
+    bool opened = status->IsOK();
+    if (opened && manager)
+    {
+        timespec now;
+        MonotonicClock::now(now);
+        std::shared_ptr<Source> source(new Source(now, std::move(m_file), manager->m_statistics));
+        manager->handleOpen(*status, source);
+    }
+    else if (!opened)
+    {
+        // Not fatal: the redirector may still offer this or another server.
+        edm::LogVerbatim("XrdAdaptorInternal") << "Failed to open replica " << m_url
+          << ": " << status->ToStr();
+        ServerHealth::reportFailure(m_server);
+    }
+    delete this;
+    if (manager) manager->replicaDone(opened);
+}
+
 void
 XrdAdaptor::RequestManager::OpenHandler::HandleResponseWithHosts(XrdCl::XRootDStatus *status, XrdCl::AnyObject *response, XrdCl::HostList *hostList)
 {
+    // Released only once the lock is: either may be the last reference.
+    std::shared_ptr<OpenHandler> self;
+    std::shared_ptr<RequestManager> manager = m_manager.lock();
     std::lock_guard<std::recursive_mutex> sentry(m_mutex);
-    if (status->IsOK())
+    self.swap(m_self);
+    if (!manager)
+    {
+        // The file was closed while the open was in process.
+        m_file.reset();
+    }
+    else if (status->IsOK())
     {
         timespec now;
-        clock_gettime(CLOCK_MONOTONIC, &now);
-        std::shared_ptr<Source> source(new Source(now, std::move(m_file)));
+        MonotonicClock::now(now);
+        std::shared_ptr<Source> source(new Source(now, std::move(m_file), manager->m_statistics));
         m_promise.set_value(source);
-        m_manager.handleOpen(*status, source);
+        manager->handleOpen(*status, source);
     }
     else
     {
         m_file.reset();
         std::shared_ptr<Source> emptySource;
         edm::Exception ex(edm::errors::FileOpenError);
-        ex << "XrdCl::File::Open(name='" << m_manager.m_name
-           << "', flags=0x" << std::hex << m_manager.m_flags
-           << ", permissions=0" << std::oct << m_manager.m_perms << std::dec
+        ex << "XrdCl::File::Open(name='" << manager->m_name
+           << "', flags=0x" << std::hex << manager->m_flags
+           << ", permissions=0" << std::oct << manager->m_perms << std::dec
            << ") => error '" << status->ToStr()
            << "' (errno=" << status->errNo << ", code=" << status->code << ")";
         ex.addContext("In XrdAdaptor::RequestManager::OpenHandler::HandleResponseWithHosts()");
-        m_manager.addConnections(ex);
+        manager->addConnections(ex);
 
-        m_promise.set_exception(std::make_exception_ptr(ex));
-        m_manager.handleOpen(*status, emptySource);
+        std::exception_ptr error = std::make_exception_ptr(ex);
+        m_promise.set_exception(error);
+        manager->handleOpen(*status, emptySource, error);
     }
     delete status;
     delete hostList;
@@ -569,27 +1236,52 @@ XrdAdaptor::RequestManager::OpenHandler::open()
     {
         return m_shared_future;
     }
+    // Only called by the manager itself, so it is still with us.
+    std::shared_ptr<RequestManager> manager = m_manager.lock();
     std::promise<std::shared_ptr<Source> > new_promise;
     m_promise.swap(new_promise);
     m_shared_future = m_promise.get_future().share();
 
-    auto opaque = m_manager.prepareOpaqueString();
-    std::string new_name = m_manager.m_name + opaque;
+    auto opaque = manager->prepareOpaqueString();
+    std::string new_name = manager->m_name + opaque;
     edm::LogVerbatim("XrdAdaptorInternal") << "Trying to open URL: " << new_name;
-    m_file.reset(new XrdCl::File());
+    m_file = FileHandle::create();
     XrdCl::XRootDStatus status;
-    if (!(status = m_file->Open(new_name, m_manager.m_flags, m_manager.m_perms, this)).IsOK())
+    if (!(status = m_file->Open(new_name, manager->m_flags, manager->m_perms, this)).IsOK())
     {
       edm::Exception ex(edm::errors::FileOpenError);
       ex << "XrdCl::File::Open(name='" << new_name
-         << "', flags=0x" << std::hex << m_manager.m_flags
-         << ", permissions=0" << std::oct << m_manager.m_perms << std::dec
+         << "', flags=0x" << std::hex << manager->m_flags
+         << ", permissions=0" << std::oct << manager->m_perms << std::dec
          << ") => error '" << status.ToStr()
          << "' (errno=" << status.errNo << ", code=" << status.code << ")";
       ex.addContext("Calling XrdAdaptor::RequestManager::OpenHandler::open()");
-      m_manager.addConnections(ex);
+      manager->addConnections(ex);
+      // No response will come; let the next call try again, and fail
+      // anyone already waiting on this attempt.
+      m_file.reset();
+      m_promise.set_exception(std::make_exception_ptr(ex));
       throw ex;
     }
+    // The response waits for m_mutex, so cannot have run yet.
+    m_self = shared_from_this();
     return m_shared_future;
 }
 
+void
+XrdAdaptor::RequestManager::queueRequests(const std::shared_ptr<Source> &source, std::vector<IOPosBuffer> &iolist, const std::shared_ptr<RequestJoin> &join, const SourceSet &sources)
+{
+    std::vector<std::shared_ptr<ClientRequest> > parked;
+    size_t front = 0;
+    while (front < iolist.size())
+    {
+        RequestPool::IOList req = m_request_pool.acquireIOList();
+        consumeChunkFront(front, iolist, *req, XRD_ADAPTOR_STEAL_UNIT);
+        std::shared_ptr<XrdAdaptor::ClientRequest> c_ptr = m_request_pool.make<XrdAdaptor::ClientRequest>(*this, req);
+        prepareHedge(*c_ptr, sources);
+        c_ptr->setJoin(join);
+        if (source) source->handle(c_ptr);
+        else parked.push_back(c_ptr);
+    }
+    if (!source) parkRequests(parked);
+}
@@ -1,6 +1,8 @@
 #ifndef Utilities_XrdAdaptor_XrdRequestManager_h
 #define Utilities_XrdAdaptor_XrdRequestManager_h
 
+#include <atomic>
+#include <memory>
 #include <mutex>
 #include <vector>
 #include <set>
@@ -14,8 +16,14 @@
 
 #include "XrdCl/XrdClFileSystem.hh"
 
+#include "XrdCoalescer.h"
+#include "XrdFileHandle.h"
 #include "XrdRequest.h"
+#include "XrdRequestPool.h"
+#include "XrdScratchPool.h"
+#include "XrdStatistics.h"
 #include "XrdSource.h"
+#include "XrdTicker.h"
 
 namespace XrdCl {
     class File;
@@ -25,21 +33,46 @@ namespace XrdAdaptor {
 
 class RequestManager : boost::noncopyable {
 
+friend class ClientRequest;
+
 public:
-    RequestManager(const std::string & filename, XrdCl::OpenFlags::Flags flags, XrdCl::Access::Mode perms);
+    /**
+     * Open the file.  The manager is always owned through a shared_ptr:
+     * requests, replica opens and the open handler refer to it weakly, as
+     * they may complete after the file is closed.
+     */
+    static std::shared_ptr<RequestManager> getInstance(const std::string & filename, XrdCl::OpenFlags::Flags flags, XrdCl::Access::Mode perms);
 
     ~RequestManager();
 
     /**
-     * Interface for handling a client request.
+     * Stop the periodic work, fail any queued and parked requests and close
+     * every source.  Requests still in flight (probes, the losing copies of
+     * hedged requests, reads whose futures were dropped) may complete later;
+     * they then find the manager closed, or gone, and do nothing more.
+     * Called from XrdFile::close(), never from a callback thread.
+     */
+    void close();
+
+    /**
+     * Interface for handling a client request.  Unless split is false, a
+     * large read is split over the active sources in the same way as a
+     * vector read; an unsplit read comes up short at the end of the file.
+     */
+    std::future<IOSize> handle(void * into, IOSize size, IOOffset off, bool split = true, CompletionHook hook = CompletionHook());
+
+    /**
+     * Memory for requests and chunk lists; callers building a vector read
+     * should take its chunk list from here.
      */
-    std::future<IOSize> handle(void * into, IOSize size, IOOffset off)
-    {
-        std::shared_ptr<XrdAdaptor::ClientRequest> c_ptr(new XrdAdaptor::ClientRequest(*this, into, size, off));
-        return handle(c_ptr);
-    }
+    const RequestPool &requestPool() const {return m_request_pool;}
 
-    std::future<IOSize> handle(std::shared_ptr<std::vector<IOPosBuffer> > iolist);
+    /**
+     * Handle a vector read.  The served bytes (such as those already copied
+     * from a cache) are added to the result.  The hook, if any, is run as
+     * the returned future becomes ready.
+     */
+    std::future<IOSize> handle(std::shared_ptr<std::vector<IOPosBuffer> > iolist, IOSize served = 0, CompletionHook hook = CompletionHook());
 
     /**
      * Handle a client request.
@@ -50,10 +83,38 @@ public:
     std::future<IOSize> handle(std::shared_ptr<XrdAdaptor::ClientRequest> c_ptr);
 
     /**
-     * Handle a failed client request.
+     * Handle a failed client request.  It is resubmitted, with the work
+     * queued on the failed source, to another active source.  If none is
+     * left, the requests are parked and a new source opened; this never
+     * blocks, as it is usually called from an XrdCl callback thread.
      */
     void requestFailure(std::shared_ptr<XrdAdaptor::ClientRequest> c_ptr);
 
+    /**
+     * Called when a source has drained its queue and has room in its window.
+     * If it is still active, it steals not-yet-started work from the back of
+     * the other active sources' queues until its window is full.
+     */
+    void stealWork(const std::shared_ptr<Source> &idle);
+
+    /**
+     * Handle the failure of an active probe; the inactive source is disabled.
+     */
+    void probeFailure(std::shared_ptr<Source> source);
+
+    /**
+     * Look for straggling requests on the active sources and, if another
+     * active source has no queued work, issue a speculative copy there.
+     * Invoked periodically by the Ticker and whenever a source goes idle.
+     */
+    void checkHedges();
+
+    /**
+     * Fail the parked requests if no new source has opened in time.
+     * Invoked periodically by the Ticker.
+     */
+    void checkParked();
+
     /**
      * Retrieve the names of the active sources
      * (primarily meant to enable meaningful log messages).
@@ -68,9 +129,16 @@ public:
 
     /**
      * Return a pointer to an active file.  Useful for metadata
-     * operations.
+     * operations.  Throws if the last active source has failed and no
+     * replacement is open yet.
+     */
+    std::shared_ptr<FileHandle> getActiveFile();
+
+    /**
+     * Retrieve the statistics of the whole file, and those of each of the
+     * current active and inactive sources.
      */
-    std::shared_ptr<XrdCl::File> getActiveFile();
+    void getStatistics(Statistics::Snapshot &total, std::vector<std::pair<std::string, Statistics::Snapshot> > &sources);
 
     /**
      * Add the list of active connections to the exception extra info.
@@ -83,15 +151,108 @@ public:
     const std::string & getFilename() const {return m_name;}
 
 private:
+    RequestManager(const std::string & filename, XrdCl::OpenFlags::Flags flags, XrdCl::Access::Mode perms);
+
+    /**
+     * Open the first source(s) and start the periodic work; the second half
+     * of getInstance, once self refers to us.
+     */
+    void initialize(std::weak_ptr<RequestManager> self);
+
+    /**
+     * Fail the given requests with error, unless already fulfilled.
+     */
+    static void failRequests(const std::vector<std::shared_ptr<ClientRequest> > &requests, std::exception_ptr error);
+
+    /**
+     * An immutable snapshot of the active and inactive sources.
+     *
+     * Writers modify m_activeSources / m_inactiveSources while holding
+     * m_source_mutex and then publish a new snapshot.  Each thread caches
+     * the snapshots it has seen, keyed by the generation they were
+     * published with, so the read path takes no lock unless the sources
+     * have changed since the thread last looked.
+     */
+    struct SourceSet {
+        std::vector<std::shared_ptr<Source> > m_active;
+        std::vector<std::shared_ptr<Source> > m_inactive;
+    };
+
+    std::shared_ptr<const SourceSet> getSources() const;
+
     /**
-     * Handle the file-open response
+     * If enabled, locate the file's replicas and open the best of them in
+     * parallel.  Returns once one has opened, or false if none could be (in
+     * which case the file should be opened through the redirector).
      */
-    virtual void handleOpen(XrdCl::XRootDStatus &status, std::shared_ptr<Source>);
+    bool openReplicas();
 
     /**
-     * Given a client request, split it into two requests lists.
+     * Called as each replica open started by openReplicas completes.
      */
-    void splitClientRequest(const std::vector<IOPosBuffer> &iolist, std::vector<IOPosBuffer> &req1, std::vector<IOPosBuffer> &req2);
+    void replicaDone(bool opened);
+
+    /**
+     * Publish the current source sets; must be called with m_source_mutex held.
+     */
+    void publishSources();
+
+    /**
+     * Recompute the earliest time for the next source check (m_nextSourceCheckMS)
+     * from m_lastSourceCheck and m_nextActiveSourceCheck; must hold m_source_mutex.
+     */
+    void updateNextSourceCheck();
+
+    /**
+     * Handle the file-open response; any parked requests are resubmitted to
+     * the new source or, if the open failed, failed with the given error.
+     */
+    virtual void handleOpen(XrdCl::XRootDStatus &status, std::shared_ptr<Source>, std::exception_ptr error = std::exception_ptr());
+
+    /**
+     * Fail all the parked requests with the given error.
+     */
+    void failParked(std::exception_ptr error);
+
+    /**
+     * Hold requests until a new source opens, starting the open if none is
+     * in progress.  Requests go straight to a source if one has opened in
+     * the meantime, and fail if the file has been closed.  Never blocks, and
+     * must be called without m_source_mutex held.
+     */
+    void parkRequests(const std::vector<std::shared_ptr<ClientRequest> > &requests);
+
+    /**
+     * Given a client request, split it into one request list per active source.
+     * Each source receives a contiguous share of the bytes proportional to the
+     * inverse of its quality metric.
+     */
+    void splitClientRequest(const std::vector<IOPosBuffer> &iolist, const std::vector<std::shared_ptr<Source> > &active, std::vector<std::vector<IOPosBuffer> > &requests);
+
+    /**
+     * Break a source's share of a vector read into several queued requests,
+     * each within the server's per-request chunk and byte limits.  The
+     * source pipelines them, and an idle source may steal the ones not yet
+     * started.  With no source, they are parked.
+     */
+    void queueRequests(const std::shared_ptr<Source> &source, std::vector<IOPosBuffer> &iolist, const std::shared_ptr<RequestJoin> &join, const SourceSet &sources);
+
+    /**
+     * If more than one source is active and stragglers have recently been
+     * seen, give the request scratch space so it may later be hedged.
+     * Otherwise the request reads directly into the client's buffers, as it
+     * does when the pool is exhausted.
+     */
+    void prepareHedge(ClientRequest &c, const SourceSet &sources);
+
+    /**
+     * Active probe algorithm: with a small probability proportional to the
+     * request size, duplicate (a prefix of) the request onto a random inactive
+     * source so its quality metric reflects the server's current health.
+     */
+    void issueProbe(const ClientRequest &c, const SourceSet &sources);
+    void issueProbe(const std::vector<IOPosBuffer> &iolist, const SourceSet &sources);
+    void issueProbe(IOOffset off, IOSize size, const std::vector<IOPosBuffer> *iolist, const SourceSet &sources);
 
     /**
      * Given a request, broadcast it to all sources.
@@ -111,20 +272,38 @@ private:
 
     /**
      * Prepare an opaque string appropriate for asking a redirector to open the
-     * current file but avoiding servers which we already have connections to.
+     * current file but avoiding servers which we already have connections to,
+     * or which are bad according to the process-wide ServerHealth.
      */
     std::string prepareOpaqueString();
 
+    // Only accessed with m_source_mutex held; see SourceSet.
     std::vector<std::shared_ptr<Source> > m_activeSources;
     std::vector<std::shared_ptr<Source> > m_inactiveSources;
+    // The current snapshot and its process-wide unique generation; both
+    // change only with m_snapshot_mutex held.
+    std::shared_ptr<const SourceSet> m_sources;
+    std::atomic<unsigned long long> m_sources_generation;
+    mutable std::mutex m_snapshot_mutex;
     std::set<std::string> m_disabledSourceStrings;
     std::set<std::shared_ptr<Source> > m_disabledSources;
+    // Requests waiting for a new source after the last active one failed,
+    // and when to give up on them; protected by m_source_mutex.
+    std::vector<std::shared_ptr<ClientRequest> > m_parked;
+    timespec m_parkedDeadline;
+    // Set by close(); protected by m_source_mutex.
+    bool m_closed;
+    std::weak_ptr<RequestManager> m_self;
 
     timespec m_lastSourceCheck;
-    // If set to true, the next active source should be 1; 0 otherwise.
-    bool m_nextInitialSourceToggle;
+    // Round-robin counter for the active source used by contiguous reads.
+    std::atomic<unsigned> m_nextInitialSource;
     // The time when the next active source check should be performed.
     timespec m_nextActiveSourceCheck;
+    // Monotonic time, in ms, before which checkSources need not take the lock.
+    std::atomic<long long> m_nextSourceCheckMS;
+    // Monotonic time, in ms, until which new requests are prepared for hedging.
+    std::atomic<long long> m_hedgeUntilMS;
     bool searchMode;
 
     const std::string m_name;
@@ -135,10 +314,26 @@ private:
     std::mt19937 m_generator;
     std::uniform_real_distribution<float> m_distribution;
 
-    class OpenHandler : boost::noncopyable, public XrdCl::ResponseHandler {
+    RequestPool m_request_pool;
+    // Scratch space for requests which may be hedged.
+    ScratchPool m_scratch_pool;
+    // Holds a single buffer, so only one probe is outstanding at a time.
+    ScratchPool m_probe_pool;
+    // Bytes requested by the client and bytes spent on probes; used to
+    // enforce the probe traffic budget.
+    std::atomic<IOOffset> m_bytes_read;
+    std::atomic<IOOffset> m_probe_bytes;
+    // State for the lock-free random numbers used to pick probes.
+    std::atomic<unsigned long long> m_probe_seed;
+    // The parent of every source's statistics.
+    std::shared_ptr<Statistics> m_statistics;
+    Ticker::Handle m_ticker_handle;
+    ReadCoalescer m_coalescer;
+
+    class OpenHandler : boost::noncopyable, public XrdCl::ResponseHandler, public std::enable_shared_from_this<OpenHandler> {
 
     public:
-        OpenHandler(RequestManager & manager);
+        OpenHandler(std::weak_ptr<RequestManager> manager);
 
         /**
          * Handle the file-open response
@@ -153,16 +348,44 @@ private:
         std::shared_future<std::shared_ptr<Source> > open();
 
     private:
-        RequestManager & m_manager;
+        std::weak_ptr<RequestManager> m_manager;
         std::shared_future<std::shared_ptr<Source> > m_shared_future;
         std::promise<std::shared_ptr<Source> > m_promise;
         // When this is not null, there is a file-open in process
         // Can only be touched when m_mutex is held.
-        std::unique_ptr<XrdCl::File> m_file;
+        std::unique_ptr<FileHandle> m_file;
+        // Keeps us alive while an open is in process, as the manager may
+        // go away first; protected by m_mutex.
+        std::shared_ptr<OpenHandler> m_self;
         std::recursive_mutex m_mutex;
     };
 
-    OpenHandler m_open_handler;
+    std::shared_ptr<OpenHandler> m_open_handler;
+
+    /**
+     * Opens one replica found by openReplicas; deletes itself once done.
+     */
+    class ReplicaHandler : boost::noncopyable, public XrdCl::ResponseHandler {
+
+    public:
+        ReplicaHandler(std::weak_ptr<RequestManager> manager, const std::string &server, const std::string &url);
+
+        XrdCl::XRootDStatus open();
+
+        virtual void HandleResponseWithHosts(XrdCl::XRootDStatus *status, XrdCl::AnyObject *response, XrdCl::HostList *hostList) override;
+
+    private:
+        std::weak_ptr<RequestManager> m_manager;
+        const std::string m_server;
+        const std::string m_url;
+        std::unique_ptr<FileHandle> m_file;
+    };
+
+    // Replica opens started by openReplicas which have not yet completed.
+    unsigned m_replicas_pending;
+    bool m_replica_opened;
+    std::mutex m_replica_mutex;
+    std::condition_variable m_replica_cv;
 };
 
 }
@@ -0,0 +1,75 @@
+
+#include "XrdRequestPool.h"
+
+using namespace XrdAdaptor;
+
+RequestPool::RequestPool()
+    : m_state(new State())
+{
+}
+
+RequestPool::State::~State()
+{
+    for (auto & freelist : m_free)
+    {
+        for (void *ptr : freelist) ::operator delete(ptr);
+    }
+}
+
+void *
+RequestPool::allocate(State *state, size_t size)
+{
+    if (!size || (size > max_block)) return ::operator new(size);
+    size_t idx = (size-1)/block_align;
+    {
+        std::lock_guard<std::mutex> sentry(state->m_mutex);
+        std::vector<void*> &freelist = state->m_free[idx];
+        if (!freelist.empty())
+        {
+            void *ptr = freelist.back();
+            freelist.pop_back();
+            return ptr;
+        }
+    }
+    return ::operator new((idx+1)*block_align);
+}
+
+void
+RequestPool::deallocate(State *state, void *ptr, size_t size)
+{
+    if (size && (size <= max_block))
+    {
+        std::lock_guard<std::mutex> sentry(state->m_mutex);
+        std::vector<void*> &freelist = state->m_free[(size-1)/block_align];
+        if (freelist.size() < max_free)
+        {
+            if (freelist.capacity() < max_free) freelist.reserve(max_free);
+            freelist.push_back(ptr);
+            return;
+        }
+    }
+    ::operator delete(ptr);
+}
+
+RequestPool::IOList
+RequestPool::acquireIOList() const
+{
+    std::shared_ptr<State> state = m_state;
+    std::unique_ptr<std::vector<IOPosBuffer> > iolist;
+    {
+        std::lock_guard<std::mutex> sentry(state->m_mutex);
+        if (!state->m_iolists.empty())
+        {
+            iolist = std::move(state->m_iolists.back());
+            state->m_iolists.pop_back();
+        }
+    }
+    if (!iolist) iolist.reset(new std::vector<IOPosBuffer>);
+    // The deleter holds the state alive; the control block itself is pooled.
+    return IOList(iolist.release(), [state](std::vector<IOPosBuffer> *released) {
+        std::unique_ptr<std::vector<IOPosBuffer> > owned(released);
+        owned->clear();
+        std::lock_guard<std::mutex> sentry(state->m_mutex);
+        if (state->m_iolists.size() < max_free) state->m_iolists.push_back(std::move(owned));
+    }, allocator<char>());
+}
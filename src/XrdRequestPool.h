@@ -0,0 +1,121 @@
+#ifndef Utilities_XrdAdaptor_XrdRequestPool_h
+#define Utilities_XrdAdaptor_XrdRequestPool_h
+
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <boost/utility.hpp>
+
+#include "Utilities/StorageFactory/interface/Storage.h"
+
+namespace XrdAdaptor {
+
+/**
+ * Recycles the memory used on the read path of a single file.
+ *
+ * Each client read creates a request, the promise state behind its future
+ * and often a chunk list; with thousands of small vector reads per event,
+ * these allocations add up.  The pool keeps freed blocks on per-size free
+ * lists and hands out chunk lists which retain their capacity, so a read
+ * in steady state does not touch the heap.
+ */
+class RequestPool : boost::noncopyable {
+
+private:
+    struct State;
+
+public:
+    typedef std::shared_ptr<std::vector<IOPosBuffer> > IOList;
+
+    /**
+     * A standard allocator drawing from the pool; suitable for
+     * std::allocate_shared and std::promise.
+     */
+    template<typename T>
+    class Allocator {
+    public:
+        typedef T value_type;
+
+        explicit Allocator(const std::shared_ptr<State> &state) : m_state(state) {}
+        template<typename U>
+        Allocator(const Allocator<U> &other) : m_state(other.m_state) {}
+
+        T *allocate(size_t n) {return static_cast<T*>(RequestPool::allocate(m_state.get(), n*sizeof(T)));}
+        void deallocate(T *ptr, size_t n) {RequestPool::deallocate(m_state.get(), ptr, n*sizeof(T));}
+
+        template<typename U>
+        bool operator==(const Allocator<U> &other) const {return m_state == other.m_state;}
+        template<typename U>
+        bool operator!=(const Allocator<U> &other) const {return m_state != other.m_state;}
+
+    private:
+        template<typename U> friend class Allocator;
+        std::shared_ptr<State> m_state;
+    };
+
+    RequestPool();
+
+    template<typename T>
+    Allocator<T> allocator() const {return Allocator<T>(m_state);}
+
+    /**
+     * Construct an object in pooled memory; the object and the shared_ptr
+     * control block share a single block.
+     */
+    template<typename T, typename... Args>
+    std::shared_ptr<T> make(Args&&... args) const
+    {
+        return std::allocate_shared<T>(allocator<T>(), std::forward<Args>(args)...);
+    }
+
+    /**
+     * Returns an empty chunk list; it returns to the pool, emptied but with
+     * its capacity intact, once the last reference is dropped.
+     */
+    IOList acquireIOList() const;
+
+private:
+    // Blocks are rounded up to a multiple of block_align; larger blocks are
+    // not pooled.
+    static const size_t block_align = 64;
+    static const size_t max_block = 1024;
+    // Bound the memory pinned by a burst of activity.
+    static const size_t max_free = 256;
+
+    struct State {
+        std::vector<void*> m_free[max_block/block_align];
+        std::vector<std::unique_ptr<std::vector<IOPosBuffer> > > m_iolists;
+        std::mutex m_mutex;
+
+        ~State();
+    };
+
+    static void *allocate(State *state, size_t size);
+    static void deallocate(State *state, void *ptr, size_t size);
+
+    // Memory may outlive the pool (a request still outstanding when the
+    // file is closed), so it keeps a reference to the shared state.
+    std::shared_ptr<State> m_state;
+};
+
+/**
+ * Borrows a per-thread object for the lifetime of the scope, so temporary
+ * containers built for every read keep their capacity between calls.  A
+ * nested borrow on the same thread gets a fresh object.
+ */
+template<typename T>
+class ThreadScratch : boost::noncopyable {
+public:
+    ThreadScratch() {m_value.swap(cache());}
+    ~ThreadScratch() {m_value.swap(cache());}
+    T &get() {return m_value;}
+private:
+    static T &cache() {static thread_local T value; return value;}
+    T m_value;
+};
+
+}
+
+#endif
@@ -0,0 +1,141 @@
+
+#include <stdlib.h>
+
+#include "XrdRequestPool.h"
+#include "XrdScheduler.h"
+#include "XrdSource.h"
+#include "XrdTrace.h"
+
+// Bytes in flight over all the files open in the process.
+#define XRD_ADAPTOR_INFLIGHT_BUDGET 256*1024*1024
+
+// Requests in flight at a single server over all the files open in the process.
+#define XRD_ADAPTOR_SERVER_REQUESTS 32
+
+using namespace XrdAdaptor;
+
+// Intentionally leaked, like Ticker::m_instance.
+Scheduler *Scheduler::m_instance = nullptr;
+std::once_flag Scheduler::m_once;
+
+static unsigned long
+envLimit(const char *name, unsigned long value)
+{
+    const char *limit = getenv(name);
+    return limit ? strtoul(limit, nullptr, 10) : value;
+}
+
+Scheduler &
+Scheduler::instance()
+{
+    std::call_once(m_once, [](){ m_instance = new Scheduler(); });
+    return *m_instance;
+}
+
+Scheduler::Scheduler()
+    : m_budget(envLimit("XRD_ADAPTOR_INFLIGHT_BUDGET", XRD_ADAPTOR_INFLIGHT_BUDGET)),
+      m_server_requests(envLimit("XRD_ADAPTOR_SERVER_REQUESTS", XRD_ADAPTOR_SERVER_REQUESTS)),
+      m_inflight(0)
+{
+}
+
+template<typename T>
+void
+Scheduler::wait(Source &source, bool woken, std::deque<T> &waiters, const T &waiter)
+{
+    XRD_ADAPTOR_TRACE_EVENT(SchedulerWait, &source, m_inflight, m_waiters.size());
+    if (woken) waiters.push_front(waiter);
+    else waiters.push_back(waiter);
+    source.m_sched_waiting = true;
+}
+
+bool
+Scheduler::wake(const std::weak_ptr<Source> &waiter, std::vector<std::shared_ptr<Source> > &woken)
+{
+    std::shared_ptr<Source> source = waiter.lock();
+    if (!source) return false;
+    source->m_sched_waiting = false;
+    source->m_sched_woken = true;
+    woken.push_back(source);
+    return true;
+}
+
+void
+Scheduler::wakeWaiters(std::vector<std::shared_ptr<Source> > &woken)
+{
+    // Woken sources take their room when they dispatch; count it as taken
+    // so that no more are woken than may proceed.
+    IOSize claimed = m_inflight;
+    while (!m_waiters.empty())
+    {
+        const Waiter &waiter = m_waiters.front();
+        if (claimed && (claimed + waiter.m_bytes > m_budget)) break;
+        if (wake(waiter.m_source, woken)) claimed += waiter.m_bytes;
+        m_waiters.pop_front();
+    }
+}
+
+bool
+Scheduler::acquire(const std::shared_ptr<Source> &source, const std::string &server, IOSize bytes)
+{
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    // A queued source is dispatched again in its turn.
+    if (source->m_sched_waiting) return false;
+    // A woken source is having its turn; others must not jump the queue.
+    bool woken = source->m_sched_woken;
+    source->m_sched_woken = false;
+    Server &state = m_servers[server];
+    bool fits = !m_inflight || (m_inflight + bytes <= m_budget);
+    if (!fits || (!woken && !m_waiters.empty()))
+    {
+        wait(*source, woken, m_waiters, Waiter{source, bytes});
+        return false;
+    }
+    if (m_server_requests && (state.m_requests >= m_server_requests))
+    {
+        wait(*source, woken, state.m_waiters, std::weak_ptr<Source>(source));
+        return false;
+    }
+    m_inflight += bytes;
+    state.m_requests++;
+    return true;
+}
+
+void
+Scheduler::release(const std::string &server, IOSize bytes)
+{
+    ThreadScratch<std::vector<std::shared_ptr<Source> > > tmp;
+    std::vector<std::shared_ptr<Source> > &woken = tmp.get();
+    {
+        std::lock_guard<std::mutex> sentry(m_mutex);
+        m_inflight -= bytes;
+        Server &state = m_servers[server];
+        if (state.m_requests) state.m_requests--;
+        // The freed request slot goes to the first source waiting for it.
+        while (!state.m_waiters.empty())
+        {
+            bool alive = wake(state.m_waiters.front(), woken);
+            state.m_waiters.pop_front();
+            if (alive) break;
+        }
+        wakeWaiters(woken);
+    }
+    for (auto & source : woken) source->dispatch();
+    woken.clear();
+}
+
+void
+Scheduler::yield(Source &source)
+{
+    if (!source.m_sched_woken) return;
+    ThreadScratch<std::vector<std::shared_ptr<Source> > > tmp;
+    std::vector<std::shared_ptr<Source> > &woken = tmp.get();
+    {
+        std::lock_guard<std::mutex> sentry(m_mutex);
+        if (!source.m_sched_woken) return;
+        source.m_sched_woken = false;
+        wakeWaiters(woken);
+    }
+    for (auto & waiter : woken) waiter->dispatch();
+    woken.clear();
+}
@@ -0,0 +1,114 @@
+#ifndef Utilities_XrdAdaptor_XrdScheduler_h
+#define Utilities_XrdAdaptor_XrdScheduler_h
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/utility.hpp>
+
+#include "Utilities/StorageFactory/interface/Storage.h"
+
+namespace XrdAdaptor {
+
+class Source;
+
+/**
+ * The process-wide gate every Source passes through before sending a request
+ * to its server, so that the many files open at once (as in pileup mixing)
+ * share the network rather than each oversubscribing it.
+ *
+ * It bounds the bytes in flight over all files, and the requests in flight
+ * at each server over all files.  Sources refused for lack of budget wait in
+ * a FIFO; as requests complete, the sources at its head are woken, as many
+ * as the freed bytes allow, and a woken source keeps its place if it is
+ * still refused.  Each source, and hence each file, thus gets a fair share.
+ * A source refused only because its server is at its cap waits on that
+ * server alone, and does not hold up sources using other servers.
+ *
+ * The limits default to XRD_ADAPTOR_INFLIGHT_BUDGET bytes and
+ * XRD_ADAPTOR_SERVER_REQUESTS requests, and may be overridden by environment
+ * variables of the same names.
+ */
+class Scheduler : boost::noncopyable {
+
+public:
+    static Scheduler & instance();
+
+    /**
+     * Reserve room for a request of the given size to the server.  If there
+     * is none, the source is queued to be dispatched again once there is,
+     * and false is returned.  A request larger than the budget is admitted
+     * when nothing else is in flight.  Must be called without holding the
+     * source's mutex.
+     */
+    bool acquire(const std::shared_ptr<Source> &source, const std::string &server, IOSize bytes);
+
+    /**
+     * Return the room taken by a completed request, and dispatch the waiting
+     * sources which may now proceed.  Must be called without holding any
+     * source's mutex.
+     */
+    void release(const std::string &server, IOSize bytes);
+
+    /**
+     * Called by a source which dispatched without asking for room; if it
+     * had been woken, its turn passes to the sources waiting behind it.
+     * Must be called without holding the source's mutex.
+     */
+    void yield(Source &source);
+
+private:
+    Scheduler();
+
+    struct Waiter {
+        std::weak_ptr<Source> m_source;
+        // Size of the request the source was refused for.
+        IOSize m_bytes;
+    };
+
+    struct Server {
+        unsigned m_requests;
+        // Sources refused because the server was at its cap.
+        std::deque<std::weak_ptr<Source> > m_waiters;
+    };
+
+    /**
+     * Queue the source on waiters, at the front if it was woken and so
+     * already had its turn; must hold m_mutex.
+     */
+    template<typename T>
+    void wait(Source &source, bool woken, std::deque<T> &waiters, const T &waiter);
+
+    /**
+     * Mark the source woken and add it to woken, if it still exists; must
+     * hold m_mutex.
+     */
+    bool wake(const std::weak_ptr<Source> &source, std::vector<std::shared_ptr<Source> > &woken);
+
+    /**
+     * Wake the sources at the head of m_waiters, as many as the free budget
+     * allows; must hold m_mutex.
+     */
+    void wakeWaiters(std::vector<std::shared_ptr<Source> > &woken);
+
+    const IOSize m_budget;
+    const unsigned m_server_requests;
+
+    // Protected by m_mutex, as are the scheduling flags of each Source.
+    IOSize m_inflight;
+    // Entries are kept once created; there are only ever a handful.
+    std::unordered_map<std::string, Server> m_servers;
+    std::deque<Waiter> m_waiters;
+    std::mutex m_mutex;
+
+    static Scheduler *m_instance;
+    static std::once_flag m_once;
+};
+
+}
+
+#endif
@@ -0,0 +1,40 @@
+
+#include <assert.h>
+
+#include "XrdScratchPool.h"
+
+using namespace XrdAdaptor;
+
+ScratchPool::ScratchPool(unsigned count, IOSize size)
+    : m_state(new State()),
+      m_size(size)
+{
+    m_state->m_available = count;
+}
+
+ScratchPool::Buffer
+ScratchPool::acquire(IOSize size)
+{
+    assert(size <= m_size);
+    std::shared_ptr<State> state = m_state;
+    std::unique_ptr<std::vector<char> > buffer;
+    {
+        std::lock_guard<std::mutex> sentry(state->m_mutex);
+        if (!state->m_available) return Buffer();
+        state->m_available--;
+        if (!state->m_free.empty())
+        {
+            buffer = std::move(state->m_free.back());
+            state->m_free.pop_back();
+        }
+    }
+    // Buffers are allocated lazily, and only as large as they need to be.
+    if (!buffer) buffer.reset(new std::vector<char>(size));
+    else if (buffer->size() < size) buffer->resize(size);
+    // The deleter holds the state alive; the control block itself is pooled.
+    return Buffer(buffer.release(), [state](std::vector<char> *released) {
+        std::lock_guard<std::mutex> sentry(state->m_mutex);
+        state->m_free.emplace_back(released);
+        state->m_available++;
+    }, m_handles.allocator<char>());
+}
@@ -0,0 +1,58 @@
+#ifndef Utilities_XrdAdaptor_XrdScratchPool_h
+#define Utilities_XrdAdaptor_XrdScratchPool_h
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <boost/utility.hpp>
+
+#include "Utilities/StorageFactory/interface/Storage.h"
+
+#include "XrdRequestPool.h"
+
+namespace XrdAdaptor {
+
+/**
+ * A bounded pool of scratch buffers of up to a fixed size.
+ *
+ * Requests which read into scratch space (rather than directly into the
+ * client's buffers) may safely be duplicated onto another source, as a losing
+ * copy which is still outstanding never writes into memory owned by the client.
+ */
+class ScratchPool : boost::noncopyable {
+
+public:
+    typedef std::shared_ptr<std::vector<char> > Buffer;
+
+    ScratchPool(unsigned count, IOSize size);
+
+    /**
+     * Returns a buffer of at least size bytes, which must not exceed
+     * bufferSize(), or an empty pointer if all the buffers are in use.  The
+     * buffer returns to the pool when released; buffers grow to the largest
+     * size asked of them, so once warmed up acquiring one does not touch
+     * the heap.
+     */
+    Buffer acquire(IOSize size);
+
+    IOSize bufferSize() const {return m_size;}
+
+private:
+    struct State {
+        std::vector<std::unique_ptr<std::vector<char> > > m_free;
+        unsigned m_available;
+        std::mutex m_mutex;
+    };
+
+    // Buffers may outlive the pool (the IO using them is still outstanding),
+    // so they keep a reference to the shared state rather than to the pool.
+    std::shared_ptr<State> m_state;
+    // Recycles the shared_ptr control blocks of the buffers handed out.
+    RequestPool m_handles;
+    const IOSize m_size;
+};
+
+}
+
+#endif
@@ -2,20 +2,45 @@
 // See http://stackoverflow.com/questions/12523122/what-is-glibcxx-use-nanosleep-all-about
 #define _GLIBCXX_USE_NANOSLEEP
 #include <thread>
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #include <assert.h>
 
-#include "XrdCl/XrdClFile.hh"
 
 #include "FWCore/MessageLogger/interface/MessageLogger.h"
 
+#include "XrdClock.h"
+#include "XrdFileHandle.h"
 #include "XrdSource.h"
 #include "XrdRequest.h"
+#include "XrdRequestPool.h"
+#include "XrdScheduler.h"
 #include "QualityMetric.h"
+#include "XrdTrace.h"
 
 #define MAX_REQUEST 256*1024
 
+// Bounds on the bytes outstanding at the server per source; a source starts
+// with room for four vector-read pieces.  A single request larger than the
+// window is still sent once nothing else is in flight.
+#define XRD_ADAPTOR_MIN_WINDOW 1024*1024
+#define XRD_ADAPTOR_INITIAL_WINDOW 8*1024*1024
+#define XRD_ADAPTOR_MAX_WINDOW 64*1024*1024
+
+// The window is this many times the bandwidth-delay product.
+#define XRD_ADAPTOR_WINDOW_GAIN 2
+
+// Delivery rate samples below the current estimate pull it down with this
+// weight, unless the source simply had too little work; the minimum latency
+// is forgotten after this many seconds.
+#define XRD_ADAPTOR_RATE_DECAY 0.125
+#define XRD_ADAPTOR_LATENCY_EXPIRY 10
+
+// A request is a straggler once it has run for this many times the
+// source's quality metric.
+#define XRD_ADAPTOR_HEDGE_FACTOR 4
+
 #ifdef XRD_FAKE_SLOW
 //#define XRD_DELAY 5140
 #define XRD_DELAY 1000
@@ -27,11 +52,22 @@ int g_delayCount = 0;
 
 using namespace XrdAdaptor;
 
-Source::Source(timespec now, std::unique_ptr<XrdCl::File> fh)
+Source::Source(timespec now, std::unique_ptr<FileHandle> fh, std::shared_ptr<Statistics> parent)
     : m_lastDowngrade({0, 0}),
       m_id(fh.get() ? fh->GetDataServer() : "(unknown)"),
       m_fh(std::move(fh)),
-      m_qm(QualityMetricFactory::get(now, m_id))
+      m_qm(QualityMetricFactory::get(now, m_id)),
+      m_statistics(parent),
+      m_inflight(0),
+      m_window(XRD_ADAPTOR_INITIAL_WINDOW),
+      m_delivered(0),
+      m_delivered_time({0, 0}),
+      m_rate(0),
+      m_min_latency(0),
+      m_min_latency_time({0, 0}),
+      m_closed(false),
+      m_sched_waiting(false),
+      m_sched_woken(false)
 #ifdef XRD_FAKE_SLOW
     , m_slow(++g_delayCount % XRD_SLOW_RATE == 0)
     //, m_slow(++g_delayCount >= XRD_SLOW_RATE)
@@ -41,19 +77,31 @@ Source::Source(timespec now, std::unique_ptr<XrdCl::File> fh)
     assert(m_qm.get());
     assert(m_fh.get());
     m_buffer.reserve(MAX_REQUEST);
+    XRD_ADAPTOR_TRACE_NAME(this, m_id);
 }
 
 Source::~Source()
 {
+  close();
+  m_fh.reset();
+}
+
+void
+Source::close()
+{
+  {
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    if (m_closed) return;
+    m_closed = true;
+  }
   XrdCl::XRootDStatus status;
   if (! (status = m_fh->Close()).IsOK())
     edm::LogWarning("XrdFileWarning")
-      << "Source::~Source() failed with error '" << status.ToString()
+      << "Source::close() failed with error '" << status.ToString()
       << "' (errno=" << status.errNo << ", code=" << status.code << ")";
-  m_fh.reset();
 }
 
-std::shared_ptr<XrdCl::File>
+std::shared_ptr<FileHandle>
 Source::getFileHandle()
 {
     return m_fh;
@@ -62,28 +110,218 @@ Source::getFileHandle()
 void
 Source::handle(std::shared_ptr<ClientRequest> c)
 {
-    edm::LogVerbatim("XrdAdaptorInternal") << "Reading from " << ID() << ", quality " << m_qm->get() << std::endl;
+    {
+        std::lock_guard<std::mutex> sentry(m_mutex);
+        m_queue.push_back(c);
+    }
+    dispatch();
+}
+
+void
+Source::dispatch()
+{
+    // Requests issued from a response callback may re-enter dispatch().
+    ThreadScratch<std::vector<std::shared_ptr<ClientRequest> > > tmp;
+    std::vector<std::shared_ptr<ClientRequest> > &ready = tmp.get();
+    std::shared_ptr<Source> self = shared_from_this();
+    Scheduler &scheduler = Scheduler::instance();
+    bool asked = false;
+    for (;;)
+    {
+        std::shared_ptr<ClientRequest> c;
+        {
+            std::lock_guard<std::mutex> sentry(m_mutex);
+            if (m_queue.empty() || (m_inflight && (m_inflight + m_queue.front()->getSize() > m_window))) break;
+            c = m_queue.front();
+        }
+        // The scheduler's mutex is global; do not hold ours while taking it.
+        asked = true;
+        if (!scheduler.acquire(self, m_id, c->getSize())) break;
+        {
+            std::lock_guard<std::mutex> sentry(m_mutex);
+            if (!m_queue.empty() && (m_queue.front() == c))
+            {
+                m_queue.pop_front();
+                m_inflight += c->getSize();
+                ready.push_back(c);
+                continue;
+            }
+        }
+        // Stolen, or sent by another thread, while we were admitted.
+        scheduler.release(m_id, c->getSize());
+    }
+    if (!asked) scheduler.yield(*this);
+    // Issue outside the lock; a failed submission calls back into requestDone().
+    for (auto & c : ready) issue(c);
+    ready.clear();
+}
+
+std::shared_ptr<ClientRequest>
+Source::stealRequest()
+{
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    std::shared_ptr<ClientRequest> c;
+    if (!m_queue.empty())
+    {
+        c = m_queue.back();
+        m_queue.pop_back();
+    }
+    return c;
+}
+
+void
+Source::drainQueue(std::vector<std::shared_ptr<ClientRequest> > &requests)
+{
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    requests.insert(requests.end(), m_queue.begin(), m_queue.end());
+    m_queue.clear();
+}
+
+bool
+Source::requestDone(ClientRequest *c, bool success)
+{
+    timespec now;
+    MonotonicClock::now(now);
+    {
+        std::lock_guard<std::mutex> sentry(m_mutex);
+        assert(m_inflight >= c->getSize());
+        m_inflight -= c->getSize();
+        for (auto it = m_outstanding.begin(); it != m_outstanding.end(); ++it)
+        {
+            if (it->get() == c) {m_outstanding.erase(it); break;}
+        }
+        updateWindow(*c, success, now);
+    }
+    // Requests of other sources waiting on the scheduler may go first.
+    Scheduler::instance().release(m_id, c->getSize());
+    dispatch();
+    return hasRoom();
+}
+
+void
+Source::updateWindow(const ClientRequest &c, bool success, const timespec &now)
+{
+    IOSize old_window = m_window;
+    if (!success)
+    {
+        m_window = std::max(m_window/2, static_cast<IOSize>(XRD_ADAPTOR_MIN_WINDOW));
+    }
+    else
+    {
+        // The rate at which the server delivered data while this request
+        // was outstanding, including the other requests in flight.
+        m_delivered += c.getSize();
+        double interval = (now.tv_sec - c.m_delivered_time.tv_sec) + (now.tv_nsec - c.m_delivered_time.tv_nsec)/1e9;
+        m_delivered_time = now;
+        if (interval > 0)
+        {
+            double sample = (m_delivered - c.m_delivered)/interval;
+            if (sample > m_rate) m_rate = sample;
+            else if (!c.m_app_limited) m_rate += XRD_ADAPTOR_RATE_DECAY*(sample - m_rate);
+        }
+        double latency = (now.tv_sec - c.m_issued.tv_sec) + (now.tv_nsec - c.m_issued.tv_nsec)/1e9;
+        if (!m_min_latency || (latency <= m_min_latency) || (now.tv_sec - m_min_latency_time.tv_sec > XRD_ADAPTOR_LATENCY_EXPIRY))
+        {
+            m_min_latency = latency;
+            m_min_latency_time = now;
+        }
+        double target = std::min(std::max(XRD_ADAPTOR_WINDOW_GAIN*m_rate*m_min_latency, static_cast<double>(XRD_ADAPTOR_MIN_WINDOW)),
+                                 static_cast<double>(XRD_ADAPTOR_MAX_WINDOW));
+        m_window = (target > m_window) ? std::min(m_window + c.getSize(), static_cast<IOSize>(target)) : static_cast<IOSize>(target);
+    }
+    if (m_window != old_window) XRD_ADAPTOR_TRACE_EVENT(SourceWindow, this, m_window, static_cast<uint64_t>(m_rate/1024));
+}
+
+bool
+Source::queueEmpty()
+{
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    return m_queue.empty();
+}
+
+bool
+Source::hasRoom()
+{
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    return m_queue.empty() && (m_inflight < m_window);
+}
+
+std::shared_ptr<ClientRequest>
+Source::takeStraggler(const timespec &now, bool &unprepared)
+{
+    long long limit = XRD_ADAPTOR_HEDGE_FACTOR*static_cast<long long>(getQuality());
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    // Requests are appended as they are issued, so the oldest come first.
+    for (const auto & c : m_outstanding)
+    {
+        if (c->m_hedged) continue;
+        long long elapsed = 1000*(now.tv_sec - c->m_issued.tv_sec) + (now.tv_nsec - c->m_issued.tv_nsec)/1000000;
+        if (elapsed <= limit) break;
+        if (!c->m_scratch)
+        {
+            unprepared = true;
+            continue;
+        }
+        c->m_hedged = true;
+        return c;
+    }
+    return std::shared_ptr<ClientRequest>();
+}
+
+void
+Source::issue(std::shared_ptr<ClientRequest> c)
+{
+    XRD_ADAPTOR_TRACE_EVENT(RequestIssued, c.get(), c->getSize(), reinterpret_cast<uintptr_t>(this));
     c->m_source = shared_from_this();
     c->m_self_reference = c;
+    MonotonicClock::now(c->m_issued);
+    {
+        std::lock_guard<std::mutex> sentry(m_mutex);
+        m_outstanding.push_back(c);
+        c->m_delivered = m_delivered;
+        // After an idle period, measure from the issue rather than the
+        // last delivery.
+        c->m_delivered_time = (m_outstanding.size() == 1) ? c->m_issued : m_delivered_time;
+        c->m_app_limited = m_queue.empty();
+    }
     m_qm->startWatch(c->m_qmw);
+    Statistics::RequestType type = c->m_probe ? Statistics::Probe :
+        (c->isSpeculative() ? Statistics::Speculative : (c->m_into ? Statistics::Read : Statistics::VectorRead));
+    m_statistics.addRequest(type, c->m_into ? 1 : c->m_iolist->size());
 #ifdef XRD_FAKE_SLOW
     if (m_slow) std::this_thread::sleep_for(std::chrono::milliseconds(XRD_DELAY));
 #endif
+    // Requests with scratch space never read directly into the client's buffers.
+    char *scratch = c->m_scratch ? &(*c->m_scratch)[0] : nullptr;
+    XrdCl::XRootDStatus status;
     if (c->m_into)
     {
         // See notes in ClientRequest definition to understand this voodoo.
-        m_fh->Read(c->m_off, c->m_size, c->m_into, c.get());
+        status = m_fh->Read(c->m_off, c->m_size, scratch ? scratch : c->m_into, c.get());
     }
     else
     {
-        XrdCl::ChunkList cl;
+        // XrdCl copies the chunk list, so the vector can be reused per thread.
+        static thread_local XrdCl::ChunkList cl;
+        cl.clear();
         cl.reserve(c->m_iolist->size());
         for (const auto & it : *c->m_iolist)
         {
-            XrdCl::ChunkInfo ci(it.offset(), it.size(), it.data());
+            void *data = it.data();
+            if (scratch)
+            {
+                data = scratch;
+                scratch += it.size();
+            }
+            XrdCl::ChunkInfo ci(it.offset(), it.size(), data);
             cl.emplace_back(ci);
         }
-        m_fh->VectorRead(cl, nullptr, c.get());
+        status = m_fh->VectorRead(cl, nullptr, c.get());
+    }
+    if (!status.IsOK())
+    {
+        // XrdCl will never invoke the handler; treat this as a failed response.
+        c->HandleResponse(new XrdCl::XRootDStatus(status), nullptr);
     }
 }
 
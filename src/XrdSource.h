@@ -1,53 +1,196 @@
 #ifndef Utilities_XrdAdaptor_XrdSource_h
 #define Utilities_XrdAdaptor_XrdSource_h
 
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #include <boost/utility.hpp>
 
-#include "QualityMetric.h"
+#include "Utilities/StorageFactory/interface/Storage.h"
 
-namespace XrdCl {
-    class File;
-}
+#include "QualityMetric.h"
+#include "XrdStatistics.h"
 
 namespace XrdAdaptor {
 
+class FileHandle;
+
 class RequestList;
 class ClientRequest;
 
 class Source : public std::enable_shared_from_this<Source>, boost::noncopyable {
 
+friend class Scheduler;
+
 public:
-    Source(timespec now, std::unique_ptr<XrdCl::File> fileHandle);
+    /**
+     * The source's statistics are also added to those of parent.
+     */
+    Source(timespec now, std::unique_ptr<FileHandle> fileHandle, std::shared_ptr<Statistics> parent);
 
     ~Source();
 
+    /**
+     * Close the file at the server; called by RequestManager::close() on
+     * the client's thread.  Requests in flight may keep the source alive
+     * until a callback thread, where it must not close the file itself.
+     */
+    void close();
+
+    /**
+     * Queue a request on this source.  The bytes outstanding at the server
+     * are limited by an adaptive window; the remainder wait in the pending
+     * queue until an earlier request completes or they are stolen.
+     *
+     * The window is sized, like BBR, at twice the bandwidth-delay product of
+     * the source: the highest recent delivery rate times the lowest recent
+     * latency.  It grows by at most the bytes delivered, so at most doubles
+     * per round trip, and is halved when a request fails.  A slow server
+     * thus keeps little in flight, and work queued behind it can be taken
+     * by a faster source.  Each request must also be admitted by the
+     * process-wide Scheduler.
+     */
     void handle(std::shared_ptr<ClientRequest>);
 
     void handle(RequestList &);
 
-    std::shared_ptr<XrdCl::File> getFileHandle();
+    /**
+     * Remove the most recently queued request which has not yet been sent to
+     * the server.  Returns an empty pointer if there is nothing to steal.
+     */
+    std::shared_ptr<ClientRequest> stealRequest();
+
+    /**
+     * Remove all requests not yet sent to the server.
+     */
+    void drainQueue(std::vector<std::shared_ptr<ClientRequest> > &requests);
+
+    /**
+     * Note the completion of an outstanding request, adjust the window, and
+     * send any queued work into the space freed.  Returns true if the source
+     * has room for more work than it has queued.
+     */
+    bool requestDone(ClientRequest *, bool success);
+
+    /**
+     * Returns true if there is no queued work waiting for this source.
+     */
+    bool queueEmpty();
+
+    /**
+     * Returns true if nothing is queued and the window is not full.
+     */
+    bool hasRoom();
+
+    /**
+     * Find the oldest outstanding request which has run for more than
+     * XRD_ADAPTOR_HEDGE_FACTOR times this source's quality metric and which
+     * may be hedged.  The request is marked as hedged before it is returned.
+     * Sets unprepared if a straggler was passed over for reading directly
+     * into the client's buffers.
+     */
+    std::shared_ptr<ClientRequest> takeStraggler(const timespec &now, bool &unprepared);
+
+    std::shared_ptr<FileHandle> getFileHandle();
 
     const std::string & ID() const {return m_id;}
 
     unsigned getQuality() {return m_qm->get();}
 
+    Statistics &statistics() {return m_statistics;}
+
     struct timespec getLastDowngrade() const {return m_lastDowngrade;}
     void setLastDowngrade(struct timespec now) {m_lastDowngrade = now;}
 
 private:
+    /**
+     * A FIFO of requests which keeps its storage once emptied; std::deque
+     * allocates a node every few pushes on a queue cycling through requests.
+     */
+    class RequestQueue {
+    public:
+        typedef std::vector<std::shared_ptr<ClientRequest> >::const_iterator const_iterator;
+
+        RequestQueue() : m_head(0) {}
+
+        bool empty() const {return m_head == m_requests.size();}
+        const std::shared_ptr<ClientRequest> &front() const {return m_requests[m_head];}
+        const std::shared_ptr<ClientRequest> &back() const {return m_requests.back();}
+        const_iterator begin() const {return m_requests.begin() + m_head;}
+        const_iterator end() const {return m_requests.end();}
+
+        void push_back(const std::shared_ptr<ClientRequest> &c)
+        {
+            // Reclaim the popped slots before the vector would grow.
+            if (m_head && (m_requests.size() == m_requests.capacity()))
+            {
+                m_requests.erase(m_requests.begin(), m_requests.begin() + m_head);
+                m_head = 0;
+            }
+            m_requests.push_back(c);
+        }
+        void pop_front() {m_requests[m_head++].reset(); if (empty()) clear();}
+        void pop_back() {m_requests.pop_back(); if (empty()) clear();}
+        void clear() {m_requests.clear(); m_head = 0;}
+
+    private:
+        std::vector<std::shared_ptr<ClientRequest> > m_requests;
+        size_t m_head;
+    };
+
     void requestCallback(/* TODO: type? */);
 
+    /**
+     * Send queued requests to the server until the in-flight window is full
+     * or the Scheduler refuses one; it calls back once there is room.
+     */
+    void dispatch();
+
+    /**
+     * Send a single request to the server.
+     */
+    void issue(std::shared_ptr<ClientRequest>);
+
+    /**
+     * Update the window for a request completed at now; must hold m_mutex.
+     */
+    void updateWindow(const ClientRequest &c, bool success, const timespec &now);
+
     struct timespec m_lastDowngrade;
     std::string m_id;
-    std::shared_ptr<XrdCl::File> m_fh;
+    std::shared_ptr<FileHandle> m_fh;
 
     std::unique_ptr<QualityMetricSource> m_qm;
+    Statistics m_statistics;
 
     std::vector<char> m_buffer;
 
+    // Requests waiting for space in the in-flight window.
+    // Protected by m_mutex, as are all the members below.
+    RequestQueue m_queue;
+    IOSize m_inflight;
+    IOSize m_window;
+    // Bytes delivered by the server, and when the last of them arrived;
+    // requests take a snapshot when issued to measure the delivery rate.
+    IOSize m_delivered;
+    timespec m_delivered_time;
+    // Recent maximum delivery rate (bytes/s) and minimum latency (s).
+    double m_rate;
+    double m_min_latency;
+    timespec m_min_latency_time;
+    // Requests sent to the server which have not yet completed.
+    std::vector<std::shared_ptr<ClientRequest> > m_outstanding;
+    bool m_closed;
+    std::mutex m_mutex;
+
+    // Protected by the Scheduler's mutex: whether this source is queued
+    // there, and whether it was woken to take its turn.  The latter is also
+    // read without the mutex, to skip yielding when it is not set.
+    bool m_sched_waiting;
+    std::atomic<bool> m_sched_woken;
+
 #ifdef XRD_FAKE_SLOW
     bool m_slow;
 #endif
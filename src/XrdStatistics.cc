@@ -0,0 +1,130 @@
+
+#include "XrdStatistics.h"
+
+using namespace XrdAdaptor;
+
+Statistics::Statistics(std::shared_ptr<Statistics> parent)
+    : m_parent(parent),
+      m_chunks(0),
+      m_bytes_read(0),
+      m_failures(0),
+      m_hedge_wins(0),
+      m_steals(0),
+      m_promotions(0),
+      m_demotions(0)
+{
+    for (auto & counter : m_requests) counter = 0;
+    for (auto & counter : m_latency) counter = 0;
+}
+
+void
+Statistics::addRequest(RequestType type, size_t chunks)
+{
+    add(m_requests[type], 1);
+    add(m_chunks, chunks);
+    if (m_parent) m_parent->addRequest(type, chunks);
+}
+
+void
+Statistics::addResponse(IOSize bytes, unsigned latency_ms)
+{
+    add(m_bytes_read, bytes);
+    unsigned bucket = 0;
+    for (unsigned remaining = latency_ms; remaining && (bucket < latency_buckets-1); remaining >>= 1)
+    {
+        bucket++;
+    }
+    add(m_latency[bucket], 1);
+    if (m_parent) m_parent->addResponse(bytes, latency_ms);
+}
+
+void
+Statistics::addFailure()
+{
+    add(m_failures, 1);
+    if (m_parent) m_parent->addFailure();
+}
+
+void
+Statistics::addHedgeWin()
+{
+    add(m_hedge_wins, 1);
+    if (m_parent) m_parent->addHedgeWin();
+}
+
+void
+Statistics::addSteal()
+{
+    add(m_steals, 1);
+    if (m_parent) m_parent->addSteal();
+}
+
+void
+Statistics::addPromotion()
+{
+    add(m_promotions, 1);
+    if (m_parent) m_parent->addPromotion();
+}
+
+void
+Statistics::addDemotion()
+{
+    add(m_demotions, 1);
+    if (m_parent) m_parent->addDemotion();
+}
+
+void
+Statistics::snapshot(Snapshot &result) const
+{
+    for (unsigned idx = 0; idx < RequestTypeCount; idx++) result.m_requests[idx] = m_requests[idx].load(std::memory_order_relaxed);
+    result.m_chunks = m_chunks.load(std::memory_order_relaxed);
+    result.m_bytes_read = m_bytes_read.load(std::memory_order_relaxed);
+    result.m_failures = m_failures.load(std::memory_order_relaxed);
+    result.m_hedge_wins = m_hedge_wins.load(std::memory_order_relaxed);
+    result.m_steals = m_steals.load(std::memory_order_relaxed);
+    result.m_promotions = m_promotions.load(std::memory_order_relaxed);
+    result.m_demotions = m_demotions.load(std::memory_order_relaxed);
+    for (unsigned idx = 0; idx < latency_buckets; idx++) result.m_latency[idx] = m_latency[idx].load(std::memory_order_relaxed);
+}
+
+unsigned long long
+Statistics::Snapshot::requests() const
+{
+    unsigned long long total = 0;
+    for (auto count : m_requests) total += count;
+    return total;
+}
+
+unsigned
+Statistics::Snapshot::latencyPercentile(double fraction) const
+{
+    unsigned long long total = 0;
+    for (auto count : m_latency) total += count;
+    if (!total) return 0;
+    unsigned long long seen = 0;
+    for (unsigned idx = 0; idx < latency_buckets; idx++)
+    {
+        seen += m_latency[idx];
+        if (seen >= fraction*total) return 1u << idx;
+    }
+    return 1u << (latency_buckets-1);
+}
+
+std::ostream &
+XrdAdaptor::operator<<(std::ostream &os, const Statistics::Snapshot &snapshot)
+{
+    os << snapshot.m_bytes_read << " bytes in "
+       << snapshot.m_requests[Statistics::Read] << " reads, "
+       << snapshot.m_requests[Statistics::VectorRead] << " vector reads ("
+       << snapshot.m_chunks << " chunks), "
+       << snapshot.m_requests[Statistics::Probe] << " probes, "
+       << snapshot.m_requests[Statistics::Speculative] << " speculative reads ("
+       << snapshot.m_hedge_wins << " won); "
+       << snapshot.m_failures << " failures, "
+       << snapshot.m_steals << " steals, "
+       << snapshot.m_promotions << " promotions, "
+       << snapshot.m_demotions << " demotions; latency p50 < "
+       << snapshot.latencyPercentile(0.5) << "ms, p99 < "
+       << snapshot.latencyPercentile(0.99) << "ms";
+    return os;
+}
@@ -0,0 +1,100 @@
+#ifndef Utilities_XrdAdaptor_XrdStatistics_h
+#define Utilities_XrdAdaptor_XrdStatistics_h
+
+#include <atomic>
+#include <memory>
+#include <ostream>
+
+#include <boost/utility.hpp>
+
+#include "Utilities/StorageFactory/interface/Storage.h"
+
+namespace XrdAdaptor {
+
+/**
+ * Counters describing the IO performed against a source or a whole file.
+ *
+ * Each Source keeps its own Statistics, whose parent is the one kept by the
+ * RequestManager; every update is applied to both, so the file totals also
+ * include sources which have since been dropped.  Updates use relaxed
+ * atomics and never lock.
+ */
+class Statistics : boost::noncopyable {
+
+public:
+    enum RequestType {
+        Read = 0,
+        VectorRead,
+        Probe,
+        Speculative,
+        RequestTypeCount
+    };
+
+    // Bucket 0 counts responses under 1ms, bucket i those in [2^(i-1), 2^i) ms;
+    // the last bucket is open-ended.
+    static const unsigned latency_buckets = 20;
+
+    /**
+     * A plain copy of the counters at some instant.
+     */
+    struct Snapshot {
+        unsigned long long m_requests[RequestTypeCount];
+        unsigned long long m_chunks;
+        unsigned long long m_bytes_read;
+        unsigned long long m_failures;
+        // Speculative reads which finished before the request they duplicated.
+        unsigned long long m_hedge_wins;
+        // Requests taken from another source's queue.
+        unsigned long long m_steals;
+        unsigned long long m_promotions;
+        unsigned long long m_demotions;
+        unsigned long long m_latency[latency_buckets];
+
+        unsigned long long requests() const;
+
+        /**
+         * Upper bound, in ms, of the latency bucket holding the given fraction
+         * of responses.
+         */
+        unsigned latencyPercentile(double fraction) const;
+    };
+
+    explicit Statistics(std::shared_ptr<Statistics> parent = std::shared_ptr<Statistics>());
+
+    void addRequest(RequestType type, size_t chunks);
+    void addResponse(IOSize bytes, unsigned latency_ms);
+    void addFailure();
+    void addHedgeWin();
+    void addSteal();
+    void addPromotion();
+    void addDemotion();
+
+    void snapshot(Snapshot &result) const;
+
+private:
+    static void add(std::atomic<unsigned long long> &counter, unsigned long long value)
+    {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    const std::shared_ptr<Statistics> m_parent;
+
+    std::atomic<unsigned long long> m_requests[RequestTypeCount];
+    std::atomic<unsigned long long> m_chunks;
+    std::atomic<unsigned long long> m_bytes_read;
+    std::atomic<unsigned long long> m_failures;
+    std::atomic<unsigned long long> m_hedge_wins;
+    std::atomic<unsigned long long> m_steals;
+    std::atomic<unsigned long long> m_promotions;
+    std::atomic<unsigned long long> m_demotions;
+    std::atomic<unsigned long long> m_latency[latency_buckets];
+};
+
+/**
+ * A one-line summary, suitable for the logs.
+ */
+std::ostream &operator<<(std::ostream &os, const Statistics::Snapshot &snapshot);
+
+}
+
+#endif
@@ -0,0 +1,81 @@
+
+// See http://stackoverflow.com/questions/12523122/what-is-glibcxx-use-nanosleep-all-about
+#define _GLIBCXX_USE_NANOSLEEP
+#include <chrono>
+
+#include "XrdTicker.h"
+
+using namespace XrdAdaptor;
+
+// Intentionally leaked, like QualityMetricFactory::m_instance: the thread
+// must never be joined from a static destructor.
+Ticker *Ticker::m_instance = nullptr;
+std::once_flag Ticker::m_once;
+const unsigned Ticker::interval_ms;
+
+Ticker &
+Ticker::instance()
+{
+    std::call_once(m_once, [](){ m_instance = new Ticker(); });
+    return *m_instance;
+}
+
+Ticker::Ticker()
+    : m_next_handle(1),
+      m_running(false),
+      m_manual(false)
+{
+}
+
+Ticker::Handle
+Ticker::add(std::function<void()> callback)
+{
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    Handle handle = m_next_handle++;
+    m_callbacks[handle] = callback;
+    if (!m_running && !m_manual)
+    {
+        m_running = true;
+        std::thread thread(&Ticker::run, this);
+        thread.detach();
+    }
+    return handle;
+}
+
+void
+Ticker::remove(Handle handle)
+{
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    m_callbacks.erase(handle);
+}
+
+void
+Ticker::setManual()
+{
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    m_manual = true;
+}
+
+void
+Ticker::tick()
+{
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    for (auto & it : m_callbacks)
+    {
+        it.second();
+    }
+}
+
+void
+Ticker::run()
+{
+    std::unique_lock<std::mutex> sentry(m_mutex);
+    while (true)
+    {
+        m_cv.wait_for(sentry, std::chrono::milliseconds(interval_ms));
+        for (auto & it : m_callbacks)
+        {
+            it.second();
+        }
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef Utilities_XrdAdaptor_XrdTicker_h
+#define Utilities_XrdAdaptor_XrdTicker_h
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <boost/utility.hpp>
+
+namespace XrdAdaptor {
+
+/**
+ * A single process-wide thread which periodically invokes registered
+ * callbacks.  Used for deadline-driven work (such as hedging straggling
+ * requests) which must happen even when no new IO or callbacks arrive.
+ */
+class Ticker : boost::noncopyable {
+
+public:
+    typedef unsigned long Handle;
+
+    static Ticker & instance();
+
+    /**
+     * Register a callback, invoked roughly every interval_ms milliseconds
+     * from the ticker thread.  The callback must not call remove().
+     */
+    Handle add(std::function<void()> callback);
+
+    /**
+     * Remove a callback.  Once this returns, the callback is guaranteed not to
+     * be running and will never be invoked again.
+     */
+    void remove(Handle);
+
+    /**
+     * Never start the ticker thread; the callbacks then run only when tick()
+     * is called.  Used by simulations, which must run them in simulated
+     * time; call before any file is opened.
+     */
+    void setManual();
+
+    /**
+     * Invoke every callback once, from the calling thread.
+     */
+    void tick();
+
+    static const unsigned interval_ms = 100;
+
+private:
+    Ticker();
+
+    void run();
+
+    std::map<Handle, std::function<void()> > m_callbacks;
+    Handle m_next_handle;
+    bool m_running;
+    bool m_manual;
+    // Held while callbacks run; remove() takes it to wait them out.
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+
+    static Ticker *m_instance;
+    static std::once_flag m_once;
+};
+
+}
+
+#endif
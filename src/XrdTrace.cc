@@ -0,0 +1,194 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "FWCore/MessageLogger/interface/MessageLogger.h"
+
+#include "XrdClock.h"
+#include "XrdTrace.h"
+
+using namespace XrdAdaptor;
+
+namespace {
+
+struct Ring {
+    explicit Ring(uint16_t thread) : m_thread(thread), m_head(0) {}
+
+    const uint16_t m_thread;
+    // Written only by the owning thread; read by dump().
+    std::atomic<uint64_t> m_head;
+    Trace::Event m_events[Trace::ring_size];
+};
+
+struct Registry {
+    std::mutex m_mutex;
+    // Rings outlive their threads so that events survive until the dump.
+    std::vector<Ring*> m_rings;
+    std::map<uint64_t, std::string> m_names;
+    std::string m_path;
+};
+
+// Intentionally leaked: rings are still written to during static destruction.
+Registry &
+registry()
+{
+    static Registry *instance = new Registry();
+    return *instance;
+}
+
+thread_local Ring *t_ring = nullptr;
+
+Ring *
+threadRing()
+{
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> sentry(reg.m_mutex);
+    Ring *ring = new Ring(static_cast<uint16_t>(reg.m_rings.size()));
+    reg.m_rings.push_back(ring);
+    return ring;
+}
+
+const char * const g_names[Trace::EventTypeCount][3] = {
+    {"RequestIssued",   "bytes",   "source"},
+    {"RequestDone",     "bytes",   "ms"},
+    {"LateResponse",    "bytes",   "source"},
+    {"ProbeIssued",     "bytes",   "quality"},
+    {"ProbeDone",       "bytes",   "quality"},
+    {"Steal",           "bytes",   "thief"},
+    {"Hedge",           "bytes",   "fast"},
+    {"Split",           "chunks",  "bytes"},
+    {"SplitPiece",      "chunks",  "bytes"},
+    {"SourceQuality",   "quality", "active"},
+    {"CheckSources",    "ms",      ""},
+    {"QualityWatch",    "ms",      ""},
+    {"VectorReadStart", "chunks",  "bytes"},
+    {"VectorReadDone",  "bytes",   ""},
+    {"Prefetch",        "ranges",  "bytes"},
+    {"ReadAheadWindow", "window",  "ms"},
+    {"SourceWindow",    "window",  "kBps"},
+    {"Parked",          "requests", "bytes"},
+    {"SchedulerWait",   "inflight", "waiting"}
+};
+
+void
+dumpAtExit()
+{
+    const std::string &path = registry().m_path;
+    if (!Trace::dump(path))
+    {
+        edm::LogWarning("XrdAdaptorInternal") << "Unable to write IO trace to " << path;
+    }
+}
+
+}
+
+namespace XrdAdaptor {
+
+struct TraceInit {
+    TraceInit()
+    {
+        const char *path = getenv("XRD_ADAPTOR_TRACE");
+        if (!path || !*path) return;
+        registry().m_path = path;
+        Trace::m_enabled.store(true, std::memory_order_relaxed);
+        atexit(&dumpAtExit);
+    }
+};
+
+}
+
+const char Trace::file_magic[8] = {'X', 'R', 'D', 'T', 'R', 'A', 'C', 'E'};
+std::atomic<bool> Trace::m_enabled(false);
+
+static TraceInit g_trace_init;
+
+void
+Trace::record(EventType type, const void *object, uint64_t arg1, uint64_t arg2)
+{
+    Ring *ring = t_ring;
+    if (!ring) ring = t_ring = threadRing();
+
+    timespec now;
+    MonotonicClock::now(now);
+    uint64_t head = ring->m_head.load(std::memory_order_relaxed);
+    Event &event = ring->m_events[head & (ring_size-1)];
+    event.m_time_ns = static_cast<uint64_t>(now.tv_sec)*1000000000ull + now.tv_nsec;
+    event.m_object = reinterpret_cast<uintptr_t>(object);
+    event.m_arg1 = arg1;
+    event.m_arg2 = arg2;
+    event.m_type = type;
+    event.m_thread = ring->m_thread;
+    event.m_reserved = 0;
+    ring->m_head.store(head+1, std::memory_order_release);
+}
+
+void
+Trace::name(const void *object, const std::string &name)
+{
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> sentry(reg.m_mutex);
+    reg.m_names[reinterpret_cast<uintptr_t>(object)] = name;
+}
+
+bool
+Trace::dump(const std::string &path)
+{
+    FILE *fp = fopen(path.c_str(), "w");
+    if (!fp) return false;
+
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> sentry(reg.m_mutex);
+    // Layout: magic, record size, name count, names, event count, events.
+    uint32_t record_size = sizeof(Event);
+    uint32_t name_count = reg.m_names.size();
+    bool ok = (fwrite(file_magic, sizeof(file_magic), 1, fp) == 1) &&
+              (fwrite(&record_size, sizeof(record_size), 1, fp) == 1) &&
+              (fwrite(&name_count, sizeof(name_count), 1, fp) == 1);
+    for (const auto & it : reg.m_names)
+    {
+        if (!ok) break;
+        uint32_t length = it.second.size();
+        ok = (fwrite(&it.first, sizeof(it.first), 1, fp) == 1) &&
+             (fwrite(&length, sizeof(length), 1, fp) == 1) &&
+             (fwrite(it.second.data(), 1, length, fp) == length);
+    }
+
+    // Snapshot the heads first; rings keep advancing while we write.
+    std::vector<uint64_t> heads;
+    heads.reserve(reg.m_rings.size());
+    uint64_t event_count = 0;
+    for (const auto & ring : reg.m_rings)
+    {
+        heads.push_back(ring->m_head.load(std::memory_order_acquire));
+        event_count += std::min<uint64_t>(heads.back(), ring_size);
+    }
+    ok = ok && (fwrite(&event_count, sizeof(event_count), 1, fp) == 1);
+    for (size_t ring_idx = 0; ok && (ring_idx < heads.size()); ring_idx++)
+    {
+        const Ring &ring = *reg.m_rings[ring_idx];
+        uint64_t head = heads[ring_idx];
+        for (uint64_t idx = head - std::min<uint64_t>(head, ring_size); ok && (idx < head); idx++)
+        {
+            ok = (fwrite(&ring.m_events[idx & (ring_size-1)], sizeof(Event), 1, fp) == 1);
+        }
+    }
+    return (fclose(fp) == 0) && ok;
+}
+
+const char *
+Trace::eventName(unsigned type)
+{
+    return (type < EventTypeCount) ? g_names[type][0] : "Unknown";
+}
+
+const char *
+Trace::argName(unsigned type, unsigned arg)
+{
+    return ((type < EventTypeCount) && (arg < 2)) ? g_names[type][arg+1] : "";
+}
@@ -0,0 +1,128 @@
+#ifndef Utilities_XrdAdaptor_XrdTrace_h
+#define Utilities_XrdAdaptor_XrdTrace_h
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+namespace XrdAdaptor {
+
+/**
+ * A binary trace of the events on the IO path.
+ *
+ * Each thread records fixed-size events into its own ring buffer; recording
+ * takes no lock and does no formatting, so it can be left on in production.
+ * When the ring fills, the oldest events are overwritten.  Recording is
+ * enabled by setting XRD_ADAPTOR_TRACE to an output path, to which the rings
+ * are written at exit; xrdadaptor_tracedump decodes the file.  Building with
+ * XRD_ADAPTOR_NO_TRACE removes the recording calls entirely.
+ */
+class Trace {
+
+public:
+    enum EventType {
+        // object: request; arg1: bytes; arg2: source.
+        RequestIssued = 0,
+        // object: request; arg1: bytes; arg2: latency in ms.
+        RequestDone,
+        // object: request; arg1: bytes; arg2: source.
+        LateResponse,
+        // object: source; arg1: bytes; arg2: quality.
+        ProbeIssued,
+        // object: source; arg1: bytes; arg2: quality.
+        ProbeDone,
+        // object: stolen-from source; arg1: bytes; arg2: thief source.
+        Steal,
+        // object: slow source; arg1: bytes; arg2: fast source.
+        Hedge,
+        // object: manager; arg1: chunks; arg2: bytes.
+        Split,
+        // object: manager; arg1: chunks; arg2: bytes, for one piece of a split.
+        SplitPiece,
+        // object: source; arg1: quality; arg2: 1 if active.
+        SourceQuality,
+        // object: manager; arg1: ms since the last check.
+        CheckSources,
+        // object: quality metric; arg1: ms.
+        QualityWatch,
+        // object: file; arg1: chunks; arg2: bytes.
+        VectorReadStart,
+        // object: file; arg1: bytes read.
+        VectorReadDone,
+        // object: manager; arg1: ranges; arg2: bytes.
+        Prefetch,
+        // object: read-ahead; arg1: new window; arg2: ms waited (0 on reset).
+        ReadAheadWindow,
+        // object: source; arg1: new in-flight window; arg2: delivery rate (kB/s).
+        SourceWindow,
+        // object: manager; arg1: requests; arg2: bytes, parked awaiting a new source.
+        Parked,
+        // object: source; arg1: bytes in flight in the process; arg2: sources already waiting.
+        SchedulerWait,
+        EventTypeCount
+    };
+
+    /**
+     * The on-disk record; 40 bytes, written in native byte order.
+     */
+    struct Event {
+        // CLOCK_MONOTONIC time of the event.
+        uint64_t m_time_ns;
+        uint64_t m_object;
+        uint64_t m_arg1;
+        uint64_t m_arg2;
+        uint16_t m_type;
+        // Small sequential number assigned when the thread first records.
+        uint16_t m_thread;
+        uint32_t m_reserved;
+    };
+
+    static const char file_magic[8];
+    // Events kept per thread; must be a power of two.
+    static const unsigned ring_size = 1 << 16;
+
+    static bool enabled() {return m_enabled.load(std::memory_order_relaxed);}
+
+    /**
+     * Append an event to the calling thread's ring.
+     */
+    static void record(EventType type, const void *object, uint64_t arg1, uint64_t arg2);
+
+    /**
+     * Associate a printable name (such as a data server) with an object
+     * appearing in events.  Takes a lock; call only on the slow path.
+     */
+    static void name(const void *object, const std::string &name);
+
+    /**
+     * Write every ring to a file.  Events recorded concurrently may be torn.
+     * Returns false on IO error.
+     */
+    static bool dump(const std::string &path);
+
+    /**
+     * Printable name of an event type and of its two arguments.
+     */
+    static const char *eventName(unsigned type);
+    static const char *argName(unsigned type, unsigned arg);
+
+private:
+    static std::atomic<bool> m_enabled;
+
+    friend struct TraceInit;
+};
+
+}
+
+#ifdef XRD_ADAPTOR_NO_TRACE
+#define XRD_ADAPTOR_TRACE_EVENT(type, object, arg1, arg2) do {} while (0)
+#define XRD_ADAPTOR_TRACE_NAME(object, label) do {} while (0)
+#else
+#define XRD_ADAPTOR_TRACE_EVENT(type, object, arg1, arg2) \
+    do { if (XrdAdaptor::Trace::enabled()) XrdAdaptor::Trace::record(XrdAdaptor::Trace::type, object, arg1, arg2); } while (0)
+#define XRD_ADAPTOR_TRACE_NAME(object, label) \
+    do { if (XrdAdaptor::Trace::enabled()) XrdAdaptor::Trace::name(object, label); } while (0)
+#endif
+
+#endif
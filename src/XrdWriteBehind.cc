@@ -0,0 +1,179 @@
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "FWCore/MessageLogger/interface/MessageLogger.h"
+
+#include "XrdFileHandle.h"
+#include "XrdRequestManager.h"
+#include "XrdWriteBehind.h"
+
+using namespace XrdAdaptor;
+
+class WriteBehind::Handler : public XrdCl::ResponseHandler {
+
+public:
+    Handler(WriteBehind &parent, Block *block) : m_parent(parent), m_block(block) {}
+
+    virtual void HandleResponse(XrdCl::XRootDStatus *stat, XrdCl::AnyObject *resp) override
+    {
+        std::unique_ptr<XrdCl::AnyObject> response(resp);
+        std::unique_ptr<XrdCl::XRootDStatus> status(stat);
+        m_parent.done(m_block, *status);
+        delete this;
+    }
+
+private:
+    WriteBehind &m_parent;
+    Block *m_block;
+};
+
+WriteBehind::WriteBehind(RequestManager &manager, IOSize block_size, IOSize max_bytes)
+    : m_manager(manager),
+      m_block_size(block_size),
+      // At least one block must fit, or no write could ever proceed.
+      m_max_bytes(std::max(max_bytes, block_size)),
+      m_bytes(0),
+      m_reported(true)
+{
+}
+
+WriteBehind::~WriteBehind()
+{
+    // Outstanding writes refer to us; we must not go away early.
+    XrdCl::XRootDStatus status = flush();
+    if (!status.IsOK() && !m_reported)
+    {
+        edm::LogWarning("XrdAdaptorInternal") << "Buffered write to " << m_manager.getFilename()
+          << " failed with error '" << status.ToString() << "' (errno=" << status.errNo
+          << ", code=" << status.code << "); the data was lost.";
+    }
+}
+
+XrdCl::XRootDStatus
+WriteBehind::write(const void *from, IOSize n, IOOffset pos)
+{
+    std::unique_lock<std::mutex> sentry(m_mutex);
+    if (!m_status.IsOK())
+    {
+        m_reported = true;
+        return m_status;
+    }
+    const char *data = static_cast<const char *>(from);
+    while (n)
+    {
+        if (m_current && (pos != m_current->m_off + static_cast<IOOffset>(m_current->m_size))) issue(sentry);
+        if (!m_current)
+        {
+            m_current = acquire(sentry);
+            m_current->m_off = pos;
+            m_current->m_size = 0;
+            // Blocks end on a multiple of the block size in the file.
+            m_current->m_capacity = m_block_size - pos % m_block_size;
+        }
+        IOSize length = std::min(n, m_current->m_capacity - m_current->m_size);
+        memcpy(&m_current->m_data[m_current->m_size], data, length);
+        m_current->m_size += length;
+        data += length;
+        pos += length;
+        n -= length;
+        if (m_current->m_size == m_current->m_capacity) issue(sentry);
+    }
+    return XrdCl::XRootDStatus();
+}
+
+XrdCl::XRootDStatus
+WriteBehind::flush()
+{
+    std::unique_lock<std::mutex> sentry(m_mutex);
+    issue(sentry);
+    while (!m_inflight.empty()) m_cv.wait(sentry);
+    if (!m_status.IsOK()) m_reported = true;
+    return m_status;
+}
+
+void
+WriteBehind::discard()
+{
+    std::unique_lock<std::mutex> sentry(m_mutex);
+    if (m_current)
+    {
+        m_free.emplace_back(std::move(m_current));
+        m_bytes -= m_block_size;
+    }
+    // Their handlers refer to us.
+    while (!m_inflight.empty()) m_cv.wait(sentry);
+    m_reported = true;
+}
+
+bool
+WriteBehind::pending() const
+{
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    return m_current || !m_inflight.empty();
+}
+
+std::unique_ptr<WriteBehind::Block>
+WriteBehind::acquire(std::unique_lock<std::mutex> &sentry)
+{
+    while ((m_bytes + m_block_size > m_max_bytes) && !m_inflight.empty()) m_cv.wait(sentry);
+    m_bytes += m_block_size;
+    if (m_free.empty())
+    {
+        std::unique_ptr<Block> block(new Block());
+        block->m_data.reset(new char[m_block_size]);
+        return block;
+    }
+    std::unique_ptr<Block> block = std::move(m_free.back());
+    m_free.pop_back();
+    return block;
+}
+
+void
+WriteBehind::waitForOverlap(std::unique_lock<std::mutex> &sentry, IOOffset off, IOSize size)
+{
+    // Writes in flight may complete in any order; a rewrite of the same
+    // range must not race the original.
+    auto overlaps = [off, size](const Block *block) {
+        return (block->m_off < off + static_cast<IOOffset>(size)) && (off < block->m_off + static_cast<IOOffset>(block->m_size));
+    };
+    while (std::any_of(m_inflight.begin(), m_inflight.end(), overlaps)) m_cv.wait(sentry);
+}
+
+void
+WriteBehind::issue(std::unique_lock<std::mutex> &sentry)
+{
+    if (!m_current) return;
+    Block *block = m_current.release();
+    waitForOverlap(sentry, block->m_off, block->m_size);
+    block->m_file = m_manager.getActiveFile();
+    m_inflight.push_back(block);
+
+    // The response may be delivered before Write returns.
+    sentry.unlock();
+    Handler *handler = new Handler(*this, block);
+    XrdCl::XRootDStatus status = block->m_file->Write(block->m_off, block->m_size, block->m_data.get(), handler);
+    if (!status.IsOK())
+    {
+        delete handler;
+        done(block, status);
+    }
+    sentry.lock();
+}
+
+void
+WriteBehind::done(Block *block, const XrdCl::XRootDStatus &status)
+{
+    std::lock_guard<std::mutex> sentry(m_mutex);
+    if (!status.IsOK() && m_status.IsOK())
+    {
+        m_status = status;
+        m_reported = false;
+    }
+    m_inflight.erase(std::find(m_inflight.begin(), m_inflight.end(), block));
+    block->m_file.reset();
+    m_free.emplace_back(block);
+    m_bytes -= m_block_size;
+    m_cv.notify_all();
+}
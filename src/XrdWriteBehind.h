@@ -0,0 +1,112 @@
+#ifndef Utilities_XrdAdaptor_XrdWriteBehind_h
+#define Utilities_XrdAdaptor_XrdWriteBehind_h
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <boost/utility.hpp>
+
+#include "XrdCl/XrdClFile.hh"
+
+#include "Utilities/StorageFactory/interface/Storage.h"
+
+namespace XrdAdaptor {
+
+class FileHandle;
+class RequestManager;
+
+/**
+ * Gathers writes into large blocks which are sent asynchronously, with
+ * several in flight at once.
+ *
+ * Consecutive writes are copied into a block until it reaches a multiple
+ * of the block size in the file; a write elsewhere in the file sends the
+ * partial block first.  The memory held by blocks being filled or in
+ * flight is capped; a write which would exceed the cap waits for earlier
+ * blocks to complete.
+ *
+ * A failed write cannot be reported to the call which made it, so the first
+ * failure is kept and returned by every later write and flush.
+ */
+class WriteBehind : boost::noncopyable {
+
+public:
+    WriteBehind(RequestManager &manager, IOSize block_size, IOSize max_bytes);
+
+    /**
+     * Waits for all outstanding writes; unreported failures are logged.
+     */
+    ~WriteBehind();
+
+    /**
+     * Copy the data and queue it to be written at pos.  Returns the first
+     * failure of any earlier write, in which case nothing is queued.
+     */
+    XrdCl::XRootDStatus write(const void *from, IOSize n, IOOffset pos);
+
+    /**
+     * Send any partial block and wait for all outstanding writes.
+     */
+    XrdCl::XRootDStatus flush();
+
+    /**
+     * Drop the data not yet sent, and wait for the writes already in
+     * flight; their failures are not reported.  For a file being aborted.
+     */
+    void discard();
+
+    /**
+     * True if any data is buffered or being written.
+     */
+    bool pending() const;
+
+private:
+    struct Block {
+        std::unique_ptr<char[]> m_data;
+        IOOffset m_off;
+        IOSize m_size;
+        IOSize m_capacity;
+        // Keeps the file open until the write completes.
+        std::shared_ptr<FileHandle> m_file;
+    };
+
+    class Handler;
+
+    /**
+     * Get an empty block, waiting for memory if needed; must hold m_mutex.
+     */
+    std::unique_ptr<Block> acquire(std::unique_lock<std::mutex> &sentry);
+
+    /**
+     * Send the current block, if any; must hold m_mutex, which is released
+     * while the write is sent.
+     */
+    void issue(std::unique_lock<std::mutex> &sentry);
+
+    /**
+     * Wait until no in-flight block overlaps [off, off+size); must hold m_mutex.
+     */
+    void waitForOverlap(std::unique_lock<std::mutex> &sentry, IOOffset off, IOSize size);
+
+    void done(Block *block, const XrdCl::XRootDStatus &status);
+
+    RequestManager &m_manager;
+    const IOSize m_block_size;
+    const IOSize m_max_bytes;
+
+    std::unique_ptr<Block> m_current;
+    std::vector<Block*> m_inflight;
+    std::vector<std::unique_ptr<Block> > m_free;
+    // Memory held by the current and in-flight blocks.
+    IOSize m_bytes;
+    XrdCl::XRootDStatus m_status;
+    bool m_reported;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+};
+
+}
+
+#endif
@@ -0,0 +1,499 @@
+/*
+ * Checks the failure paths of XrdFile against simulated servers (see
+ * XrdMockBackend.h): responses which arrive after the file is closed, and
+ * sources which fail while the file is open.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Utilities/XrdAdaptor/src/QualityMetric.h"
+#include "Utilities/XrdAdaptor/src/XrdFile.h"
+#include "Utilities/XrdAdaptor/src/XrdPrefetchCache.h"
+#include "Utilities/XrdAdaptor/src/XrdRecorder.h"
+#include "Utilities/XrdAdaptor/src/XrdRequestManager.h"
+#include "Utilities/XrdAdaptor/bin/XrdMockBackend.h"
+
+using namespace XrdAdaptor;
+
+namespace {
+
+  const IOSize kFileSize = 16*1024*1024;
+  const IOSize kReadSize = 256*1024;
+
+  unsigned g_failures = 0;
+
+#define CHECK(condition) \
+  do { if (!(condition)) { std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; g_failures++; } } while (0)
+
+  // A scratch file whose every byte is determined by its offset.
+  class TestFile {
+  public:
+    TestFile()
+    {
+      char path[] = "/tmp/testXrdAdaptorFailures.XXXXXX";
+      int fd = mkstemp(path);
+      m_path = path;
+      std::vector<unsigned char> data(kFileSize);
+      for (IOSize idx = 0; idx < kFileSize; idx++) data[idx] = static_cast<unsigned char>(idx % 251);
+      if ((fd == -1) || (write(fd, &data[0], kFileSize) != static_cast<ssize_t>(kFileSize)))
+      {
+        std::cerr << "Unable to create " << m_path << std::endl;
+        exit(1);
+      }
+      close(fd);
+    }
+    ~TestFile() {unlink(m_path.c_str());}
+    std::string url() const {return "root://mock/" + m_path;}
+    const std::string &path() const {return m_path;}
+  private:
+    std::string m_path;
+  };
+
+  std::vector<Mock::ServerConfig>
+  servers(const std::string &spec)
+  {
+    std::vector<Mock::ServerConfig> result;
+    std::string error;
+    if (!Mock::parseServers(spec, result, error))
+    {
+      std::cerr << "Invalid servers: " << error << std::endl;
+      exit(1);
+    }
+    return result;
+  }
+
+  // Every future must be ready, with a value or an exception, by the deadline.
+  void
+  checkSettled(std::vector<std::future<IOSize> > &futures, std::chrono::seconds timeout)
+  {
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+    for (auto & future : futures)
+    {
+      CHECK(future.wait_until(deadline) == std::future_status::ready);
+    }
+  }
+
+  /**
+   * Close the file, or destroy it without closing, while reads are queued
+   * and in flight at a slow and a fast server; the responses, and any
+   * speculative copies, arrive after the file is gone.
+   */
+  void
+  testCloseInFlight(const TestFile &data, std::function<void(XrdFile &)> finish)
+  {
+    Mock::Backend backend(servers("fast:latency=5,bandwidth=50;slow:latency=300,jitter=200,bandwidth=5"), 1);
+    backend.install();
+    std::vector<char> buffer(kFileSize);
+    std::vector<std::future<IOSize> > futures;
+    {
+      XrdFile file(data.url());
+      // Let the slow replica open as well.
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      for (IOSize offset = 0; offset + kReadSize <= kFileSize; offset += kReadSize)
+      {
+        futures.push_back(file.readAsync(&buffer[offset], kReadSize, offset));
+      }
+      finish(file);
+    }
+    checkSettled(futures, std::chrono::seconds(10));
+    backend.drain();
+  }
+
+  /**
+   * The only source goes down while reads are in flight, and more reads
+   * are issued while the replacement, at a slower server, is opening; all
+   * of them complete from the replacement.
+   */
+  void
+  testFailover(const TestFile &data)
+  {
+    Mock::Backend backend(servers("a:latency=5,down_after=0.5;b:latency=300"), 1);
+    backend.install();
+    std::vector<unsigned char> buffer(kFileSize);
+    std::vector<std::future<IOSize> > futures;
+    {
+      XrdFile file(data.url());
+      std::this_thread::sleep_for(std::chrono::milliseconds(600));
+      for (IOSize offset = 0; offset + kReadSize <= kFileSize; offset += kReadSize)
+      {
+        futures.push_back(file.readAsync(&buffer[offset], kReadSize, offset));
+        // Spread the reads over the failure and the open which follows it.
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      }
+      checkSettled(futures, std::chrono::seconds(10));
+      for (auto & future : futures)
+      {
+        try
+        {
+          CHECK(future.get() == kReadSize);
+        }
+        catch (cms::Exception &ex)
+        {
+          std::cerr << "Read failed: " << ex.what() << std::endl;
+          CHECK(false);
+        }
+      }
+      bool correct = true;
+      for (IOSize idx = 0; idx < kFileSize; idx++) correct &= (buffer[idx] == idx % 251);
+      CHECK(correct);
+      file.close();
+    }
+    backend.drain();
+  }
+
+  /**
+   * Every server goes down, so the open of a replacement fails at once;
+   * reads fail promptly rather than waiting out the parked timeout, both
+   * the ones which were in flight and those issued afterwards.
+   */
+  void
+  testNoReplacement(const TestFile &data)
+  {
+    Mock::Backend backend(servers("c:latency=5,down_after=0.5;d:latency=5,down_after=0.5"), 1);
+    backend.install();
+    std::vector<char> buffer(kReadSize);
+    {
+      XrdFile file(data.url());
+      std::this_thread::sleep_for(std::chrono::milliseconds(600));
+      for (unsigned attempt = 0; attempt < 3; attempt++)
+      {
+        std::vector<std::future<IOSize> > futures;
+        futures.push_back(file.readAsync(&buffer[0], kReadSize, 0));
+        checkSettled(futures, std::chrono::seconds(5));
+        bool failed = false;
+        try
+        {
+          futures[0].get();
+        }
+        catch (cms::Exception &)
+        {
+          failed = true;
+        }
+        CHECK(failed);
+      }
+      file.close();
+    }
+    backend.drain();
+  }
+
+  /**
+   * Reads must see buffered writes, including reads which would otherwise
+   * be served from blocks read ahead.
+   */
+  void
+  testReadYourWrites()
+  {
+    TestFile data;
+    Mock::Backend backend(servers("a:latency=5"), 1);
+    backend.install();
+    const IOSize kChunk = 64*1024;
+    std::vector<unsigned char> buffer(kChunk);
+    {
+      XrdFile file(data.url(), IOFlags::OpenRead | IOFlags::OpenWrite);
+      // Read sequentially until the file is being read ahead.
+      IOOffset offset = 0;
+      for (unsigned idx = 0; idx < 4; idx++, offset += kChunk) file.read(&buffer[0], kChunk, offset);
+      std::vector<unsigned char> written(kChunk, 0xff);
+      file.write(&written[0], kChunk, offset + kChunk);
+      for (unsigned idx = 0; idx < 2; idx++, offset += kChunk)
+      {
+        CHECK(file.read(&buffer[0], kChunk, offset) == kChunk);
+        bool correct = true;
+        for (IOSize pos = 0; pos < kChunk; pos++) correct &= (buffer[pos] == (idx ? 0xff : (offset + pos) % 251));
+        CHECK(correct);
+      }
+      file.close();
+    }
+    backend.drain();
+  }
+
+  /**
+   * Aborting a file drops its buffered writes instead of sending them.
+   */
+  void
+  testAbortDiscardsWrites()
+  {
+    TestFile data;
+    Mock::Backend backend(servers("a:latency=5"), 1);
+    backend.install();
+    const IOSize kChunk = 64*1024;
+    {
+      XrdFile file(data.url(), IOFlags::OpenRead | IOFlags::OpenWrite);
+      std::vector<unsigned char> written(kChunk, 0xff);
+      file.write(&written[0], kChunk, 0);
+      file.abort();
+    }
+    backend.drain();
+    std::vector<unsigned char> buffer(kChunk);
+    int fd = open(data.path().c_str(), O_RDONLY);
+    CHECK(pread(fd, &buffer[0], kChunk, 0) == static_cast<ssize_t>(kChunk));
+    close(fd);
+    bool unchanged = true;
+    for (IOSize pos = 0; pos < kChunk; pos++) unchanged &= (buffer[pos] == pos % 251);
+    CHECK(unchanged);
+  }
+
+  /**
+   * A file which grows after it is opened can be read past its size at
+   * open.
+   */
+  void
+  testGrowingFile()
+  {
+    TestFile data;
+    Mock::Backend backend(servers("a:latency=5"), 1);
+    backend.install();
+    const IOSize kChunk = 64*1024;
+    std::vector<unsigned char> buffer(2*kChunk);
+    {
+      XrdFile file(data.url());
+      std::vector<unsigned char> appended(kChunk, 0xff);
+      int fd = open(data.path().c_str(), O_WRONLY | O_APPEND);
+      CHECK(write(fd, &appended[0], kChunk) == static_cast<ssize_t>(kChunk));
+      close(fd);
+      CHECK(file.read(&buffer[0], 2*kChunk, kFileSize - kChunk) == 2*kChunk);
+      bool correct = true;
+      for (IOSize pos = 0; pos < kChunk; pos++) correct &= (buffer[pos] == (kFileSize - kChunk + pos) % 251) && (buffer[kChunk + pos] == 0xff);
+      CHECK(correct);
+      // A non-blocking read does not Stat the file, but still sees it grow.
+      std::vector<unsigned char> tail(4*kChunk);
+      CHECK(file.readAsync(&tail[0], 4*kChunk, kFileSize).get() == kChunk);
+      CHECK(tail[0] == 0xff && tail[kChunk - 1] == 0xff);
+      // Reads wholly past the end still return nothing.
+      CHECK(file.read(&buffer[0], kChunk, kFileSize + kChunk) == 0);
+      file.close();
+    }
+    backend.drain();
+  }
+
+  /**
+   * A vector read of a single chunk crossing the end of the file is served
+   * as a plain read, and comes up short rather than failing.
+   */
+  void
+  testShortSingleChunkReadv()
+  {
+    TestFile data;
+    Mock::Backend backend(servers("a:latency=5"), 1);
+    backend.install();
+    const IOSize kChunk = 4096;
+    const IOSize kTail = 1000;
+    std::vector<unsigned char> buffer(kChunk);
+    {
+      XrdFile file(data.url());
+      IOPosBuffer chunk(kFileSize - kTail, &buffer[0], kChunk);
+      CHECK(file.readv(&chunk, 1) == kTail);
+      bool correct = true;
+      for (IOSize pos = 0; pos < kTail; pos++) correct &= (buffer[pos] == (kFileSize - kTail + pos) % 251);
+      CHECK(correct);
+      file.close();
+    }
+    backend.drain();
+  }
+
+  /**
+   * Prefetched ranges are served from any block covering them, including
+   * one inserted after a smaller block starting later; ranges which were not
+   * prefetched, or whose block was evicted, miss.  Evicting a block whose
+   * read is still in flight does not wait for it, but its memory is only
+   * reused once the read completes.
+   */
+  void
+  testPrefetchCache(const TestFile &data)
+  {
+    Mock::Backend backend(servers("a:latency=300"), 1);
+    backend.install();
+    const IOSize kBlock = 64*1024;
+    std::shared_ptr<RequestManager> manager = RequestManager::getInstance(data.url(), XrdCl::OpenFlags::Read, XrdCl::Access::None);
+    {
+      PrefetchCache cache(*manager, 8*kBlock);
+      std::vector<char> buffer(kBlock);
+      IOSize result = 0;
+      auto correct = [&buffer](IOOffset offset, IOSize size) {
+        for (IOSize idx = 0; idx < size; idx++)
+        {
+          if (static_cast<unsigned char>(buffer[idx]) != (offset + idx) % 251) return false;
+        }
+        return true;
+      };
+      auto range = [&buffer](IOOffset offset, IOSize size) {return IOPosBuffer(offset, &buffer[0], size);};
+
+      IOPosBuffer small = range(kBlock, 100);
+      IOPosBuffer large = range(0, 4*kBlock);
+      CHECK(cache.prefetch(&small, 1));
+      CHECK(cache.prefetch(&large, 1));
+      // Already covered by the large block.
+      IOPosBuffer covered = range(2*kBlock, kBlock);
+      CHECK(!cache.prefetch(&covered, 1));
+      // Still in flight: a miss unless the read may wait.
+      CHECK(!cache.read(&buffer[0], kBlock, 2*kBlock, result, false));
+      CHECK(cache.read(&buffer[0], kBlock, 2*kBlock, result) && (result == kBlock) && correct(2*kBlock, kBlock));
+      CHECK(cache.read(&buffer[0], kBlock, 2*kBlock, result, false));
+      CHECK(!cache.read(&buffer[0], kBlock, 5*kBlock, result));
+
+      // Fill the cache with reads still in flight, evicting the first two.
+      IOPosBuffer more[] = {range(8*kBlock, 4*kBlock), range(12*kBlock, 4*kBlock)};
+      CHECK(cache.prefetch(more, 2));
+      CHECK(!cache.read(&buffer[0], kBlock, 2*kBlock, result));
+      // Evicting the in-flight blocks frees nothing yet, so this is skipped.
+      IOPosBuffer last = range(16*kBlock, 4*kBlock);
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      CHECK(!cache.prefetch(&last, 1));
+      CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(150));
+      CHECK(!cache.read(&buffer[0], kBlock, 8*kBlock, result));
+      // Once those reads complete, their memory is reused.
+      std::this_thread::sleep_for(std::chrono::milliseconds(600));
+      CHECK(cache.prefetch(&last, 1));
+      CHECK(cache.read(&buffer[0], kBlock, 17*kBlock, result) && correct(17*kBlock, kBlock));
+    }
+    manager->close();
+    backend.drain();
+  }
+
+  /**
+   * A server which recently failed for another file is not opened while
+   * another server has the file; when no other has, it is opened anyway.
+   */
+  void
+  testBadServerAvoided(const TestFile &data)
+  {
+    Mock::Backend backend(servers("a:latency=5;b:latency=5"), 1);
+    backend.install();
+    ServerHealth::reportFailure("a:1094");
+    // Through the redirector, and by locating the replicas.
+    for (const char *locate : {"0", "2"})
+    {
+      setenv("XRD_ADAPTOR_LOCATE_SOURCES", locate, 1);
+      XrdFile file(data.url());
+      Statistics::Snapshot total;
+      std::vector<std::pair<std::string, Statistics::Snapshot> > sources;
+      file.getStatistics(total, sources);
+      CHECK(sources.size() == 1);
+      CHECK(!sources.empty() && (sources[0].first == "b:1094"));
+      file.close();
+    }
+    setenv("XRD_ADAPTOR_LOCATE_SOURCES", "0", 1);
+    ServerHealth::reportFailure("b:1094");
+    {
+      XrdFile file(data.url());
+      char byte;
+      CHECK(file.read(&byte, 1, 0) == 1);
+      file.close();
+    }
+    backend.drain();
+  }
+
+  /**
+   * Asynchronous reads are recorded once they complete, with their result
+   * and latency.
+   */
+  void
+  testRecordsAsyncCompletion(const std::string &recording)
+  {
+    TestFile data;
+    Mock::Backend backend(servers("a:latency=50"), 1);
+    backend.install();
+    const IOSize kChunk = 4096;
+    const IOOffset kReadOffset = 3*kReadSize + 17;
+    const IOOffset kVectorOffset = 5*kReadSize + 17;
+    std::vector<char> buffer(3*kChunk);
+    {
+      XrdFile file(data.url());
+      CHECK(file.readAsync(&buffer[0], kChunk, kReadOffset).get() == kChunk);
+      std::vector<IOPosBuffer> chunks;
+      chunks.push_back(IOPosBuffer(kVectorOffset, &buffer[kChunk], kChunk));
+      chunks.push_back(IOPosBuffer(kVectorOffset + 2*kChunk, &buffer[2*kChunk], kChunk));
+      std::future<IOSize> future = file.readvAsync(&chunks[0], chunks.size());
+      // The chunk list need not outlive the call.
+      chunks.clear();
+      CHECK(future.get() == 2*kChunk);
+      file.close();
+    }
+    backend.drain();
+
+    unsigned found = 0;
+    FILE *fp = fopen(recording.c_str(), "r");
+    CHECK(fp);
+    if (!fp) return;
+    char magic[sizeof(Recorder::file_magic)];
+    CHECK((fread(magic, sizeof(magic), 1, fp) == 1) && !memcmp(magic, Recorder::file_magic, sizeof(magic)));
+    Recorder::Record record;
+    while (fread(&record, sizeof(record), 1, fp) == 1)
+    {
+      std::vector<Recorder::Chunk> chunks;
+      bool named = (record.m_type == Recorder::Open) || (record.m_type == Recorder::SourceName);
+      if (!named && record.m_count)
+      {
+        chunks.resize(record.m_count);
+        if (fread(&chunks[0], sizeof(Recorder::Chunk), record.m_count, fp) != record.m_count) break;
+      }
+      if (fseek(fp, (named ? record.m_count : 0) + record.m_sources*sizeof(uint16_t), SEEK_CUR)) break;
+      if (!(record.m_flags & Recorder::Async)) continue;
+      bool ours = (record.m_type == Recorder::Read) ? (record.m_offset == static_cast<uint64_t>(kReadOffset))
+        : ((record.m_type == Recorder::VectorRead) && (chunks.size() == 2) && (chunks[0].m_offset == static_cast<uint64_t>(kVectorOffset)));
+      if (!ours) continue;
+      found++;
+      CHECK(!(record.m_flags & Recorder::Failed));
+      CHECK(record.m_result == record.m_size);
+      CHECK(record.m_latency_us >= 40000);
+    }
+    fclose(fp);
+    CHECK(found == 2);
+  }
+
+}
+
+int
+main()
+{
+  TestFile data;
+  // Record the IO of every test; the recorder starts with the first file.
+  char recording[] = "/tmp/testXrdAdaptorFailures.rec.XXXXXX";
+  close(mkstemp(recording));
+  setenv("XRD_ADAPTOR_RECORD", recording, 1);
+
+  // Open both servers, so that reads are split and hedged between them.
+  setenv("XRD_ADAPTOR_LOCATE_SOURCES", "2", 1);
+  testCloseInFlight(data, [](XrdFile &file) {file.close();});
+  testCloseInFlight(data, [](XrdFile &file) {file.abort();});
+  testCloseInFlight(data, [](XrdFile &) {});
+
+  // Open a single source through the redirector.
+  setenv("XRD_ADAPTOR_LOCATE_SOURCES", "0", 1);
+  testFailover(data);
+  testNoReplacement(data);
+  // Read-ahead and write-behind are off by default.
+  setenv("XRD_ADAPTOR_READAHEAD_MAX_BYTES", "8388608", 1);
+  setenv("XRD_ADAPTOR_WRITE_BEHIND_BYTES", "16777216", 1);
+  testReadYourWrites();
+  unsetenv("XRD_ADAPTOR_READAHEAD_MAX_BYTES");
+  testAbortDiscardsWrites();
+  unsetenv("XRD_ADAPTOR_WRITE_BEHIND_BYTES");
+  testGrowingFile();
+  testShortSingleChunkReadv();
+  testRecordsAsyncCompletion(recording);
+  testPrefetchCache(data);
+  // Servers reported bad stay bad for the rest of the process.
+  testBadServerAvoided(data);
+  unlink(recording);
+
+  if (g_failures)
+  {
+    std::cerr << g_failures << " checks failed" << std::endl;
+    return 1;
+  }
+  std::cout << "All checks passed" << std::endl;
+  return 0;
+}